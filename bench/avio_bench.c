@@ -0,0 +1,121 @@
+#define _GNU_SOURCE
+#include "avio_file.h"
+#include "bench_util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Copies a scratch file through each I/O backend the splitter can use and
+// prints one JSON object per run with the throughput and the read/write
+// syscalls it took (from /proc/self/io, Linux only).
+
+#define DEFAULT_SIZE_MB 512
+#define COPY_CHUNK (256 << 10)  // what a muxer typically hands avio_write() per packet burst
+
+typedef struct {
+    const char *name;
+    AvioFileOptions io;
+    int preallocate;
+} Backend;
+
+static int write_scratch_file(const char *path, int64_t size) {
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    char *block = malloc(1 << 20);
+    if (!block) {
+        fclose(f);
+        return -1;
+    }
+    for (int i = 0; i < (1 << 20); i++) {
+        block[i] = (char)(i * 131 + 7);
+    }
+    for (int64_t written = 0; written < size; written += 1 << 20) {
+        fwrite(block, 1, 1 << 20, f);
+    }
+    free(block);
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+static int run_backend(const Backend *backend, const char *input, const char *output, int64_t size) {
+    AVIOContext *in = NULL, *out = NULL;
+    unsigned char *chunk = malloc(COPY_CHUNK);
+    IoCounters before, after;
+    int64_t copied = 0;
+
+    if (!chunk) {
+        return AVERROR(ENOMEM);
+    }
+
+    bench_read_io_counters(&before);
+    double start = bench_now();
+
+    int ret = avio_file_open(&in, input, AVIO_FLAG_READ, &backend->io, 0);
+    if (ret >= 0) {
+        ret = avio_file_open(&out, output, AVIO_FLAG_WRITE, &backend->io, backend->preallocate ? size : 0);
+    }
+    while (ret >= 0) {
+        int n = avio_read(in, chunk, COPY_CHUNK);
+        if (n <= 0) {
+            break;
+        }
+        avio_write(out, chunk, n);
+        copied += n;
+    }
+    if (out) {
+        int close_ret = avio_file_close(&out);
+        if (ret >= 0) {
+            ret = close_ret;
+        }
+    }
+    avio_file_close(&in);
+
+    double seconds = bench_now() - start;
+    bench_read_io_counters(&after);
+    free(chunk);
+    unlink(output);
+
+    if (ret < 0) {
+        fprintf(stderr, "%s: copy failed (%d)\n", backend->name, ret);
+        return ret;
+    }
+    printf("{\"backend\": \"%s\", \"buffer_size\": %d, \"mmap\": %d, \"preallocate\": %d, "
+           "\"bytes\": %lld, \"seconds\": %.3f, \"mb_per_s\": %.1f, \"syscr\": %lld, \"syscw\": %lld}\n",
+           backend->name, backend->io.buffer_size, backend->io.use_mmap, backend->preallocate,
+           (long long)copied, seconds, seconds > 0 ? copied / seconds / (1 << 20) : 0.0,
+           after.syscr - before.syscr, after.syscw - before.syscw);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    const char *dir = argc > 1 ? argv[1] : ".";
+    int64_t size = (int64_t)(argc > 2 ? atoi(argv[2]) : DEFAULT_SIZE_MB) << 20;
+    char input[1024], output[1024];
+
+    snprintf(input, sizeof(input), "%s/avio_bench_input.bin", dir);
+    snprintf(output, sizeof(output), "%s/avio_bench_output.bin", dir);
+
+    const Backend backends[] = {
+        { "avio_open",      { .buffer_size = 0 },                       0 },
+        { "custom_64k",     { .buffer_size = 64 << 10 },                0 },
+        { "custom_4m",      { .buffer_size = 4 << 20 },                 1 },
+        { "custom_4m_mmap", { .buffer_size = 4 << 20, .use_mmap = 1 },  1 },
+    };
+
+    if (write_scratch_file(input, size) < 0) {
+        return 1;
+    }
+
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+        if (run_backend(&backends[i], input, output, size) < 0) {
+            failed = 1;
+        }
+    }
+
+    unlink(input);
+    return failed;
+}
@@ -0,0 +1,222 @@
+#define _GNU_SOURCE
+#include "bench_util.h"
+#include "keyframe_index.h"
+#include "probe.h"
+#include "synth.h"
+#include "video_splitter.h"
+#include <getopt.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Generates a synthetic input, splits it and prints one JSON object per run:
+// how long planning (probe + plan) and executing took, throughput, the RSS
+// the run started from and peaked at, and the syscalls and bytes it cost.
+
+static void usage(const char *program) {
+    printf("Usage: %s [options]\n"
+           "\n"
+           "  --container C        mp4, mkv (default) or ts\n"
+           "  --duration SECONDS   length of the synthetic input (default 600)\n"
+           "  --bitrate BPS        video bit rate (default 8000000)\n"
+           "  --gop FRAMES         frames per GOP (default 60)\n"
+           "  --parts N            parts to split into (default 4)\n"
+           "  --mode MODE          single-pass (default), per-part or parallel\n"
+           "  --jobs N             workers for the parallel mode\n"
+           "  --keyframe-index     snap cuts to keyframes\n"
+           "  --repeat N           runs over the same input (default 3)\n"
+           "  --dir DIR            where the input and parts go (default .)\n"
+           "  --keep               leave the input and the last run's parts behind\n",
+           program);
+}
+
+static const char *mode_name(SplitMode mode) {
+    switch (mode) {
+    case SPLIT_MODE_PER_PART:
+        return "per-part";
+    case SPLIT_MODE_PARALLEL:
+        return "parallel";
+    default:
+        return "single-pass";
+    }
+}
+
+static void remove_parts(const SplitPlan *plan) {
+    for (int i = 0; i < plan->total_parts; i++) {
+        remove(plan->parts[i].output_filename);
+    }
+}
+
+static int run_once(const char *input, const SynthOptions *synth, const SynthResult *generated,
+                    int parts, SplitOptions *options, int run, int keep) {
+    IoCounters before, after;
+    SplitPlan *plan = NULL;
+    double part_duration = synth->duration / parts;
+
+    // Every run pays for its own probe
+    media_probe_cache_clear();
+
+    // The peak is the run's own, not the generator's or an earlier run's.
+    // Without a reset it is the process's, and only the first run's means much.
+    int peak_reset = bench_reset_peak_rss() >= 0;
+    long base_rss_kb = bench_rss_kb();
+    bench_read_io_counters(&before);
+    double start = bench_now();
+    int ret = split_plan_create(input, part_duration, part_duration / 2, options, &plan);
+    double planned = bench_now();
+    if (ret >= 0) {
+        ret = split_plan_execute(plan, options);
+    }
+    double finished = bench_now();
+    bench_read_io_counters(&after);
+
+    double execute_seconds = finished - planned;
+    printf("{\"run\": %d, \"container\": \"%s\", \"duration\": %.0f, \"bit_rate\": %lld, \"gop\": %d, "
+           "\"mode\": \"%s\", \"jobs\": %d, \"keyframe_index\": %d, \"parts\": %d, "
+           "\"input_bytes\": %lld, \"packets\": %lld, "
+           "\"plan_seconds\": %.4f, \"execute_seconds\": %.4f, \"total_seconds\": %.4f, "
+           "\"mb_per_s\": %.1f, \"packets_per_s\": %.0f, \"base_rss_kb\": %ld, \"peak_rss_kb\": %ld, "
+           "\"peak_rss_per_run\": %s, "
+           "\"syscr\": %lld, \"syscw\": %lld, \"read_bytes\": %lld, \"write_bytes\": %lld, "
+           "\"result\": %d}\n",
+           run, synth->container, synth->duration, (long long)synth->bit_rate, synth->gop_size,
+           mode_name(options->mode), options->jobs, options->use_keyframe_index,
+           plan ? plan->total_parts : 0,
+           (long long)generated->file_size, (long long)generated->packets,
+           planned - start, execute_seconds, finished - start,
+           execute_seconds > 0 ? generated->file_size / execute_seconds / (1 << 20) : 0.0,
+           execute_seconds > 0 ? generated->packets / execute_seconds : 0.0,
+           base_rss_kb, bench_peak_rss_kb(), peak_reset ? "true" : "false",
+           after.syscr - before.syscr, after.syscw - before.syscw,
+           after.read_bytes - before.read_bytes, after.write_bytes - before.write_bytes,
+           ret);
+    fflush(stdout);
+
+    if (plan && !keep) {
+        remove_parts(plan);
+    }
+    split_plan_free(&plan);
+    return ret;
+}
+
+int main(int argc, char *argv[]) {
+    enum { OPT_CONTAINER = 256, OPT_DURATION, OPT_BITRATE, OPT_GOP, OPT_PARTS, OPT_MODE,
+           OPT_JOBS, OPT_KEYFRAME_INDEX, OPT_REPEAT, OPT_DIR, OPT_KEEP };
+    static const struct option long_options[] = {
+        { "container", required_argument, NULL, OPT_CONTAINER },
+        { "duration", required_argument, NULL, OPT_DURATION },
+        { "bitrate", required_argument, NULL, OPT_BITRATE },
+        { "gop", required_argument, NULL, OPT_GOP },
+        { "parts", required_argument, NULL, OPT_PARTS },
+        { "mode", required_argument, NULL, OPT_MODE },
+        { "jobs", required_argument, NULL, OPT_JOBS },
+        { "keyframe-index", no_argument, NULL, OPT_KEYFRAME_INDEX },
+        { "repeat", required_argument, NULL, OPT_REPEAT },
+        { "dir", required_argument, NULL, OPT_DIR },
+        { "keep", no_argument, NULL, OPT_KEEP },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+
+    SynthOptions synth;
+    SplitOptions options;
+    synth_options_init(&synth);
+    split_options_init(&options);
+    int parts = 4, repeat = 3, keep = 0;
+    const char *dir = ".";
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+        switch (opt) {
+        case OPT_CONTAINER:
+            synth.container = optarg;
+            break;
+        case OPT_DURATION:
+            synth.duration = atof(optarg);
+            break;
+        case OPT_BITRATE:
+            synth.bit_rate = atoll(optarg);
+            break;
+        case OPT_GOP:
+            synth.gop_size = atoi(optarg);
+            break;
+        case OPT_PARTS:
+            parts = atoi(optarg);
+            break;
+        case OPT_MODE:
+            if (strcmp(optarg, "per-part") == 0) {
+                options.mode = SPLIT_MODE_PER_PART;
+            } else if (strcmp(optarg, "parallel") == 0) {
+                options.mode = SPLIT_MODE_PARALLEL;
+            } else {
+                options.mode = SPLIT_MODE_SINGLE_PASS;
+            }
+            break;
+        case OPT_JOBS:
+            options.jobs = atoi(optarg);
+            break;
+        case OPT_KEYFRAME_INDEX:
+            options.use_keyframe_index = 1;
+            break;
+        case OPT_REPEAT:
+            repeat = atoi(optarg);
+            break;
+        case OPT_DIR:
+            dir = optarg;
+            break;
+        case OPT_KEEP:
+            keep = 1;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    const char *extension = synth_extension(synth.container);
+    if (!extension || synth.duration <= 0 || synth.bit_rate <= 0 || synth.gop_size <= 0 ||
+        parts <= 0 || repeat <= 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    char input[1024];
+    snprintf(input, sizeof(input), "%s/synth_%.0fs_%lldbps_gop%d.%s", dir, synth.duration,
+             (long long)synth.bit_rate, synth.gop_size, extension);
+
+    SynthResult generated = {0};
+    double start = bench_now();
+    int ret = synth_generate(&synth, input, &generated);
+    if (ret < 0) {
+        fprintf(stderr, "Could not generate '%s'\n", input);
+        return 1;
+    }
+    fprintf(stderr, "Generated %s (%lld bytes, %lld packets) in %.1f s\n", input,
+            (long long)generated.file_size, (long long)generated.packets, bench_now() - start);
+#ifdef __GLIBC__
+    malloc_trim(0);  // the encoder's freed heap isn't counted in the runs' base RSS
+#endif
+
+    int failed = 0;
+    for (int run = 1; run <= repeat; run++) {
+        if (run_once(input, &synth, &generated, parts, &options, run, keep && run == repeat) < 0) {
+            failed = 1;
+        }
+    }
+
+    if (!keep) {
+        remove(input);
+        if (options.use_keyframe_index) {
+            char sidecar[1100];
+            keyframe_index_sidecar_path(input, sidecar, sizeof(sidecar));
+            remove(sidecar);
+        }
+    }
+    return failed;
+}
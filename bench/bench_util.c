@@ -0,0 +1,78 @@
+#define _GNU_SOURCE
+#include "bench_util.h"
+#include <libavutil/time.h>
+#include <stdio.h>
+#include <string.h>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+void bench_read_io_counters(IoCounters *counters) {
+    memset(counters, 0, sizeof(*counters));
+    FILE *f = fopen("/proc/self/io", "r");
+    if (!f) {
+        return;
+    }
+    char line[128];
+    while (fgets(line, sizeof(line), f)) {
+        sscanf(line, "syscr: %lld", &counters->syscr);
+        sscanf(line, "syscw: %lld", &counters->syscw);
+        sscanf(line, "read_bytes: %lld", &counters->read_bytes);
+        sscanf(line, "write_bytes: %lld", &counters->write_bytes);
+    }
+    fclose(f);
+}
+
+// A "Name:   123 kB" line of /proc/self/status, -1 where it is missing
+static long read_status_kb(const char *name) {
+    FILE *f = fopen("/proc/self/status", "r");
+    if (!f) {
+        return -1;
+    }
+    char line[128];
+    long kb = -1;
+    size_t length = strlen(name);
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, name, length) == 0 && line[length] == ':') {
+            sscanf(line + length + 1, "%ld", &kb);
+            break;
+        }
+    }
+    fclose(f);
+    return kb;
+}
+
+int bench_reset_peak_rss(void) {
+    // "5" resets VmHWM to the current RSS (Linux 4.0 and later)
+    FILE *f = fopen("/proc/self/clear_refs", "w");
+    if (!f) {
+        return -1;
+    }
+    int ok = fputs("5", f) >= 0;
+    if (fclose(f) != 0 || !ok) {
+        return -1;
+    }
+    return 0;
+}
+
+long bench_peak_rss_kb(void) {
+    long kb = read_status_kb("VmHWM");
+    if (kb >= 0) {
+        return kb;
+    }
+#ifdef _WIN32
+    return 0;
+#else
+    struct rusage usage;
+    return getrusage(RUSAGE_SELF, &usage) == 0 ? usage.ru_maxrss : 0;
+#endif
+}
+
+long bench_rss_kb(void) {
+    long kb = read_status_kb("VmRSS");
+    return kb >= 0 ? kb : 0;
+}
+
+double bench_now(void) {
+    return av_gettime_relative() / 1e6;
+}
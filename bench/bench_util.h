@@ -0,0 +1,28 @@
+#ifndef BENCH_UTIL_H
+#define BENCH_UTIL_H
+
+#include <stdint.h>
+
+// Syscall and byte counters of this process, all zero where /proc/self/io is missing
+typedef struct {
+    long long syscr;
+    long long syscw;
+    long long read_bytes;   // from storage, page cache hits don't count
+    long long write_bytes;
+} IoCounters;
+
+void bench_read_io_counters(IoCounters*);
+
+// Starts a new peak resident set size from the current one, so each run
+// measures its own. Returns a negative value where that isn't possible
+// (not Linux, no /proc/self/clear_refs), the peak then covers the whole process.
+int bench_reset_peak_rss(void);
+
+// Peak resident set size since the last reset, or of the whole process so
+// far, and the current one, in KiB
+long bench_peak_rss_kb(void);
+long bench_rss_kb(void);
+
+double bench_now(void);  // monotonic seconds
+
+#endif
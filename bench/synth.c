@@ -0,0 +1,401 @@
+#define _GNU_SOURCE
+#include "synth.h"
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/channel_layout.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define AUDIO_SAMPLE_RATE 48000
+#define AUDIO_BIT_RATE 192000
+
+typedef struct {
+    AVPacket **packets;
+    int count;
+    int capacity;
+    int64_t period;  // template length in the encoder time base
+} PacketTemplate;
+
+void synth_options_init(SynthOptions *options) {
+    memset(options, 0, sizeof(*options));
+    options->duration = 600.0;
+    options->bit_rate = 8000000;
+    options->gop_size = 60;
+    options->width = 1280;
+    options->height = 720;
+    options->fps = 30;
+    options->audio = 1;
+    options->container = "mkv";
+}
+
+const char *synth_extension(const char *container) {
+    if (strcmp(container, "mp4") == 0) {
+        return "mp4";
+    }
+    if (strcmp(container, "mkv") == 0) {
+        return "mkv";
+    }
+    if (strcmp(container, "ts") == 0) {
+        return "ts";
+    }
+    return NULL;
+}
+
+static void template_free(PacketTemplate *template) {
+    for (int i = 0; i < template->count; i++) {
+        av_packet_free(&template->packets[i]);
+    }
+    free(template->packets);
+    memset(template, 0, sizeof(*template));
+}
+
+// Moves every packet the encoder has ready into the template
+static int drain_encoder(AVCodecContext *codec_ctx, PacketTemplate *template) {
+    for (;;) {
+        AVPacket *packet = av_packet_alloc();
+        if (!packet) {
+            return AVERROR(ENOMEM);
+        }
+        int ret = avcodec_receive_packet(codec_ctx, packet);
+        if (ret < 0) {
+            av_packet_free(&packet);
+            return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+        }
+        if (template->count == template->capacity) {
+            int capacity = template->capacity ? template->capacity * 2 : 256;
+            AVPacket **packets = realloc(template->packets, capacity * sizeof(AVPacket *));
+            if (!packets) {
+                av_packet_free(&packet);
+                return AVERROR(ENOMEM);
+            }
+            template->packets = packets;
+            template->capacity = capacity;
+        }
+        template->packets[template->count++] = packet;
+    }
+}
+
+static uint32_t next_random(uint32_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+// Noise over a moving gradient, so the encoder has to spend the bit rate
+static void fill_video_frame(AVFrame *frame, int index, uint32_t *seed) {
+    for (int y = 0; y < frame->height; y++) {
+        uint8_t *row = frame->data[0] + y * frame->linesize[0];
+        for (int x = 0; x < frame->width; x++) {
+            row[x] = (uint8_t)(x + y + index * 3 + (next_random(seed) & 0x1f));
+        }
+    }
+    for (int plane = 1; plane < 3; plane++) {
+        for (int y = 0; y < frame->height / 2; y++) {
+            uint8_t *row = frame->data[plane] + y * frame->linesize[plane];
+            for (int x = 0; x < frame->width / 2; x++) {
+                row[x] = (uint8_t)(128 + plane * index + (next_random(seed) & 0x0f));
+            }
+        }
+    }
+}
+
+static int encode_video_template(const SynthOptions *options, AVCodecContext *codec_ctx,
+                                 PacketTemplate *template) {
+    AVFrame *frame = av_frame_alloc();
+    uint32_t seed = 0x9e3779b9;
+    if (!frame) {
+        return AVERROR(ENOMEM);
+    }
+    frame->format = codec_ctx->pix_fmt;
+    frame->width = codec_ctx->width;
+    frame->height = codec_ctx->height;
+    int ret = av_frame_get_buffer(frame, 0);
+
+    for (int i = 0; ret >= 0 && i < options->gop_size; i++) {
+        ret = av_frame_make_writable(frame);
+        if (ret < 0) {
+            break;
+        }
+        fill_video_frame(frame, i, &seed);
+        frame->pts = i;
+        ret = avcodec_send_frame(codec_ctx, frame);
+        if (ret >= 0) {
+            ret = drain_encoder(codec_ctx, template);
+        }
+    }
+    if (ret >= 0) {
+        ret = avcodec_send_frame(codec_ctx, NULL);
+    }
+    if (ret >= 0) {
+        ret = drain_encoder(codec_ctx, template);
+    }
+    av_frame_free(&frame);
+    template->period = options->gop_size;
+    return ret;
+}
+
+static int encode_audio_template(const SynthOptions *options, AVCodecContext *codec_ctx,
+                                 PacketTemplate *template) {
+    AVFrame *frame = av_frame_alloc();
+    if (!frame) {
+        return AVERROR(ENOMEM);
+    }
+    frame->format = codec_ctx->sample_fmt;
+    frame->nb_samples = codec_ctx->frame_size;
+    frame->sample_rate = codec_ctx->sample_rate;
+    int ret = av_channel_layout_copy(&frame->ch_layout, &codec_ctx->ch_layout);
+    if (ret >= 0) {
+        ret = av_frame_get_buffer(frame, 0);
+    }
+
+    // Enough whole frames to cover one GOP
+    int64_t gop_samples = (int64_t)options->gop_size * AUDIO_SAMPLE_RATE / options->fps;
+    int frames = (int)((gop_samples + codec_ctx->frame_size - 1) / codec_ctx->frame_size);
+    for (int i = 0; ret >= 0 && i < frames; i++) {
+        ret = av_frame_make_writable(frame);
+        if (ret < 0) {
+            break;
+        }
+        int16_t *samples = (int16_t *)frame->data[0];
+        for (int s = 0; s < frame->nb_samples; s++) {
+            // 375 Hz square-ish tone, interleaved stereo
+            int16_t value = ((i * frame->nb_samples + s) / 64) % 2 ? 4000 : -4000;
+            samples[2 * s] = value;
+            samples[2 * s + 1] = value;
+        }
+        frame->pts = (int64_t)i * codec_ctx->frame_size;
+        ret = avcodec_send_frame(codec_ctx, frame);
+        if (ret >= 0) {
+            ret = drain_encoder(codec_ctx, template);
+        }
+    }
+    if (ret >= 0) {
+        ret = avcodec_send_frame(codec_ctx, NULL);
+    }
+    if (ret >= 0) {
+        ret = drain_encoder(codec_ctx, template);
+    }
+    av_frame_free(&frame);
+    template->period = (int64_t)frames * codec_ctx->frame_size;
+    return ret;
+}
+
+static int open_video_encoder(const SynthOptions *options, int global_header, AVCodecContext **out) {
+    const AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_MPEG2VIDEO);
+    if (!codec) {
+        fprintf(stderr, "MPEG-2 video encoder not available\n");
+        return AVERROR_ENCODER_NOT_FOUND;
+    }
+    AVCodecContext *codec_ctx = avcodec_alloc_context3(codec);
+    if (!codec_ctx) {
+        return AVERROR(ENOMEM);
+    }
+    codec_ctx->width = options->width;
+    codec_ctx->height = options->height;
+    codec_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+    codec_ctx->time_base = (AVRational){ 1, options->fps };
+    codec_ctx->framerate = (AVRational){ options->fps, 1 };
+    codec_ctx->gop_size = options->gop_size;
+    codec_ctx->max_b_frames = 0;  // pts == dts, so repeated GOPs need no reordering
+    codec_ctx->bit_rate = options->bit_rate;
+    codec_ctx->rc_max_rate = options->bit_rate;
+    codec_ctx->rc_buffer_size = (int)(options->bit_rate > INT32_MAX ? INT32_MAX : options->bit_rate);
+    codec_ctx->flags |= AV_CODEC_FLAG_CLOSED_GOP;
+    if (global_header) {
+        codec_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+    int ret = avcodec_open2(codec_ctx, codec, NULL);
+    if (ret < 0) {
+        avcodec_free_context(&codec_ctx);
+        return ret;
+    }
+    *out = codec_ctx;
+    return 0;
+}
+
+static int open_audio_encoder(int global_header, AVCodecContext **out) {
+    const AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_MP2);
+    if (!codec) {
+        fprintf(stderr, "MP2 audio encoder not available\n");
+        return AVERROR_ENCODER_NOT_FOUND;
+    }
+    AVCodecContext *codec_ctx = avcodec_alloc_context3(codec);
+    if (!codec_ctx) {
+        return AVERROR(ENOMEM);
+    }
+    codec_ctx->sample_fmt = AV_SAMPLE_FMT_S16;
+    codec_ctx->sample_rate = AUDIO_SAMPLE_RATE;
+    codec_ctx->bit_rate = AUDIO_BIT_RATE;
+    codec_ctx->time_base = (AVRational){ 1, AUDIO_SAMPLE_RATE };
+    av_channel_layout_default(&codec_ctx->ch_layout, 2);
+    if (global_header) {
+        codec_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+    int ret = avcodec_open2(codec_ctx, codec, NULL);
+    if (ret < 0) {
+        avcodec_free_context(&codec_ctx);
+        return ret;
+    }
+    *out = codec_ctx;
+    return 0;
+}
+
+// Writes template packet i shifted into repetition n
+static int write_repeated(AVFormatContext *output_ctx, AVStream *stream, AVRational time_base,
+                          const PacketTemplate *template, int64_t n, int i, AVPacket *packet) {
+    int ret = av_packet_ref(packet, template->packets[i]);
+    if (ret < 0) {
+        return ret;
+    }
+    int64_t shift = n * template->period;
+    if (packet->pts != AV_NOPTS_VALUE) {
+        packet->pts += shift;
+    }
+    if (packet->dts != AV_NOPTS_VALUE) {
+        packet->dts += shift;
+    }
+    packet->pos = -1;
+    packet->stream_index = stream->index;
+    av_packet_rescale_ts(packet, time_base, stream->time_base);
+    return av_interleaved_write_frame(output_ctx, packet);
+}
+
+static double template_time(const PacketTemplate *template, AVRational time_base, int64_t n, int i) {
+    const AVPacket *packet = template->packets[i];
+    int64_t ts = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+    return (ts + n * template->period) * av_q2d(time_base);
+}
+
+int synth_generate(const SynthOptions *options, const char *filename, SynthResult *result) {
+    AVFormatContext *output_ctx = NULL;
+    AVCodecContext *video_ctx = NULL, *audio_ctx = NULL;
+    PacketTemplate video = {0}, audio = {0};
+    AVStream *video_stream = NULL, *audio_stream = NULL;
+    AVPacket *packet = NULL;
+    int64_t packets = 0;
+
+    const char *format_name = strcmp(options->container, "ts") == 0 ? "mpegts" :
+                              strcmp(options->container, "mkv") == 0 ? "matroska" : options->container;
+    int ret = avformat_alloc_output_context2(&output_ctx, NULL, format_name, filename);
+    if (!output_ctx) {
+        fprintf(stderr, "Could not create output context for '%s'\n", options->container);
+        return ret < 0 ? ret : AVERROR_UNKNOWN;
+    }
+    int global_header = (output_ctx->oformat->flags & AVFMT_GLOBALHEADER) != 0;
+
+    ret = open_video_encoder(options, global_header, &video_ctx);
+    if (ret < 0) {
+        goto cleanup;
+    }
+    ret = encode_video_template(options, video_ctx, &video);
+    if (ret < 0 || video.count == 0) {
+        fprintf(stderr, "Could not encode the video template\n");
+        ret = ret < 0 ? ret : AVERROR_UNKNOWN;
+        goto cleanup;
+    }
+    video_stream = avformat_new_stream(output_ctx, NULL);
+    if (!video_stream) {
+        ret = AVERROR(ENOMEM);
+        goto cleanup;
+    }
+    ret = avcodec_parameters_from_context(video_stream->codecpar, video_ctx);
+    if (ret < 0) {
+        goto cleanup;
+    }
+    video_stream->time_base = video_ctx->time_base;
+
+    if (options->audio) {
+        ret = open_audio_encoder(global_header, &audio_ctx);
+        if (ret >= 0) {
+            ret = encode_audio_template(options, audio_ctx, &audio);
+        }
+        if (ret < 0 || audio.count == 0) {
+            fprintf(stderr, "Could not encode the audio template\n");
+            ret = ret < 0 ? ret : AVERROR_UNKNOWN;
+            goto cleanup;
+        }
+        audio_stream = avformat_new_stream(output_ctx, NULL);
+        if (!audio_stream) {
+            ret = AVERROR(ENOMEM);
+            goto cleanup;
+        }
+        ret = avcodec_parameters_from_context(audio_stream->codecpar, audio_ctx);
+        if (ret < 0) {
+            goto cleanup;
+        }
+        audio_stream->time_base = audio_ctx->time_base;
+    }
+
+    ret = avio_open(&output_ctx->pb, filename, AVIO_FLAG_WRITE);
+    if (ret < 0) {
+        fprintf(stderr, "Could not open output file '%s'\n", filename);
+        goto cleanup;
+    }
+    ret = avformat_write_header(output_ctx, NULL);
+    if (ret < 0) {
+        fprintf(stderr, "Error occurred when writing header\n");
+        goto cleanup;
+    }
+
+    packet = av_packet_alloc();
+    if (!packet) {
+        ret = AVERROR(ENOMEM);
+        goto cleanup;
+    }
+
+    // Merge the two repeated sequences in time order until the duration is reached
+    int64_t video_n = 0, audio_n = 0;
+    int video_i = 0, audio_i = 0;
+    for (;;) {
+        double video_time = template_time(&video, video_ctx->time_base, video_n, video_i);
+        double audio_time = audio_ctx ? template_time(&audio, audio_ctx->time_base, audio_n, audio_i)
+                                      : video_time + 1.0;
+        if (video_time >= options->duration && audio_time >= options->duration) {
+            break;
+        }
+
+        if (audio_time < video_time) {
+            ret = write_repeated(output_ctx, audio_stream, audio_ctx->time_base, &audio, audio_n, audio_i, packet);
+            if (++audio_i == audio.count) {
+                audio_i = 0;
+                audio_n++;
+            }
+        } else {
+            ret = write_repeated(output_ctx, video_stream, video_ctx->time_base, &video, video_n, video_i, packet);
+            if (++video_i == video.count) {
+                video_i = 0;
+                video_n++;
+            }
+        }
+        if (ret < 0) {
+            fprintf(stderr, "Error muxing packet\n");
+            goto cleanup;
+        }
+        packets++;
+    }
+
+    ret = av_write_trailer(output_ctx);
+
+cleanup:
+    av_packet_free(&packet);
+    template_free(&video);
+    template_free(&audio);
+    avcodec_free_context(&video_ctx);
+    avcodec_free_context(&audio_ctx);
+    if (output_ctx) {
+        if (!(output_ctx->oformat->flags & AVFMT_NOFILE)) {
+            avio_closep(&output_ctx->pb);
+        }
+        avformat_free_context(output_ctx);
+    }
+
+    if (ret >= 0 && result) {
+        struct stat st;
+        result->file_size = stat(filename, &st) == 0 ? (int64_t)st.st_size : -1;
+        result->packets = packets;
+    }
+    return ret;
+}
@@ -0,0 +1,32 @@
+#ifndef SYNTH_H
+#define SYNTH_H
+
+#include <stdint.h>
+
+// A synthetic recording: MPEG-2 video with fixed-length GOPs and MP2 audio.
+// One GOP (and the audio covering it) is encoded once and its packets are
+// repeated with shifted timestamps, so hours of input take seconds to make.
+typedef struct {
+    double duration;       // seconds
+    int64_t bit_rate;      // video bits per second
+    int gop_size;          // frames per GOP
+    int width;
+    int height;
+    int fps;
+    int audio;             // add a stereo audio stream
+    const char *container; // "mp4", "mkv" or "ts"
+} SynthOptions;
+
+typedef struct {
+    int64_t file_size;
+    int64_t packets;
+} SynthResult;
+
+void synth_options_init(SynthOptions*);
+
+// File extension of the container, or NULL for an unknown one
+const char *synth_extension(const char*);
+
+int synth_generate(const SynthOptions*, const char*, SynthResult*);
+
+#endif
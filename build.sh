@@ -1,2 +1,7 @@
 #!/bin/bash
-gcc -I./src -g src/video_splitter.c -o a.out src/main.c `pkg-config --cflags --libs gtk+-3.0 libavformat libavcodec libavutil`
+CORE="src/video_splitter.c src/storage.c src/keyframe_index.c src/packet_ring.c src/avio_file.c src/probe.c src/silence.c src/smart_render.c src/journal.c src/checksum.c src/scheduler.c src/preview.c src/ts_copy.c src/mux_queue.c src/trace.c"
+FFMPEG_FLAGS=`pkg-config --cflags --libs libavformat libavcodec libavutil libswscale`
+# TRACE=1 ./build.sh builds with the instrumentation behind --trace
+CFLAGS="-I./src -g -pthread ${TRACE:+-DVS_ENABLE_TRACE}"
+gcc $CFLAGS $CORE -o a.out src/main.c `pkg-config --cflags --libs gtk+-3.0` $FFMPEG_FLAGS -lm
+gcc $CFLAGS $CORE -o video_splitter_cli src/cli.c $FFMPEG_FLAGS -lm
@@ -0,0 +1,343 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include "avio_file.h"
+#include <libavformat/version.h>
+#include <libavutil/time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#define FOLLOW_POLL_US 200000  // between two reads at the end of a followed input
+#define STREAM_BUFFER_SIZE (1 << 20)  // bytes per read() from stdin or a pipe when none was asked for
+
+typedef struct {
+    int fd;
+    int writable;
+    int64_t position;
+    int64_t size;           // of the input, or furthest byte written so far
+    const uint8_t *map;     // whole input when mapped
+    int64_t preallocated;
+    int stream;             // stdin, a FIFO or a socket: read once, never seeked
+    double follow_idle;
+    AVIOInterruptCB interrupt;
+} AvioFile;
+
+#ifndef _WIN32
+
+// Pipes, sockets and character devices can only be read once, front to back
+static int is_stream_mode(mode_t mode) {
+    return S_ISFIFO(mode) || S_ISSOCK(mode) || S_ISCHR(mode);
+}
+
+static int file_read(void *opaque, uint8_t *buf, int buf_size) {
+    AvioFile *file = opaque;
+
+    if (file->map) {
+        int64_t left = file->size - file->position;
+        if (left <= 0) {
+            return AVERROR_EOF;
+        }
+        int n = left < buf_size ? (int)left : buf_size;
+        memcpy(buf, file->map + file->position, n);
+        file->position += n;
+        return n;
+    }
+
+    int64_t idle_since = 0;
+    for (;;) {
+        ssize_t n;
+        do {
+            n = read(file->fd, buf, buf_size);
+        } while (n < 0 && errno == EINTR);
+        if (n < 0) {
+            return AVERROR(errno);
+        }
+        if (n > 0) {
+            file->position += n;
+            return (int)n;
+        }
+        if (file->follow_idle <= 0 || file->stream) {
+            // A pipe only reads 0 bytes once every writer has closed it
+            return AVERROR_EOF;
+        }
+
+        // At the current end of an input that may still be growing
+        int64_t now = av_gettime_relative();
+        if (!idle_since) {
+            idle_since = now;
+        } else if (now - idle_since >= (int64_t)(file->follow_idle * AV_TIME_BASE)) {
+            return AVERROR_EOF;
+        }
+        if (file->interrupt.callback && file->interrupt.callback(file->interrupt.opaque)) {
+            return AVERROR_EXIT;
+        }
+        av_usleep(FOLLOW_POLL_US);
+    }
+}
+
+// The buffer of write_packet only became const in libavformat 61 (FFmpeg 7)
+#if LIBAVFORMAT_VERSION_MAJOR < 61
+typedef uint8_t WriteBuffer;
+#else
+typedef const uint8_t WriteBuffer;
+#endif
+
+static int file_write(void *opaque, WriteBuffer *buf, int buf_size) {
+    AvioFile *file = opaque;
+    int written = 0;
+
+    while (written < buf_size) {
+        ssize_t n = write(file->fd, buf + written, buf_size - written);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return AVERROR(errno);
+        }
+        written += (int)n;
+    }
+    file->position += written;
+    if (file->position > file->size) {
+        file->size = file->position;
+    }
+    return written;
+}
+
+static int64_t file_seek(void *opaque, int64_t offset, int whence) {
+    AvioFile *file = opaque;
+
+    if (whence & AVSEEK_SIZE) {
+        if (file->writable) {
+            return file->size;
+        }
+        struct stat st;
+        return fstat(file->fd, &st) == 0 ? (int64_t)st.st_size : AVERROR(errno);
+    }
+
+    whence &= ~AVSEEK_FORCE;
+    int64_t target;
+    switch (whence) {
+    case SEEK_SET:
+        target = offset;
+        break;
+    case SEEK_CUR:
+        target = file->position + offset;
+        break;
+    case SEEK_END:
+        target = file->size + offset;
+        break;
+    default:
+        return AVERROR(EINVAL);
+    }
+    if (target < 0) {
+        return AVERROR(EINVAL);
+    }
+
+    if (!file->map && lseek(file->fd, target, SEEK_SET) < 0) {
+        return AVERROR(errno);
+    }
+    file->position = target;
+    return target;
+}
+
+static void map_input(AvioFile *file) {
+    if (file->size <= 0 || (uint64_t)file->size > SIZE_MAX) {
+        return;
+    }
+    void *map = mmap(NULL, (size_t)file->size, PROT_READ, MAP_SHARED, file->fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Could not map input, reading it instead\n");
+        return;
+    }
+    madvise(map, (size_t)file->size, MADV_SEQUENTIAL);
+    file->map = map;
+}
+
+static int open_file(AvioFile *file, const char *filename, int flags, const AvioFileOptions *options,
+                     int64_t preallocate) {
+    file->writable = (flags & AVIO_FLAG_WRITE) != 0;
+    if (!file->writable && strcmp(filename, "-") == 0) {
+        // Our own descriptor, closing it must not close stdin
+        file->fd = dup(STDIN_FILENO);
+    } else {
+        file->fd = file->writable ? open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644)
+                                  : open(filename, O_RDONLY);
+    }
+    if (file->fd < 0) {
+        return AVERROR(errno);
+    }
+
+    if (file->writable) {
+#ifdef __linux__
+        // Reserve the space in one go so a 100 GB part isn't spread across the
+        // disk by many small extensions. Unsupported filesystems just skip it.
+        if (preallocate > 0 && fallocate(file->fd, 0, 0, preallocate) == 0) {
+            file->preallocated = preallocate;
+        }
+#endif
+        return 0;
+    }
+
+    struct stat st;
+    if (fstat(file->fd, &st) == 0) {
+        if (is_stream_mode(st.st_mode)) {
+            file->stream = 1;
+            return 0;
+        }
+        // A block device (a disk or partition image) seeks like a file, but
+        // only tells its size by seeking to the end
+        file->size = S_ISBLK(st.st_mode) ? lseek(file->fd, 0, SEEK_END) : st.st_size;
+        if (S_ISBLK(st.st_mode)) {
+            lseek(file->fd, 0, SEEK_SET);
+        }
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(file->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    if (options->follow_idle > 0) {
+        // A mapping would stop at the size the input had when it was opened
+        file->follow_idle = options->follow_idle;
+        file->interrupt = options->interrupt;
+        return 0;
+    }
+    if (options->use_mmap) {
+        map_input(file);
+    }
+    return 0;
+}
+
+static void close_file(AvioFile *file) {
+    if (file->map) {
+        munmap((void *)file->map, (size_t)file->size);
+    }
+    if (file->writable && file->preallocated > file->size) {
+        if (ftruncate(file->fd, file->size) != 0) {
+            fprintf(stderr, "Could not release preallocated space\n");
+        }
+    }
+    close(file->fd);
+}
+
+#endif
+
+int avio_file_is_stream(const char *filename) {
+    if (strcmp(filename, "-") == 0) {
+        return 1;
+    }
+#ifndef _WIN32
+    struct stat st;
+    if (stat(filename, &st) == 0 && is_stream_mode(st.st_mode)) {
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+int avio_file_open(AVIOContext **pb, const char *filename, int flags,
+                   const AvioFileOptions *options, int64_t preallocate) {
+#ifdef _WIN32
+    return avio_open(pb, strcmp(filename, "-") == 0 ? "pipe:0" : filename, flags);
+#else
+    int buffer_size = options ? options->buffer_size : 0;
+    if (buffer_size <= 0) {
+        if (!(flags & AVIO_FLAG_WRITE) && avio_file_is_stream(filename)) {
+            // libavformat's file protocol doesn't know "-"
+            buffer_size = STREAM_BUFFER_SIZE;
+        } else {
+            return avio_open(pb, filename, flags);
+        }
+    }
+    AvioFileOptions defaults = {0};
+    if (!options) {
+        options = &defaults;
+    }
+
+    AvioFile *file = calloc(1, sizeof(AvioFile));
+    if (!file) {
+        return AVERROR(ENOMEM);
+    }
+    int ret = open_file(file, filename, flags, options, preallocate);
+    if (ret < 0) {
+        free(file);
+        return ret;
+    }
+
+    unsigned char *buffer = av_malloc(buffer_size);
+    if (buffer) {
+        *pb = avio_alloc_context(buffer, buffer_size, file->writable, file,
+                                 file->writable ? NULL : file_read,
+                                 file->writable ? file_write : NULL,
+                                 file->follow_idle > 0 || file->stream ? NULL : file_seek);
+    }
+    if (!buffer || !*pb) {
+        av_free(buffer);
+        close_file(file);
+        free(file);
+        return AVERROR(ENOMEM);
+    }
+    return 0;
+#endif
+}
+
+int avio_file_close(AVIOContext **pb) {
+    if (!*pb) {
+        return 0;
+    }
+#ifndef _WIN32
+    if ((*pb)->read_packet == file_read || (*pb)->write_packet == file_write) {
+        AvioFile *file = (*pb)->opaque;
+        avio_flush(*pb);
+        int ret = (*pb)->error;
+        av_freep(&(*pb)->buffer);
+        avio_context_free(pb);
+        close_file(file);
+        free(file);
+        return ret;
+    }
+#endif
+    return avio_closep(pb);
+}
+
+int avio_file_open_input(AVFormatContext **ctx, const char *filename, const AvioFileOptions *options,
+                         AVDictionary **format_options) {
+    if ((!options || options->buffer_size <= 0) && !avio_file_is_stream(filename)) {
+        return avformat_open_input(ctx, filename, NULL, format_options);
+    }
+
+    AVIOContext *pb = NULL;
+    int ret = avio_file_open(&pb, filename, AVIO_FLAG_READ, options, 0);
+    if (ret < 0) {
+        return ret;
+    }
+
+    *ctx = avformat_alloc_context();
+    if (!*ctx) {
+        avio_file_close(&pb);
+        return AVERROR(ENOMEM);
+    }
+    (*ctx)->pb = pb;
+    (*ctx)->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+    ret = avformat_open_input(ctx, filename, NULL, format_options);
+    if (ret < 0) {
+        // avformat_open_input() already freed the context but not our I/O
+        avio_file_close(&pb);
+    }
+    return ret;
+}
+
+void avio_file_close_input(AVFormatContext **ctx) {
+    if (!*ctx) {
+        return;
+    }
+    AVIOContext *pb = ((*ctx)->flags & AVFMT_FLAG_CUSTOM_IO) ? (*ctx)->pb : NULL;
+    avformat_close_input(ctx);
+    avio_file_close(&pb);
+}
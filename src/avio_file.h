@@ -0,0 +1,34 @@
+#ifndef AVIO_FILE_H
+#define AVIO_FILE_H
+
+#include <libavformat/avformat.h>
+
+// File I/O for the splitter with large buffers and kernel hints, replacing
+// libavformat's file protocol (which moves 32 KB per syscall).
+typedef struct {
+    int buffer_size;  // bytes per read()/write(), 0 uses libavformat's own file protocol
+    int use_mmap;     // map the input instead of reading it, falls back to read() if mapping fails
+    // When positive, an input that is still being written (or a pipe) is
+    // tailed: at its end reads wait for more data and only report EOF once
+    // nothing arrived for this many seconds. Such inputs aren't seekable.
+    double follow_idle;
+    AVIOInterruptCB interrupt;  // checked while waiting for a followed input to grow
+} AvioFileOptions;
+
+// 1 for "-" (stdin) and for pipes, sockets and character devices: inputs
+// that can only be read once, front to back. They are opened with a buffer of
+// our own even without buffer_size, never seekable, and end at their EOF.
+int avio_file_is_stream(const char*);
+
+// Opens a plain AVIOContext. For AVIO_FLAG_WRITE, a non-zero preallocate
+// reserves that many bytes on disk up front; the file is cut back to what
+// was actually written when it is closed.
+int avio_file_open(AVIOContext**, const char*, int, const AvioFileOptions*, int64_t);
+int avio_file_close(AVIOContext**);
+
+// avformat_open_input()/avformat_close_input() on top of avio_file_open(),
+// the dictionary is passed on to avformat_open_input()
+int avio_file_open_input(AVFormatContext**, const char*, const AvioFileOptions*, AVDictionary**);
+void avio_file_close_input(AVFormatContext**);
+
+#endif
@@ -0,0 +1,456 @@
+#include "checksum.h"
+#include "probe.h"
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define CHECKSUM_X86 1
+#include <immintrin.h>
+#endif
+
+#define MANIFEST_MAGIC "VSSUM 1"
+#define MANIFEST_SUFFIX ".vssum"
+
+#define STRIPE 64                // bytes folded into the 8 accumulators at a time
+#define STRIPES_PER_BLOCK 16     // stripes between two scrambles
+#define TAIL_KEY 16              // secret lane used for the last, partial stripe
+#define SCRAMBLE_KEY 16          // secret lanes mixed in when scrambling
+
+#define PRIME32_1 0x9E3779B1U
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+
+static const uint64_t secret[24] = {
+    0x55f446881efad3bbULL, 0xbb3e2c38b955ae8dULL, 0x353292c85ef1188bULL,
+    0x8577efc4458f1573ULL, 0x6a0646507dabe0bfULL, 0x6b56a71ba42eea08ULL,
+    0xd4c890afea24285fULL, 0xce0932728d813da0ULL, 0x60daf3af52857924ULL,
+    0xd25b71fa85702848ULL, 0x515710e6caf36d39ULL, 0xfd47b621b7d834fbULL,
+    0xe6079232e4ecc076ULL, 0xb100bab7fa3de893ULL, 0xf8e6fd387b9c5c0aULL,
+    0x8ac7cd00bf72dfecULL, 0x20877c9abc40647dULL, 0x33bdc6e012c78a70ULL,
+    0x774e1011caa3705dULL, 0xa2c0d5d7e15d412aULL, 0xb42afa91143412f6ULL,
+    0xe6da7c6f94cc6293ULL, 0x1c2fa8e48e4a9830ULL, 0xd907d54afd927c89ULL,
+};
+
+struct ChecksumManifest {
+    FILE *file;
+    pthread_mutex_t lock;  // parallel workers finish parts concurrently
+};
+
+static uint64_t read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// Every kernel folds stripe s of data into acc with secret lanes key + s..:
+// acc[i] += data[i ^ 1] + lo32(data[i] ^ key[i]) * hi32(data[i] ^ key[i])
+static void accumulate_scalar(uint64_t *acc, const uint8_t *data, size_t stripes, int key) {
+    for (size_t s = 0; s < stripes; s++, data += STRIPE) {
+        for (int i = 0; i < 8; i++) {
+            uint64_t value = read64(data + 8 * i);
+            uint64_t keyed = value ^ secret[key + s + i];
+            acc[i ^ 1] += value;
+            acc[i] += (keyed & 0xFFFFFFFFULL) * (keyed >> 32);
+        }
+    }
+}
+
+#ifdef CHECKSUM_X86
+
+__attribute__((target("avx2")))
+static void accumulate_avx2(uint64_t *acc, const uint8_t *data, size_t stripes, int key) {
+    __m256i acc0 = _mm256_loadu_si256((const __m256i *)acc);
+    __m256i acc1 = _mm256_loadu_si256((const __m256i *)(acc + 4));
+    for (size_t s = 0; s < stripes; s++, data += STRIPE) {
+        const uint64_t *k = &secret[key + s];
+        __m256i d0 = _mm256_loadu_si256((const __m256i *)data);
+        __m256i d1 = _mm256_loadu_si256((const __m256i *)(data + 32));
+        __m256i k0 = _mm256_xor_si256(d0, _mm256_loadu_si256((const __m256i *)k));
+        __m256i k1 = _mm256_xor_si256(d1, _mm256_loadu_si256((const __m256i *)(k + 4)));
+        __m256i p0 = _mm256_mul_epu32(k0, _mm256_srli_epi64(k0, 32));
+        __m256i p1 = _mm256_mul_epu32(k1, _mm256_srli_epi64(k1, 32));
+        acc0 = _mm256_add_epi64(acc0, _mm256_add_epi64(p0, _mm256_shuffle_epi32(d0, _MM_SHUFFLE(1, 0, 3, 2))));
+        acc1 = _mm256_add_epi64(acc1, _mm256_add_epi64(p1, _mm256_shuffle_epi32(d1, _MM_SHUFFLE(1, 0, 3, 2))));
+    }
+    _mm256_storeu_si256((__m256i *)acc, acc0);
+    _mm256_storeu_si256((__m256i *)(acc + 4), acc1);
+}
+
+__attribute__((target("sse2")))
+static void accumulate_sse2(uint64_t *acc, const uint8_t *data, size_t stripes, int key) {
+    __m128i a[4];
+    for (int i = 0; i < 4; i++) {
+        a[i] = _mm_loadu_si128((const __m128i *)(acc + 2 * i));
+    }
+    for (size_t s = 0; s < stripes; s++, data += STRIPE) {
+        const uint64_t *k = &secret[key + s];
+        for (int i = 0; i < 4; i++) {
+            __m128i d = _mm_loadu_si128((const __m128i *)(data + 16 * i));
+            __m128i keyed = _mm_xor_si128(d, _mm_loadu_si128((const __m128i *)(k + 2 * i)));
+            __m128i product = _mm_mul_epu32(keyed, _mm_srli_epi64(keyed, 32));
+            a[i] = _mm_add_epi64(a[i], _mm_add_epi64(product, _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2))));
+        }
+    }
+    for (int i = 0; i < 4; i++) {
+        _mm_storeu_si128((__m128i *)(acc + 2 * i), a[i]);
+    }
+}
+
+#endif
+
+static void accumulate(uint64_t *acc, const uint8_t *data, size_t stripes, int key) {
+#ifdef CHECKSUM_X86
+    static void (*kernel)(uint64_t*, const uint8_t*, size_t, int);
+    if (!kernel) {
+        // Benign race: every thread picks the same function
+        __builtin_cpu_init();
+        kernel = __builtin_cpu_supports("avx2") ? accumulate_avx2 :
+                 __builtin_cpu_supports("sse2") ? accumulate_sse2 : accumulate_scalar;
+    }
+    kernel(acc, data, stripes, key);
+#else
+    accumulate_scalar(acc, data, stripes, key);
+#endif
+}
+
+static void scramble(uint64_t *acc) {
+    for (int i = 0; i < 8; i++) {
+        uint64_t a = acc[i];
+        a ^= a >> 47;
+        a ^= secret[SCRAMBLE_KEY + i];
+        acc[i] = a * PRIME32_1;
+    }
+}
+
+// Low and high halves of the 128-bit product, folded together
+static uint64_t mul_fold64(uint64_t a, uint64_t b) {
+    uint64_t a_lo = a & 0xFFFFFFFFULL, a_hi = a >> 32;
+    uint64_t b_lo = b & 0xFFFFFFFFULL, b_hi = b >> 32;
+    uint64_t lo_lo = a_lo * b_lo, hi_lo = a_hi * b_lo, lo_hi = a_lo * b_hi, hi_hi = a_hi * b_hi;
+    uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xFFFFFFFFULL) + lo_hi;
+    uint64_t upper = hi_hi + (hi_lo >> 32) + (cross >> 32);
+    uint64_t lower = (cross << 32) | (lo_lo & 0xFFFFFFFFULL);
+    return upper ^ lower;
+}
+
+static uint64_t avalanche(uint64_t h) {
+    h ^= h >> 37;
+    h *= 0x165667919E3779F9ULL;
+    return h ^ (h >> 32);
+}
+
+uint64_t checksum_hash(const void *data, size_t size, uint64_t seed) {
+    const uint8_t *p = data;
+    uint64_t acc[8] = {
+        PRIME32_1, PRIME64_1, PRIME64_2, PRIME64_4,
+        PRIME64_1 ^ seed, PRIME64_2 + seed, PRIME64_4 - seed, PRIME32_1 ^ (seed >> 17),
+    };
+
+    size_t stripes = size / STRIPE;
+    size_t done = 0;
+    while (stripes - done >= STRIPES_PER_BLOCK) {
+        accumulate(acc, p + done * STRIPE, STRIPES_PER_BLOCK, 0);
+        scramble(acc);
+        done += STRIPES_PER_BLOCK;
+    }
+    accumulate(acc, p + done * STRIPE, stripes - done, 0);
+
+    size_t tail = size - stripes * STRIPE;
+    if (tail > 0) {
+        uint8_t last[STRIPE] = {0};
+        memcpy(last, p + stripes * STRIPE, tail);
+        accumulate_scalar(acc, last, 1, TAIL_KEY);
+    }
+
+    uint64_t h = (uint64_t)size * PRIME64_1 ^ seed;
+    for (int i = 0; i < 4; i++) {
+        h += mul_fold64(acc[2 * i] ^ secret[2 * i + 1], acc[2 * i + 1] ^ secret[2 * i + 2]);
+    }
+    return avalanche(h);
+}
+
+int part_checksum_init(PartChecksum *checksum, int nb_streams) {
+    checksum->streams = calloc(nb_streams, sizeof(StreamChecksum));
+    if (!checksum->streams) {
+        checksum->nb_streams = 0;
+        return AVERROR(ENOMEM);
+    }
+    checksum->nb_streams = nb_streams;
+    part_checksum_reset(checksum);
+    return 0;
+}
+
+void part_checksum_reset(PartChecksum *checksum) {
+    for (int i = 0; i < checksum->nb_streams; i++) {
+        checksum->streams[i] = (StreamChecksum){
+            .first_ts = AV_NOPTS_VALUE, .last_ts = AV_NOPTS_VALUE, .min_pts = AV_NOPTS_VALUE, .first_pos = -1,
+        };
+    }
+}
+
+void part_checksum_add(PartChecksum *checksum, const AVPacket *packet) {
+    if (packet->stream_index < 0 || packet->stream_index >= checksum->nb_streams) {
+        return;
+    }
+    StreamChecksum *stream = &checksum->streams[packet->stream_index];
+    int64_t ts = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+    if (stream->packets == 0) {
+        stream->first_ts = ts;
+        stream->first_pos = packet->pos;
+    }
+    stream->last_ts = ts;
+    if (packet->pts != AV_NOPTS_VALUE && (stream->min_pts == AV_NOPTS_VALUE || packet->pts < stream->min_pts)) {
+        stream->min_pts = packet->pts;
+    }
+
+    uint64_t seed = (uint64_t)packet->stream_index * PRIME64_4 ^ (uint64_t)packet->pts * PRIME64_1 ^
+                    (uint64_t)packet->dts * PRIME64_2;
+    uint64_t h = checksum_hash(packet->data, packet->size, seed);
+    stream->hash = ((stream->hash ^ h) << 27 | (stream->hash ^ h) >> 37) * PRIME64_1 + PRIME64_4;
+    stream->packets++;
+    stream->bytes += packet->size;
+}
+
+void part_checksum_free(PartChecksum *checksum) {
+    free(checksum->streams);
+    checksum->streams = NULL;
+    checksum->nb_streams = 0;
+}
+
+void checksum_manifest_path(const char *input_filename, char *path, size_t size) {
+    snprintf(path, size, "%s%s", input_filename, MANIFEST_SUFFIX);
+}
+
+int checksum_manifest_open(const char *path, int append, ChecksumManifest **manifest_out) {
+    FILE *existing = append ? fopen(path, "r") : NULL;
+    if (existing) {
+        fclose(existing);
+    } else {
+        append = 0;
+    }
+
+    FILE *f = fopen(path, append ? "a" : "w");
+    if (!f) {
+        int ret = AVERROR(errno);
+        fprintf(stderr, "Could not write manifest '%s'\n", path);
+        return ret;
+    }
+    if (!append) {
+        fprintf(f, "%s\n", MANIFEST_MAGIC);
+    }
+
+    ChecksumManifest *manifest = calloc(1, sizeof(ChecksumManifest));
+    if (!manifest) {
+        fclose(f);
+        return AVERROR(ENOMEM);
+    }
+    manifest->file = f;
+    pthread_mutex_init(&manifest->lock, NULL);
+    *manifest_out = manifest;
+    return 0;
+}
+
+int checksum_manifest_add(ChecksumManifest *manifest, const SplitPart *part, const PartChecksum *checksum) {
+    pthread_mutex_lock(&manifest->lock);
+    fprintf(manifest->file, "part %d %s\n", part->number, part->output_filename);
+    for (int i = 0; i < checksum->nb_streams; i++) {
+        const StreamChecksum *stream = &checksum->streams[i];
+        fprintf(manifest->file, "stream %d %lld %lld %lld %lld %lld %lld %016llx\n", i,
+                (long long)stream->packets, (long long)stream->bytes, (long long)stream->first_ts,
+                (long long)stream->last_ts, (long long)stream->min_pts, (long long)stream->first_pos,
+                (unsigned long long)stream->hash);
+    }
+    int ret = fflush(manifest->file) == 0 ? 0 : AVERROR(errno);
+    pthread_mutex_unlock(&manifest->lock);
+    return ret;
+}
+
+void checksum_manifest_close(ChecksumManifest **manifest) {
+    if (!*manifest) {
+        return;
+    }
+    fclose((*manifest)->file);
+    pthread_mutex_destroy(&(*manifest)->lock);
+    free(*manifest);
+    *manifest = NULL;
+}
+
+// Goes back to where the earliest first packet of the part is. MPEG-TS/PS
+// inputs go straight to its byte position, others to its timestamp.
+static int seek_to_part(AVFormatContext *input_ctx, const PartChecksum *expected) {
+    int64_t target_us = INT64_MAX;
+    int64_t target_pos = INT64_MAX;
+    for (int i = 0; i < expected->nb_streams && i < (int)input_ctx->nb_streams; i++) {
+        const StreamChecksum *stream = &expected->streams[i];
+        if (stream->packets == 0 || stream->first_ts == AV_NOPTS_VALUE) {
+            continue;
+        }
+        int64_t ts = av_rescale_q(stream->first_ts, input_ctx->streams[i]->time_base, AV_TIME_BASE_Q);
+        if (ts < target_us) {
+            target_us = ts;
+        }
+        if (stream->first_pos >= 0 && stream->first_pos < target_pos) {
+            target_pos = stream->first_pos;
+        }
+    }
+    if (target_us == INT64_MAX) {
+        return 0;
+    }
+
+    if (target_pos != INT64_MAX && (input_ctx->iformat->flags & AVFMT_TS_DISCONT) &&
+        av_seek_frame(input_ctx, -1, target_pos, AVSEEK_FLAG_BYTE) >= 0) {
+        return 0;
+    }
+    return avformat_seek_file(input_ctx, -1, INT64_MIN, target_us, target_us, 0);
+}
+
+// Hashes the source packets of one part, picked by the recorded timestamps
+static int verify_part(AVFormatContext *input_ctx, const PartChecksum *expected, PartChecksum *actual) {
+    int ret = seek_to_part(input_ctx, expected);
+    if (ret < 0) {
+        return ret;
+    }
+    part_checksum_reset(actual);
+
+    int pending = 0;
+    for (int i = 0; i < expected->nb_streams; i++) {
+        if (expected->streams[i].packets > 0) {
+            pending++;
+        }
+    }
+
+    AVPacket *packet = av_packet_alloc();
+    if (!packet) {
+        return AVERROR(ENOMEM);
+    }
+    while (pending > 0 && (ret = av_read_frame(input_ctx, packet)) >= 0) {
+        int s = packet->stream_index;
+        if (s >= expected->nb_streams || s >= actual->nb_streams) {
+            av_packet_unref(packet);
+            continue;
+        }
+        const StreamChecksum *want = &expected->streams[s];
+        StreamChecksum *got = &actual->streams[s];
+        int64_t ts = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+
+        if (want->packets > 0 && got->last_ts != want->last_ts && ts != AV_NOPTS_VALUE &&
+            ts >= want->first_ts && ts <= want->last_ts) {
+            if (packet->pts == AV_NOPTS_VALUE || want->min_pts == AV_NOPTS_VALUE || packet->pts >= want->min_pts) {
+                part_checksum_add(actual, packet);
+            }
+            if (ts == want->last_ts) {
+                pending--;
+            }
+        } else if (want->packets > 0 && got->last_ts != want->last_ts && ts != AV_NOPTS_VALUE && ts > want->last_ts) {
+            // The last packet isn't in the source any more
+            pending--;
+            got->last_ts = want->last_ts;
+        }
+        av_packet_unref(packet);
+    }
+    av_packet_free(&packet);
+    return ret == AVERROR_EOF || ret >= 0 ? 0 : ret;
+}
+
+static int parts_match(const PartChecksum *expected, const PartChecksum *actual) {
+    for (int i = 0; i < expected->nb_streams; i++) {
+        const StreamChecksum *want = &expected->streams[i];
+        const StreamChecksum *got = i < actual->nb_streams ? &actual->streams[i] : NULL;
+        if (want->packets == 0) {
+            continue;
+        }
+        if (!got || got->packets != want->packets || got->bytes != want->bytes || got->hash != want->hash) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int checksum_verify(const char *input_filename, const char *manifest_path) {
+    AVFormatContext *input_ctx = NULL;
+    PartChecksum expected = {0}, actual = {0};
+    char line[2048];
+    int mismatched = 0, checked = 0;
+    int number = 0;
+
+    FILE *f = fopen(manifest_path, "r");
+    if (!f) {
+        int ret = AVERROR(errno);
+        fprintf(stderr, "Could not read manifest '%s'\n", manifest_path);
+        return ret;
+    }
+    if (!fgets(line, sizeof(line), f) || strncmp(line, MANIFEST_MAGIC, strlen(MANIFEST_MAGIC)) != 0) {
+        fprintf(stderr, "'%s' is not a split manifest\n", manifest_path);
+        fclose(f);
+        return AVERROR_INVALIDDATA;
+    }
+
+    int ret = avformat_open_input(&input_ctx, input_filename, NULL, NULL);
+    if (ret < 0) {
+        fprintf(stderr, "Could not open input file '%s'\n", input_filename);
+        goto cleanup;
+    }
+    ret = media_probe_find_stream_info(input_ctx, NULL);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to retrieve input stream information\n");
+        goto cleanup;
+    }
+    if ((ret = part_checksum_init(&expected, input_ctx->nb_streams)) < 0 ||
+        (ret = part_checksum_init(&actual, input_ctx->nb_streams)) < 0) {
+        goto cleanup;
+    }
+
+    // Each part is checked when the next one (or the end) is reached
+    for (;;) {
+        int more = fgets(line, sizeof(line), f) != NULL;
+        int stream;
+        long long packets, bytes, first_ts, last_ts, min_pts, first_pos;
+        unsigned long long hash;
+
+        if (more && sscanf(line, "stream %d %lld %lld %lld %lld %lld %lld %llx", &stream, &packets, &bytes,
+                           &first_ts, &last_ts, &min_pts, &first_pos, &hash) == 8) {
+            if (stream >= 0 && stream < expected.nb_streams) {
+                expected.streams[stream] = (StreamChecksum){
+                    .packets = packets, .bytes = bytes, .first_ts = first_ts, .last_ts = last_ts,
+                    .min_pts = min_pts, .first_pos = first_pos, .hash = hash,
+                };
+            }
+            continue;
+        }
+
+        if (number > 0) {
+            ret = verify_part(input_ctx, &expected, &actual);
+            if (ret < 0) {
+                fprintf(stderr, "Could not read the source of part %d\n", number);
+                goto cleanup;
+            }
+            int match = parts_match(&expected, &actual);
+            printf("part %02d  %s\n", number, match ? "ok" : "MISMATCH");
+            mismatched += !match;
+            checked++;
+        }
+        if (!more) {
+            break;
+        }
+        if (sscanf(line, "part %d", &number) != 1) {
+            number = 0;
+        }
+        part_checksum_reset(&expected);
+    }
+
+    printf("%d of %d parts match their source\n", checked - mismatched, checked);
+    ret = mismatched;
+
+cleanup:
+    part_checksum_free(&expected);
+    part_checksum_free(&actual);
+    avformat_close_input(&input_ctx);
+    fclose(f);
+    return ret;
+}
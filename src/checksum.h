@@ -0,0 +1,58 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "video_splitter.h"
+
+struct AVPacket;
+
+// Lossless-copy verification without re-reading the parts. Every packet
+// copied into a part is hashed (stream, pts, dts, payload) on its way to the
+// muxer; the per-stream results go to a manifest next to the input. Verifying
+// later hashes the same source packets again, found from the recorded
+// positions, and compares.
+
+typedef struct {
+    int64_t packets;
+    int64_t bytes;
+    // Timestamps in the input stream's time base. The packets hashed are
+    // exactly those from first_ts to last_ts (dts, or pts when missing) that
+    // aren't displayed before min_pts.
+    int64_t first_ts;
+    int64_t last_ts;
+    int64_t min_pts;
+    int64_t first_pos;  // byte position of the first packet in the input, -1 if unknown
+    uint64_t hash;
+} StreamChecksum;
+
+typedef struct {
+    int nb_streams;
+    StreamChecksum *streams;
+} PartChecksum;
+
+// 64-bit non-cryptographic hash in the style of XXH3 (not compatible with it),
+// vectorized with AVX2 or SSE2 when the CPU has them
+uint64_t checksum_hash(const void*, size_t, uint64_t);
+
+int part_checksum_init(PartChecksum*, int);
+void part_checksum_reset(PartChecksum*);
+// Folds a packet, as read from the input, into its stream's checksum
+void part_checksum_add(PartChecksum*, const struct AVPacket*);
+void part_checksum_free(PartChecksum*);
+
+typedef struct ChecksumManifest ChecksumManifest;
+
+void checksum_manifest_path(const char*, char*, size_t);
+// Starts a manifest, or adds to an existing one when append is set (a
+// resumed job)
+int checksum_manifest_open(const char*, int, ChecksumManifest**);
+int checksum_manifest_add(ChecksumManifest*, const SplitPart*, const PartChecksum*);
+void checksum_manifest_close(ChecksumManifest**);
+
+// Hashes the source range of every part listed in the manifest and compares
+// it with the recorded checksums. Returns the number of parts that don't
+// match, or a negative AVERROR.
+int checksum_verify(const char*, const char*);
+
+#endif
@@ -0,0 +1,567 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include "video_splitter.h"
+#include "checksum.h"
+#include "scheduler.h"
+#include "preview.h"
+
+#define DEFAULT_MAX_DURATION (6.0 * 3600.0)  // same defaults as the GUI
+#define DEFAULT_MIN_DURATION (30.0 * 60.0)
+#define PREVIEW_WIDTH 320  // pixels per thumbnail of a contact sheet
+#define DEFAULT_FOLLOW_IDLE 60.0  // seconds a followed input may stay unchanged before it is done
+
+static const char *video_extensions[] = {
+    ".mp4", ".avi", ".mkv", ".mov", ".wmv", ".flv", ".webm", ".m4v", ".ts", NULL
+};
+
+typedef struct {
+    char **items;
+    int count;
+    int capacity;
+} FileList;
+
+static void usage(const char *program) {
+    printf("Usage: %s [options] <file|directory>...\n"
+           "       %s [options] -o NAME -\n"
+           "\n"
+           "Splits every video file given, and every video file directly inside the\n"
+           "directories given, into parts written next to the input. Stdin (-) and\n"
+           "pipes are read once as they arrive, writing each part as soon as it is full.\n"
+           "\n"
+           "  -M, --max HH:MM:SS      longest part (default 06:00:00)\n"
+           "  -m, --min HH:MM:SS      shortest last part before it is merged (default 00:30:00)\n"
+           "  -o, --output NAME       name parts NAME_partNN.EXT instead of after the input (one input\n"
+           "                          only, required for stdin)\n"
+           "  -S, --max-size SIZE     also keep every part under SIZE bytes (K, M or G suffix), cutting\n"
+           "                          on keyframes from the packet sizes in the <input>.kfidx index\n"
+           "      --mode MODE         single-pass (default), per-part or parallel\n"
+           "                          (parallel with several inputs: all of them share one pool of\n"
+           "                          workers, reading and writing each disk only as hard as it takes)\n"
+           "  -j, --jobs N            workers for the parallel mode (default: from the disk type)\n"
+           "  -k, --keyframe-index    snap cuts to keyframes using an <input>.kfidx sidecar\n"
+           "  -f, --follow[=SECONDS]  split a recording still in progress as it grows, ending\n"
+           "                          once it stays unchanged for SECONDS (default 60); MKV or TS input\n"
+           "      --ts-copy           copy MPEG-TS parts as raw byte ranges between keyframes with\n"
+           "                          copy_file_range (shared blocks on btrfs/XFS), timestamps kept\n"
+           "      --smart-render      frame-exact cuts, re-encoding only up to the first keyframe of each part\n"
+           "      --silence-window S  move each cut to the quietest audio within S seconds around it,\n"
+           "                          then to the nearest keyframe unless --smart-render; the\n"
+           "                          keyframes are read near each cut, no full-file index is built\n"
+           "      --pipeline-depth N  packets read ahead on a separate thread, 0 disables (default 128)\n"
+           "      --io-buffer SIZE    bytes per read/write, with an optional K or M suffix, 0 uses\n"
+           "                          libavformat's file I/O (default 4M)\n"
+           "      --mux-queue SIZE    interleave each part in a queue of at most SIZE bytes (K, M or\n"
+           "                          G suffix) instead of the muxer's unbounded one\n"
+           "      --sparse-streams P  with --mux-queue, for streams silent longer than --sparse-delay:\n"
+           "                          heartbeat (default) writes their late packets as they come,\n"
+           "                          drop leaves them out (not with --checksum, which keeps them)\n"
+           "      --sparse-delay S    seconds the queue waits for a silent stream (default 2)\n"
+           "      --mmap              map the input into memory instead of reading it\n"
+           "      --no-preallocate    don't reserve each part's space on disk up front\n"
+           "      --journal           record finished parts in <input>.vsjob; rerunning an interrupted\n"
+           "                          split skips them and resumes at the first missing part\n"
+           "      --checksum          hash every copied packet into an <input>.vssum manifest\n"
+           "      --verify            instead of splitting, check the source of every part listed\n"
+           "                          in <input>.vssum against its checksums\n"
+           "      --probe-cache       remember probed inputs on disk, so rescanning a directory is quick\n"
+           "      --trace FILE        write a Chrome trace of each split (the last input's is kept)\n"
+           "                          and print a timing summary, needs a build with -Dtracing=true\n"
+           "      --preview           write a contact sheet of each part's start, middle and end\n"
+           "                          keyframes next to it (<part>.png), quick with --dry-run\n"
+           "  -n, --dry-run           print the plan without writing any part\n"
+           "  -h, --help              show this help\n",
+           program, program);
+}
+
+// Accepts a byte count with an optional K, M or G suffix
+static int parse_bytes(const char *text, int64_t *bytes) {
+    char *end;
+    long long value = strtoll(text, &end, 10);
+    if (end == text || value < 0) {
+        return -1;
+    }
+    int shift = 0;
+    if (*end == 'K' || *end == 'k') {
+        shift = 10;
+    } else if (*end == 'M' || *end == 'm') {
+        shift = 20;
+    } else if (*end == 'G' || *end == 'g') {
+        shift = 30;
+    }
+    if (shift) {
+        end++;
+    }
+    if (*end != '\0' || value > (INT64_MAX >> shift)) {
+        return -1;
+    }
+    *bytes = (int64_t)value << shift;
+    return 0;
+}
+
+// A byte count of at most 1G that fits an int
+static int parse_size(const char *text, int *bytes) {
+    int64_t value;
+    if (parse_bytes(text, &value) < 0 || value > (1 << 30)) {
+        return -1;
+    }
+    *bytes = (int)value;
+    return 0;
+}
+
+// Accepts HH:MM:SS, MM:SS or plain seconds
+static int parse_duration(const char *text, double *seconds) {
+    int fields[3];
+    char extra;
+    int count = sscanf(text, "%d:%d:%d%c", &fields[0], &fields[1], &fields[2], &extra);
+    if (count == 3 || (count == 2 && strchr(text, ':'))) {
+        double total = 0;
+        for (int i = 0; i < count; i++) {
+            if (fields[i] < 0) {
+                return -1;
+            }
+            total = total * 60.0 + fields[i];
+        }
+        *seconds = total;
+        return 0;
+    }
+
+    char *end;
+    double value = strtod(text, &end);
+    if (end == text || *end != '\0' || value < 0) {
+        return -1;
+    }
+    *seconds = value;
+    return 0;
+}
+
+static int has_video_extension(const char *filename) {
+    const char *dot = strrchr(filename, '.');
+    if (!dot) {
+        return 0;
+    }
+    for (int i = 0; video_extensions[i]; i++) {
+        if (strcasecmp(dot, video_extensions[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Outputs of an earlier run (<name>_partNN.<ext>) must not be split again
+static int is_split_output(const char *filename) {
+    const char *dot = strrchr(filename, '.');
+    size_t len = dot ? (size_t)(dot - filename) : strlen(filename);
+    return len >= 7 && strncmp(filename + len - 7, "_part", 5) == 0 &&
+           filename[len - 2] >= '0' && filename[len - 2] <= '9' &&
+           filename[len - 1] >= '0' && filename[len - 1] <= '9';
+}
+
+static int file_list_add(FileList *list, const char *path) {
+    if (list->count == list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 16;
+        char **items = realloc(list->items, capacity * sizeof(char *));
+        if (!items) {
+            return -1;
+        }
+        list->items = items;
+        list->capacity = capacity;
+    }
+    list->items[list->count] = strdup(path);
+    if (!list->items[list->count]) {
+        return -1;
+    }
+    list->count++;
+    return 0;
+}
+
+static int compare_paths(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int collect_directory(FileList *list, const char *directory) {
+    DIR *dir = opendir(directory);
+    if (!dir) {
+        fprintf(stderr, "Could not open directory '%s'\n", directory);
+        return -1;
+    }
+
+    int first = list->count;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.' || !has_video_extension(entry->d_name) ||
+            is_split_output(entry->d_name)) {
+            continue;
+        }
+
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+        struct stat st;
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if (file_list_add(list, path) < 0) {
+            closedir(dir);
+            return -1;
+        }
+    }
+    closedir(dir);
+
+    // readdir order is arbitrary, keep runs reproducible
+    qsort(list->items + first, list->count - first, sizeof(char *), compare_paths);
+    return 0;
+}
+
+static void print_plan(const SplitPlan *plan) {
+    printf("\n%s: %d parts\n", plan->input_filename, plan->total_parts);
+    for (int i = 0; i < plan->total_parts; i++) {
+        const SplitPart *part = &plan->parts[i];
+        printf("  part %02d  start %10.2f s  duration %10.2f s  %s\n",
+               part->number, part->start_time, part->duration, part->output_filename);
+    }
+}
+
+static void write_previews(const SplitPlan *plan) {
+    struct AVFrame **sheets = NULL;
+    if (preview_plan(plan, PREVIEW_WIDTH, &sheets) < 0) {
+        fprintf(stderr, "Could not preview '%s'\n", plan->input_filename);
+        return;
+    }
+    for (int i = 0; i < plan->total_parts; i++) {
+        char path[1024];
+        preview_sheet_path(&plan->parts[i], path, sizeof(path));
+        if (sheets[i] && preview_save_png(sheets[i], path) >= 0) {
+            printf("  preview of part %02d: %s\n", plan->parts[i].number, path);
+        }
+    }
+    preview_sheets_free(&sheets, plan->total_parts);
+}
+
+// Checks every input's parts against its manifest, freeing the list. failed
+// counts the inputs already lost while collecting them.
+static int verify_inputs(FileList *inputs, int failed) {
+    int total = inputs->count + failed;
+    for (int i = 0; i < inputs->count; i++) {
+        char manifest_path[1024];
+        checksum_manifest_path(inputs->items[i], manifest_path, sizeof(manifest_path));
+        printf("\n%s\n", inputs->items[i]);
+        if (checksum_verify(inputs->items[i], manifest_path) != 0) {
+            failed++;
+        }
+        free(inputs->items[i]);
+    }
+    free(inputs->items);
+
+    printf("\n%d of %d files verified\n", total - failed, total);
+    return failed ? 1 : 0;
+}
+
+// Plans every input, then cuts all their parts on one scheduler, freeing the
+// list. failed counts the inputs already lost while collecting them.
+static int split_scheduled(FileList *inputs, double max_duration, double min_duration,
+                           const SplitOptions *options, int preview, int failed) {
+    SplitScheduler *scheduler = NULL;
+    SplitPlan **plans = calloc(inputs->count, sizeof(SplitPlan *));
+    if (!plans || split_scheduler_new(options, &scheduler) < 0) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    for (int i = 0; i < inputs->count; i++) {
+        if (split_plan_create(inputs->items[i], max_duration, min_duration, options, &plans[i]) >= 0) {
+            print_plan(plans[i]);
+            if (preview) {
+                write_previews(plans[i]);
+            }
+            if (split_scheduler_add(scheduler, plans[i]) < 0) {
+                split_plan_free(&plans[i]);
+            }
+        }
+    }
+    split_scheduler_run(scheduler);
+    split_scheduler_free(&scheduler);
+
+    int succeeded = 0;
+    for (int i = 0; i < inputs->count; i++) {
+        int ok = plans[i] != NULL;
+        for (int p = 0; ok && p < plans[i]->total_parts; p++) {
+            ok = plans[i]->parts[p].skip || plans[i]->parts[p].result >= 0;
+        }
+        if (ok) {
+            succeeded++;
+        } else {
+            fprintf(stderr, "Failed to split '%s'\n", inputs->items[i]);
+            failed++;
+        }
+        split_plan_free(&plans[i]);
+        free(inputs->items[i]);
+    }
+    free(plans);
+    free(inputs->items);
+
+    printf("\n%d of %d files split successfully\n", succeeded, succeeded + failed);
+    return failed ? 1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+    enum { OPT_MODE = 256, OPT_PIPELINE_DEPTH, OPT_IO_BUFFER, OPT_MUX_QUEUE, OPT_SPARSE_STREAMS, OPT_SPARSE_DELAY, OPT_MMAP, OPT_NO_PREALLOCATE,
+           OPT_PROBE_CACHE, OPT_TRACE, OPT_SILENCE_WINDOW,
+           OPT_SMART_RENDER, OPT_TS_COPY, OPT_JOURNAL, OPT_CHECKSUM, OPT_VERIFY, OPT_PREVIEW };
+    static const struct option long_options[] = {
+        { "max", required_argument, NULL, 'M' },
+        { "min", required_argument, NULL, 'm' },
+        { "max-size", required_argument, NULL, 'S' },
+        { "output", required_argument, NULL, 'o' },
+        { "mode", required_argument, NULL, OPT_MODE },
+        { "jobs", required_argument, NULL, 'j' },
+        { "keyframe-index", no_argument, NULL, 'k' },
+        { "follow", optional_argument, NULL, 'f' },
+        { "smart-render", no_argument, NULL, OPT_SMART_RENDER },
+        { "ts-copy", no_argument, NULL, OPT_TS_COPY },
+        { "silence-window", required_argument, NULL, OPT_SILENCE_WINDOW },
+        { "pipeline-depth", required_argument, NULL, OPT_PIPELINE_DEPTH },
+        { "io-buffer", required_argument, NULL, OPT_IO_BUFFER },
+        { "mux-queue", required_argument, NULL, OPT_MUX_QUEUE },
+        { "sparse-streams", required_argument, NULL, OPT_SPARSE_STREAMS },
+        { "sparse-delay", required_argument, NULL, OPT_SPARSE_DELAY },
+        { "mmap", no_argument, NULL, OPT_MMAP },
+        { "no-preallocate", no_argument, NULL, OPT_NO_PREALLOCATE },
+        { "journal", no_argument, NULL, OPT_JOURNAL },
+        { "checksum", no_argument, NULL, OPT_CHECKSUM },
+        { "verify", no_argument, NULL, OPT_VERIFY },
+        { "probe-cache", no_argument, NULL, OPT_PROBE_CACHE },
+        { "trace", required_argument, NULL, OPT_TRACE },
+        { "preview", no_argument, NULL, OPT_PREVIEW },
+        { "dry-run", no_argument, NULL, 'n' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+
+    double max_duration = DEFAULT_MAX_DURATION;
+    double min_duration = DEFAULT_MIN_DURATION;
+    int dry_run = 0;
+    int preview = 0;
+    int verify = 0;
+    SplitOptions options;
+    split_options_init(&options);
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "M:m:S:o:j:kf::nh", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'M':
+            if (parse_duration(optarg, &max_duration) < 0 || max_duration <= 0) {
+                fprintf(stderr, "Invalid maximum duration '%s'\n", optarg);
+                return 2;
+            }
+            break;
+        case 'm':
+            if (parse_duration(optarg, &min_duration) < 0) {
+                fprintf(stderr, "Invalid minimum duration '%s'\n", optarg);
+                return 2;
+            }
+            break;
+        case 'S':
+            if (parse_bytes(optarg, &options.max_part_bytes) < 0 || options.max_part_bytes <= 0) {
+                fprintf(stderr, "Invalid maximum part size '%s'\n", optarg);
+                return 2;
+            }
+            break;
+        case 'o':
+            options.output_name = optarg;
+            break;
+        case OPT_MODE:
+            if (strcmp(optarg, "single-pass") == 0) {
+                options.mode = SPLIT_MODE_SINGLE_PASS;
+            } else if (strcmp(optarg, "per-part") == 0) {
+                options.mode = SPLIT_MODE_PER_PART;
+            } else if (strcmp(optarg, "parallel") == 0) {
+                options.mode = SPLIT_MODE_PARALLEL;
+            } else {
+                fprintf(stderr, "Unknown mode '%s'\n", optarg);
+                return 2;
+            }
+            break;
+        case 'j':
+            options.jobs = atoi(optarg);
+            if (options.jobs <= 0) {
+                fprintf(stderr, "Invalid job count '%s'\n", optarg);
+                return 2;
+            }
+            break;
+        case 'k':
+            options.use_keyframe_index = 1;
+            break;
+        case 'f':
+            options.follow = DEFAULT_FOLLOW_IDLE;
+            if (optarg) {
+                char *end;
+                options.follow = strtod(optarg, &end);
+                if (end == optarg || *end != '\0' || options.follow <= 0) {
+                    fprintf(stderr, "Invalid follow timeout '%s'\n", optarg);
+                    return 2;
+                }
+            }
+            break;
+        case OPT_SMART_RENDER:
+            options.smart_render = 1;
+            break;
+        case OPT_TS_COPY:
+            options.ts_copy = 1;
+            break;
+        case OPT_SILENCE_WINDOW: {
+            char *end;
+            options.silence_window = strtod(optarg, &end);
+            if (end == optarg || *end != '\0' || options.silence_window < 0) {
+                fprintf(stderr, "Invalid silence window '%s'\n", optarg);
+                return 2;
+            }
+            break;
+        }
+        case OPT_PIPELINE_DEPTH:
+            options.pipeline_depth = atoi(optarg);
+            if (options.pipeline_depth < 0) {
+                fprintf(stderr, "Invalid pipeline depth '%s'\n", optarg);
+                return 2;
+            }
+            break;
+        case OPT_IO_BUFFER:
+            if (parse_size(optarg, &options.io_buffer_size) < 0) {
+                fprintf(stderr, "Invalid I/O buffer size '%s'\n", optarg);
+                return 2;
+            }
+            break;
+        case OPT_MUX_QUEUE:
+            if (parse_bytes(optarg, &options.mux_queue_bytes) < 0 || options.mux_queue_bytes <= 0) {
+                fprintf(stderr, "Invalid muxing queue size '%s'\n", optarg);
+                return 2;
+            }
+            break;
+        case OPT_SPARSE_STREAMS:
+            if (strcmp(optarg, "heartbeat") == 0) {
+                options.mux_sparse = MUX_SPARSE_HEARTBEAT;
+            } else if (strcmp(optarg, "drop") == 0) {
+                options.mux_sparse = MUX_SPARSE_DROP;
+            } else {
+                fprintf(stderr, "Unknown sparse stream policy '%s'\n", optarg);
+                return 2;
+            }
+            break;
+        case OPT_SPARSE_DELAY: {
+            char *end;
+            options.mux_sparse_delay = strtod(optarg, &end);
+            if (end == optarg || *end != '\0' || options.mux_sparse_delay < 0) {
+                fprintf(stderr, "Invalid sparse stream delay '%s'\n", optarg);
+                return 2;
+            }
+            break;
+        }
+        case OPT_MMAP:
+            options.io_mmap = 1;
+            break;
+        case OPT_NO_PREALLOCATE:
+            options.io_preallocate = 0;
+            break;
+        case OPT_JOURNAL:
+            options.journal = 1;
+            break;
+        case OPT_CHECKSUM:
+            options.checksum = 1;
+            break;
+        case OPT_VERIFY:
+            verify = 1;
+            break;
+        case OPT_PROBE_CACHE:
+            options.probe_cache = 1;
+            break;
+        case OPT_TRACE:
+#ifndef VS_ENABLE_TRACE
+            fprintf(stderr, "Built without tracing, ignoring --trace\n");
+#endif
+            options.trace_path = optarg;
+            break;
+        case OPT_PREVIEW:
+            preview = 1;
+            break;
+        case 'n':
+            dry_run = 1;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    FileList inputs = {0};
+    int failed = 0;
+    for (int i = optind; i < argc; i++) {
+        struct stat st;
+        if (strcmp(argv[i], "-") == 0) {
+            st.st_mode = S_IFIFO;
+        } else if (stat(argv[i], &st) != 0) {
+            fprintf(stderr, "Could not access '%s'\n", argv[i]);
+            failed++;
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            if (collect_directory(&inputs, argv[i]) < 0) {
+                failed++;
+            }
+        } else if (file_list_add(&inputs, argv[i]) < 0) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+    }
+
+    if (verify) {
+        return verify_inputs(&inputs, failed);
+    }
+    if (options.output_name && inputs.count > 1) {
+        fprintf(stderr, "--output names the parts of a single input\n");
+        return 2;
+    }
+
+    if (options.mode == SPLIT_MODE_PARALLEL && options.follow <= 0 && inputs.count > 1 && !dry_run) {
+        return split_scheduled(&inputs, max_duration, min_duration, &options, preview, failed);
+    }
+
+    int succeeded = 0;
+    for (int i = 0; i < inputs.count; i++) {
+        SplitPlan *plan = NULL;
+        int ret = split_plan_create(inputs.items[i], max_duration, min_duration, &options, &plan);
+        if (ret >= 0) {
+            print_plan(plan);
+            if (preview) {
+                write_previews(plan);
+            }
+            if (!dry_run) {
+                ret = split_plan_execute(plan, &options);
+            }
+            split_plan_free(&plan);
+        }
+        if (ret < 0) {
+            fprintf(stderr, "Failed to split '%s'\n", inputs.items[i]);
+            failed++;
+        } else {
+            succeeded++;
+        }
+        free(inputs.items[i]);
+    }
+    free(inputs.items);
+
+    printf("\n%d of %d files split successfully\n", succeeded, succeeded + failed);
+    return failed ? 1 : 0;
+}
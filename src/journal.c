@@ -0,0 +1,225 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include "journal.h"
+#include <libavutil/avutil.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#define JOURNAL_MAGIC "VSJOB 1"
+#define JOURNAL_SUFFIX ".vsjob"
+#define FINGERPRINT_SPAN (64 << 10)  // bytes hashed at each end of a part
+
+struct SplitJournal {
+    char path[1024];
+    FILE *file;
+    pthread_mutex_t lock;  // parallel workers finish parts concurrently
+};
+
+void split_journal_path(const char *input_filename, char *path, size_t size) {
+    snprintf(path, size, "%s%s", input_filename, JOURNAL_SUFFIX);
+}
+
+// FNV-1a over the size and both ends of the file. Parts are far too big to
+// hash whole just to resume; a part cut short or rewritten by something else
+// changes its size or its tail.
+static int file_fingerprint(const char *filename, int64_t *size_out, uint64_t *hash_out) {
+    FILE *f = fopen(filename, "rb");
+    if (!f) {
+        return AVERROR(errno);
+    }
+
+    struct stat st;
+    if (fstat(fileno(f), &st) != 0) {
+        fclose(f);
+        return AVERROR(errno);
+    }
+    int64_t size = st.st_size;
+
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (int b = 0; b < 8; b++) {
+        hash = (hash ^ (uint8_t)(size >> (8 * b))) * 0x100000001b3ULL;
+    }
+
+    unsigned char *buffer = malloc(FINGERPRINT_SPAN);
+    if (!buffer) {
+        fclose(f);
+        return AVERROR(ENOMEM);
+    }
+    int64_t offsets[2] = { 0, size > FINGERPRINT_SPAN ? size - FINGERPRINT_SPAN : 0 };
+    int ret = 0;
+    for (int i = 0; i < 2 && ret == 0; i++) {
+        if (fseeko(f, offsets[i], SEEK_SET) != 0) {
+            ret = AVERROR(errno);
+            break;
+        }
+        size_t n = fread(buffer, 1, FINGERPRINT_SPAN, f);
+        for (size_t k = 0; k < n; k++) {
+            hash = (hash ^ buffer[k]) * 0x100000001b3ULL;
+        }
+    }
+    free(buffer);
+    fclose(f);
+
+    *size_out = size;
+    *hash_out = hash;
+    return ret;
+}
+
+// Header line number line of the journal of a plan, 0 once past the last one
+static int header_line(const SplitPlan *plan, const struct stat *st, int line, char *buf, size_t size) {
+    if (line == 0) {
+        snprintf(buf, size, "%s\n", JOURNAL_MAGIC);
+    } else if (line == 1) {
+        snprintf(buf, size, "input %lld %lld %s\n", (long long)st->st_size, (long long)st->st_mtime,
+                 plan->input_filename);
+    } else if (line - 2 < plan->total_parts) {
+        const SplitPart *part = &plan->parts[line - 2];
+        snprintf(buf, size, "part %d %.6f %.6f %s\n", part->number, part->start_time, part->duration,
+                 part->output_filename);
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+static int sync_file(FILE *f) {
+    if (fflush(f) != 0) {
+        return AVERROR(errno);
+    }
+#ifdef _WIN32
+    return _commit(_fileno(f)) == 0 ? 0 : AVERROR(errno);
+#else
+    return fsync(fileno(f)) == 0 ? 0 : AVERROR(errno);
+#endif
+}
+
+// Marks the parts an earlier run finished, returns how many were found or a
+// negative value when the journal belongs to another input or plan
+static int resume(FILE *f, SplitPlan *plan, const struct stat *st) {
+    char expected[2048], line[2048];
+
+    for (int i = 0; header_line(plan, st, i, expected, sizeof(expected)); i++) {
+        if (!fgets(line, sizeof(line), f) || strcmp(line, expected) != 0) {
+            return -1;
+        }
+    }
+
+    int resumed = 0;
+    while (fgets(line, sizeof(line), f)) {
+        int number;
+        long long size;
+        unsigned long long hash;
+        if (sscanf(line, "done %d %lld %llx", &number, &size, &hash) != 3 ||
+            number < 1 || number > plan->total_parts) {
+            // A line cut short by a crash ends the journal
+            break;
+        }
+
+        SplitPart *part = &plan->parts[number - 1];
+        int64_t actual_size;
+        uint64_t actual_hash;
+        if (file_fingerprint(part->output_filename, &actual_size, &actual_hash) < 0 ||
+            actual_size != size || actual_hash != hash) {
+            printf("Part %d changed since it was written, redoing it\n", number);
+            continue;
+        }
+        if (!part->skip) {
+            part->skip = 1;
+            part->result = 0;
+            resumed++;
+        }
+    }
+    return resumed;
+}
+
+int split_journal_open(SplitPlan *plan, SplitJournal **journal_out) {
+    struct stat st;
+    if (stat(plan->input_filename, &st) != 0) {
+        return AVERROR(errno);
+    }
+
+    SplitJournal *journal = calloc(1, sizeof(SplitJournal));
+    if (!journal) {
+        return AVERROR(ENOMEM);
+    }
+    split_journal_path(plan->input_filename, journal->path, sizeof(journal->path));
+    pthread_mutex_init(&journal->lock, NULL);
+
+    FILE *f = fopen(journal->path, "r");
+    if (f) {
+        int resumed = resume(f, plan, &st);
+        fclose(f);
+        if (resumed >= 0) {
+            if (resumed > 0) {
+                printf("Resuming from '%s', %d of %d parts already done\n", journal->path, resumed,
+                       plan->total_parts);
+            }
+            journal->file = fopen(journal->path, "a");
+        } else {
+            printf("Ignoring '%s', it was written for another split\n", journal->path);
+        }
+    }
+
+    if (!journal->file) {
+        char line[2048];
+        journal->file = fopen(journal->path, "w");
+        for (int i = 0; journal->file && header_line(plan, &st, i, line, sizeof(line)); i++) {
+            fputs(line, journal->file);
+        }
+        if (journal->file && sync_file(journal->file) < 0) {
+            fclose(journal->file);
+            journal->file = NULL;
+        }
+    }
+    if (!journal->file) {
+        int ret = AVERROR(errno ? errno : EIO);
+        fprintf(stderr, "Could not write journal '%s'\n", journal->path);
+        split_journal_close(&journal, 0);
+        return ret;
+    }
+
+    *journal_out = journal;
+    return 0;
+}
+
+int split_journal_part_done(SplitJournal *journal, const SplitPart *part) {
+    int64_t size;
+    uint64_t hash;
+    int ret = file_fingerprint(part->output_filename, &size, &hash);
+    if (ret < 0) {
+        return ret;
+    }
+
+    pthread_mutex_lock(&journal->lock);
+    fprintf(journal->file, "done %d %lld %016llx\n", part->number, (long long)size, (unsigned long long)hash);
+    ret = sync_file(journal->file);
+    pthread_mutex_unlock(&journal->lock);
+    if (ret < 0) {
+        fprintf(stderr, "Could not record part %d in '%s'\n", part->number, journal->path);
+    }
+    return ret;
+}
+
+void split_journal_close(SplitJournal **journal, int complete) {
+    if (!*journal) {
+        return;
+    }
+    if ((*journal)->file) {
+        fclose((*journal)->file);
+    }
+    if (complete) {
+        remove((*journal)->path);
+    }
+    pthread_mutex_destroy(&(*journal)->lock);
+    free(*journal);
+    *journal = NULL;
+}
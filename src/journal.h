@@ -0,0 +1,24 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "video_splitter.h"
+
+// On-disk record of a split job (<input>.vsjob) so a split that died halfway
+// resumes at the first unfinished part. It holds the input's size and mtime,
+// the plan, and one line per finished part with the part's size and a
+// fingerprint of its file. Lines are only appended, each flushed to disk
+// before the part counts as done.
+typedef struct SplitJournal SplitJournal;
+
+void split_journal_path(const char*, char*, size_t);
+
+// Opens the journal of a plan. When the journal on disk was written for the
+// same input and plan, every part it lists whose file is still intact gets
+// SplitPart.skip set; any other journal is replaced by a fresh one.
+int split_journal_open(SplitPlan*, SplitJournal**);
+// Records a finished part, safely on disk once this returns
+int split_journal_part_done(SplitJournal*, const SplitPart*);
+// Closes the journal, deleting it once the whole job is done
+void split_journal_close(SplitJournal**, int);
+
+#endif
@@ -0,0 +1,457 @@
+#define _GNU_SOURCE
+#include "keyframe_index.h"
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define KEYFRAME_INDEX_MAGIC "VSKI"
+#define KEYFRAME_INDEX_VERSION 2
+#define KEYFRAME_INDEX_HEADER_SIZE (4 + 4 + 8 + 8 + 4 + 4 + 4 + 8 + 4)
+#define KEYFRAME_ENTRY_SIZE (8 + 8 + 4 + 8)
+
+static void put_le32(uint8_t *buf, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        buf[i] = (uint8_t)(value >> (8 * i));
+    }
+}
+
+static void put_le64(uint8_t *buf, uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        buf[i] = (uint8_t)(value >> (8 * i));
+    }
+}
+
+static uint32_t get_le32(const uint8_t *buf) {
+    uint32_t value = 0;
+    for (int i = 3; i >= 0; i--) {
+        value = (value << 8) | buf[i];
+    }
+    return value;
+}
+
+static uint64_t get_le64(const uint8_t *buf) {
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--) {
+        value = (value << 8) | buf[i];
+    }
+    return value;
+}
+
+static int stat_file(const char *filename, int64_t *file_size, int64_t *mtime) {
+    struct stat st;
+    if (stat(filename, &st) != 0) {
+        return AVERROR(errno);
+    }
+    *file_size = (int64_t)st.st_size;
+    *mtime = (int64_t)st.st_mtime;
+    return 0;
+}
+
+static int compare_entries(const void *a, const void *b) {
+    const KeyframeEntry *ea = a, *eb = b;
+    return (ea->pts > eb->pts) - (ea->pts < eb->pts);
+}
+
+static int compare_positions(const void *a, const void *b) {
+    const KeyframeEntry *ea = a, *eb = b;
+    return (ea->pos > eb->pos) - (ea->pos < eb->pos);
+}
+
+void keyframe_index_sidecar_path(const char *filename, char *path, size_t max_len) {
+    snprintf(path, max_len, "%s.kfidx", filename);
+}
+
+void keyframe_index_free(KeyframeIndex **index) {
+    if (!*index) {
+        return;
+    }
+    free((*index)->entries);
+    free(*index);
+    *index = NULL;
+}
+
+static int append_entry(KeyframeIndex *index, int *capacity, const KeyframeEntry *entry) {
+    if (index->count == *capacity) {
+        int new_capacity = *capacity ? *capacity * 2 : 1024;
+        KeyframeEntry *entries = realloc(index->entries, new_capacity * sizeof(KeyframeEntry));
+        if (!entries) {
+            return AVERROR(ENOMEM);
+        }
+        index->entries = entries;
+        *capacity = new_capacity;
+    }
+    index->entries[index->count++] = *entry;
+    return 0;
+}
+
+// Keyframe whose GOP holds the byte at pos, -1 before the first one.
+// The entries are sorted by position.
+static int keyframe_at_pos(const KeyframeIndex *index, int64_t pos) {
+    int lo = 0, hi = index->count - 1, found = -1;
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (index->entries[mid].pos <= pos) {
+            found = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return found;
+}
+
+// Every stream has sample sizes in the demuxer's index, as MP4/MOV give
+static int index_has_sizes(const AVFormatContext *input_ctx) {
+    for (unsigned i = 0; i < input_ctx->nb_streams; i++) {
+        AVStream *stream = input_ctx->streams[i];
+        if (avformat_index_get_entries_count(stream) == 0 || avformat_index_get_entry(stream, 0)->size <= 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// MP4/MOV read an index of every sample of every stream with the header and
+// Matroska reads its cues, so their keyframes and GOP sizes are known without
+// reading any packet. GOPs of an MP4 add up their samples' sizes; Matroska
+// cues have no sizes, a GOP spans the bytes up to the next keyframe's cluster.
+// Gives 1 when the index was filled in, 0 when the file has to be scanned.
+static int index_from_demuxer(AVFormatContext *input_ctx, KeyframeIndex *index, int *capacity, AVPacket *packet) {
+    const char *format = input_ctx->iformat->name;
+    int matroska = strstr(format, "matroska") != NULL;
+    if (!matroska && !strstr(format, "mov")) {
+        return 0;
+    }
+
+    AVStream *video = input_ctx->streams[index->stream_index];
+    int entry_count = avformat_index_get_entries_count(video);
+    // A fragmented MP4 only has its first fragment indexed after the header
+    if (!matroska && (video->nb_frames <= 0 || entry_count < video->nb_frames)) {
+        return 0;
+    }
+    for (int i = 0; i < entry_count; i++) {
+        const AVIndexEntry *entry = avformat_index_get_entry(video, i);
+        if ((entry->flags & AVINDEX_KEYFRAME) && entry->pos >= 0 && entry->timestamp != AV_NOPTS_VALUE) {
+            KeyframeEntry keyframe = { .pts = entry->timestamp, .pos = entry->pos, .size = entry->size };
+            int ret = append_entry(index, capacity, &keyframe);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+    }
+    if (index->count == 0) {
+        return 0;
+    }
+    qsort(index->entries, index->count, sizeof(KeyframeEntry), compare_positions);
+
+    if (!matroska && index_has_sizes(input_ctx)) {
+        for (unsigned s = 0; s < input_ctx->nb_streams; s++) {
+            AVStream *stream = input_ctx->streams[s];
+            int count = avformat_index_get_entries_count(stream);
+            for (int i = 0; i < count; i++) {
+                const AVIndexEntry *entry = avformat_index_get_entry(stream, i);
+                int k = keyframe_at_pos(index, entry->pos);
+                index->entries[k < 0 ? 0 : k].gop_bytes += entry->size;
+                index->packet_bytes += entry->size;
+            }
+        }
+    } else {
+        for (int i = 0; i < index->count; i++) {
+            int64_t end = i + 1 < index->count ? index->entries[i + 1].pos : index->file_size;
+            index->entries[i].gop_bytes = end > index->entries[i].pos ? end - index->entries[i].pos : 0;
+            index->packet_bytes += index->entries[i].gop_bytes;
+        }
+    }
+
+    // MP4 indexes samples by dts. The first keyframe's packet tells how far
+    // its pts is ahead, the same reordering delay holds for the others.
+    if (!matroska) {
+        for (int n = 0; n < 1024 && av_read_frame(input_ctx, packet) >= 0; n++) {
+            int found = packet->stream_index == index->stream_index && (packet->flags & AV_PKT_FLAG_KEY);
+            if (found && packet->pos == index->entries[0].pos && packet->pts != AV_NOPTS_VALUE) {
+                int64_t delay = packet->pts - index->entries[0].pts;
+                for (int i = 0; i < index->count; i++) {
+                    index->entries[i].pts += delay;
+                }
+            }
+            av_packet_unref(packet);
+            if (found) {
+                break;
+            }
+        }
+    }
+    return 1;
+}
+
+int keyframe_index_build(const char *filename, KeyframeIndex **index_out) {
+    AVFormatContext *input_ctx = NULL;
+    AVPacket *packet = NULL;
+    int capacity = 0;
+
+    KeyframeIndex *index = calloc(1, sizeof(KeyframeIndex));
+    if (!index) {
+        return AVERROR(ENOMEM);
+    }
+
+    int ret = stat_file(filename, &index->file_size, &index->mtime);
+    if (ret < 0) {
+        fprintf(stderr, "Could not stat '%s'\n", filename);
+        goto fail;
+    }
+
+    ret = avformat_open_input(&input_ctx, filename, NULL, NULL);
+    if (ret < 0) {
+        fprintf(stderr, "Could not open input file '%s'\n", filename);
+        goto fail;
+    }
+
+    ret = avformat_find_stream_info(input_ctx, NULL);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to retrieve input stream information\n");
+        goto fail;
+    }
+
+    ret = av_find_best_stream(input_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (ret < 0) {
+        fprintf(stderr, "No video stream to index in '%s'\n", filename);
+        goto fail;
+    }
+    index->stream_index = ret;
+    index->time_base = input_ctx->streams[ret]->time_base;
+    index->start_time = input_ctx->start_time != AV_NOPTS_VALUE ? input_ctx->start_time : 0;
+
+    packet = av_packet_alloc();
+    if (!packet) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    ret = index_from_demuxer(input_ctx, index, &capacity, packet);
+    if (ret < 0) {
+        goto fail;
+    }
+    if (ret > 0) {
+        qsort(index->entries, index->count, sizeof(KeyframeEntry), compare_entries);
+        av_packet_free(&packet);
+        avformat_close_input(&input_ctx);
+        *index_out = index;
+        return 0;
+    }
+
+    // Without such an index (MPEG-TS and the like) every packet of every
+    // stream is read for the GOP sizes, payloads included
+    int64_t leading_bytes = 0;  // packets before the first keyframe
+    while ((ret = av_read_frame(input_ctx, packet)) >= 0) {
+        if (packet->stream_index == index->stream_index && (packet->flags & AV_PKT_FLAG_KEY)) {
+            KeyframeEntry entry = {
+                .pts = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts,
+                .pos = packet->pos,
+                .size = packet->size,
+                .gop_bytes = index->count == 0 ? leading_bytes : 0,
+            };
+            if (entry.pts != AV_NOPTS_VALUE) {
+                ret = append_entry(index, &capacity, &entry);
+                if (ret < 0) {
+                    av_packet_unref(packet);
+                    goto fail;
+                }
+            }
+        }
+        if (index->count > 0) {
+            index->entries[index->count - 1].gop_bytes += packet->size;
+        } else {
+            leading_bytes += packet->size;
+        }
+        index->packet_bytes += packet->size;
+        av_packet_unref(packet);
+    }
+    if (ret != AVERROR_EOF) {
+        fprintf(stderr, "Error reading '%s' while indexing\n", filename);
+        goto fail;
+    }
+
+    qsort(index->entries, index->count, sizeof(KeyframeEntry), compare_entries);
+
+    av_packet_free(&packet);
+    avformat_close_input(&input_ctx);
+    *index_out = index;
+    return 0;
+
+fail:
+    av_packet_free(&packet);
+    avformat_close_input(&input_ctx);
+    keyframe_index_free(&index);
+    return ret;
+}
+
+int keyframe_index_save(const char *filename, const KeyframeIndex *index) {
+    char path[1024], tmp_path[1040];
+    keyframe_index_sidecar_path(filename, path, sizeof(path));
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    FILE *fp = fopen(tmp_path, "wb");
+    if (!fp) {
+        fprintf(stderr, "Could not create keyframe index '%s'\n", tmp_path);
+        return AVERROR(errno);
+    }
+
+    uint8_t header[KEYFRAME_INDEX_HEADER_SIZE];
+    memcpy(header, KEYFRAME_INDEX_MAGIC, 4);
+    put_le32(header + 4, KEYFRAME_INDEX_VERSION);
+    put_le64(header + 8, (uint64_t)index->file_size);
+    put_le64(header + 16, (uint64_t)index->mtime);
+    put_le32(header + 24, (uint32_t)index->stream_index);
+    put_le32(header + 28, (uint32_t)index->time_base.num);
+    put_le32(header + 32, (uint32_t)index->time_base.den);
+    put_le64(header + 36, (uint64_t)index->start_time);
+    put_le32(header + 44, (uint32_t)index->count);
+    int ok = fwrite(header, sizeof(header), 1, fp) == 1;
+
+    for (int i = 0; ok && i < index->count; i++) {
+        uint8_t entry[KEYFRAME_ENTRY_SIZE];
+        put_le64(entry, (uint64_t)index->entries[i].pts);
+        put_le64(entry + 8, (uint64_t)index->entries[i].pos);
+        put_le32(entry + 16, (uint32_t)index->entries[i].size);
+        put_le64(entry + 20, (uint64_t)index->entries[i].gop_bytes);
+        ok = fwrite(entry, sizeof(entry), 1, fp) == 1;
+    }
+
+    if (fclose(fp) != 0) {
+        ok = 0;
+    }
+    if (!ok || rename(tmp_path, path) != 0) {
+        fprintf(stderr, "Could not write keyframe index '%s'\n", path);
+        remove(tmp_path);
+        return AVERROR(EIO);
+    }
+    return 0;
+}
+
+int keyframe_index_load(const char *filename, KeyframeIndex **index_out) {
+    char path[1024];
+    keyframe_index_sidecar_path(filename, path, sizeof(path));
+
+    int64_t file_size, mtime;
+    int ret = stat_file(filename, &file_size, &mtime);
+    if (ret < 0) {
+        return ret;
+    }
+
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        return AVERROR_INVALIDDATA;
+    }
+
+    KeyframeIndex *index = NULL;
+    uint8_t header[KEYFRAME_INDEX_HEADER_SIZE];
+    ret = AVERROR_INVALIDDATA;
+    if (fread(header, sizeof(header), 1, fp) != 1 ||
+        memcmp(header, KEYFRAME_INDEX_MAGIC, 4) != 0 ||
+        get_le32(header + 4) != KEYFRAME_INDEX_VERSION ||
+        (int64_t)get_le64(header + 8) != file_size ||
+        (int64_t)get_le64(header + 16) != mtime) {
+        goto fail;
+    }
+
+    index = calloc(1, sizeof(KeyframeIndex));
+    if (!index) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    index->file_size = file_size;
+    index->mtime = mtime;
+    index->stream_index = (int)get_le32(header + 24);
+    index->time_base.num = (int)get_le32(header + 28);
+    index->time_base.den = (int)get_le32(header + 32);
+    index->start_time = (int64_t)get_le64(header + 36);
+    uint32_t count = get_le32(header + 44);
+    if (index->time_base.num <= 0 || index->time_base.den <= 0 || count > INT32_MAX / KEYFRAME_ENTRY_SIZE) {
+        goto fail;
+    }
+
+    index->entries = calloc(count ? count : 1, sizeof(KeyframeEntry));
+    if (!index->entries) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t entry[KEYFRAME_ENTRY_SIZE];
+        if (fread(entry, sizeof(entry), 1, fp) != 1) {
+            goto fail;
+        }
+        index->entries[i].pts = (int64_t)get_le64(entry);
+        index->entries[i].pos = (int64_t)get_le64(entry + 8);
+        index->entries[i].size = (int32_t)get_le32(entry + 16);
+        index->entries[i].gop_bytes = (int64_t)get_le64(entry + 20);
+        index->packet_bytes += index->entries[i].gop_bytes;
+    }
+    index->count = (int)count;
+
+    fclose(fp);
+    *index_out = index;
+    return 0;
+
+fail:
+    fclose(fp);
+    keyframe_index_free(&index);
+    return ret;
+}
+
+int keyframe_index_get(const char *filename, KeyframeIndex **index) {
+    if (keyframe_index_load(filename, index) == 0) {
+        printf("Using keyframe index with %d keyframes\n", (*index)->count);
+        return 0;
+    }
+
+    printf("Building keyframe index for '%s'\n", filename);
+    int ret = keyframe_index_build(filename, index);
+    if (ret < 0) {
+        return ret;
+    }
+    printf("Indexed %d keyframes\n", (*index)->count);
+
+    // The index is still usable for this run if the sidecar can't be written
+    keyframe_index_save(filename, *index);
+    return 0;
+}
+
+double keyframe_index_time(const KeyframeIndex *index, int i) {
+    return index->entries[i].pts * av_q2d(index->time_base) - (double)index->start_time / AV_TIME_BASE;
+}
+
+int keyframe_index_at_or_before(const KeyframeIndex *index, double time) {
+    int low = 0, high = index->count - 1, found = 0;
+    while (low <= high) {
+        int mid = low + (high - low) / 2;
+        if (keyframe_index_time(index, mid) <= time) {
+            found = mid;
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+    return found;
+}
+
+int keyframe_index_nearest(const KeyframeIndex *index, double time) {
+    if (index->count == 0) {
+        return -1;
+    }
+    int i = keyframe_index_at_or_before(index, time);
+    if (i + 1 < index->count &&
+        keyframe_index_time(index, i + 1) - time < time - keyframe_index_time(index, i)) {
+        return i + 1;
+    }
+    return i;
+}
+
+int64_t keyframe_index_bytes(const KeyframeIndex *index, int first, int end) {
+    int64_t bytes = 0;
+    for (int i = first; i < end && i < index->count; i++) {
+        bytes += index->entries[i].gop_bytes;
+    }
+    return bytes;
+}
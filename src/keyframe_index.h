@@ -0,0 +1,60 @@
+#ifndef KEYFRAME_INDEX_H
+#define KEYFRAME_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <libavutil/avutil.h>
+
+typedef struct {
+    int64_t pts;   // in the indexed stream's time base
+    int64_t pos;   // byte offset of the packet in the file, -1 when unknown
+    int32_t size;  // packet size in bytes
+    // Payload of every stream's packets from this keyframe up to the next
+    // one, in file order; the first keyframe also counts what comes before it
+    int64_t gop_bytes;
+} KeyframeEntry;
+
+typedef struct KeyframeIndex {
+    // identify the file the index was built from
+    int64_t file_size;
+    int64_t mtime;
+
+    int stream_index;
+    AVRational time_base;
+    int64_t start_time;  // container start time in AV_TIME_BASE units
+    int count;
+    KeyframeEntry *entries;  // sorted by pts
+    int64_t packet_bytes;    // payload of every packet in the file, the sum of gop_bytes
+} KeyframeIndex;
+
+// Records every keyframe of a file's video stream and how many packet bytes
+// each GOP spans. MP4/MOV and Matroska with cues are indexed from the
+// demuxer's own index without reading packets; other inputs, MPEG-TS among
+// them, are read packet by packet to the end, payloads included.
+int keyframe_index_build(const char*, KeyframeIndex**);
+
+// Sidecar next to the input (<input>.kfidx). load fails with AVERROR_INVALIDDATA
+// when the sidecar is missing, corrupt or was made for another size/mtime.
+int keyframe_index_load(const char*, KeyframeIndex**);
+int keyframe_index_save(const char*, const KeyframeIndex*);
+
+// Loads the sidecar if it is still valid, otherwise builds and saves it
+int keyframe_index_get(const char*, KeyframeIndex**);
+
+void keyframe_index_free(KeyframeIndex**);
+
+void keyframe_index_sidecar_path(const char*, char*, size_t);
+
+// Time of a keyframe in seconds from the start of the file
+double keyframe_index_time(const KeyframeIndex*, int);
+
+// Keyframe closest to a time in seconds, -1 for an empty index
+int keyframe_index_nearest(const KeyframeIndex*, double);
+
+// Last keyframe at or before a time in seconds, 0 if the time is before the first one
+int keyframe_index_at_or_before(const KeyframeIndex*, double);
+
+// Packet bytes of the GOPs from keyframe first up to, not including, keyframe end
+int64_t keyframe_index_bytes(const KeyframeIndex*, int, int);
+
+#endif
@@ -2,7 +2,11 @@
 #include <libavformat/avformat.h>
 #include <stdio.h>
 #include "libavutil/avutil.h"
+#include "probe.h"
+#include "keyframe_index.h"
+#include "preview.h"
 #include "video_splitter.h"
+#include "scheduler.h"
 
 const int MAX_SIZE_IN_SECS = 4 * 60 * 60; // 4 hours
 #define SPLIT_VIDEO_DURATION (4.0 * 3600.0)  // 4 hours in seconds
@@ -11,6 +15,8 @@ const int MAX_SIZE_IN_SECS = 4 * 60 * 60; // 4 hours
 #define MIN_HOURS_VIDEO "00"
 #define MIN_MINUTES_VIDEO "30"
 #define DEFAULT_SECONDS "00"
+#define PLAN_THUMBS_MARGIN 100  // rows on either side of the visible ones that keep their thumbnails
+#define PLAN_THUMB_WIDTH 64  // pixels of each of a row's start, middle and end thumbnails
 
 typedef struct {
     char* filename;
@@ -25,12 +31,85 @@ typedef struct {
     GtkWidget *seconds;
 } TimeInputData;
 
+enum {
+    PLAN_COLUMN_SELECTED,
+    PLAN_COLUMN_THUMBNAIL,
+    PLAN_COLUMN_NAME,
+    PLAN_COLUMN_START,
+    PLAN_COLUMN_DURATION,
+    PLAN_COLUMN_SIZE,
+    PLAN_COLUMNS
+};
+
+typedef enum {
+    THUMBNAIL_NONE,
+    THUMBNAIL_RENDERING,
+    THUMBNAIL_DONE,  // shown, or nothing could be decoded for it
+} PlanThumbnailState;
+
+// The parts of a planned split, in a tree view that only lays out and draws
+// the rows in sight. Sizes are estimated on a thread and only the rows near
+// the visible ones get thumbnails, rendered on another, so plans with
+// thousands of parts open at once. Shared with those threads and the split
+// thread, freed with the last reference.
+typedef struct {
+    gint refs;
+    SplitPlan *plan;
+    gboolean *selected;      // per part, the unchecked ones are skipped
+    int64_t *estimates;      // per part, NULL until the estimate thread is done
+    guint8 *thumbnails;      // per part, a PlanThumbnailState
+    gboolean rendering;      // a thumbnail thread is running
+    GtkWidget *list;
+    GtkListStore *store;     // a row per part, only touched on the main loop
+    GtkWidget *summary_label;
+    gboolean closed;         // the list dropped the plan, only touched on the main loop
+} PlanView;
+
+typedef struct {
+    PlanView *view;
+    char *filename;
+    int64_t *estimates;
+} PlanEstimate;
+
+typedef struct {
+    PlanView *view;
+    int first;
+    int count;
+    GdkPixbuf **sheets;  // per part from first on, NULL where nothing could be decoded
+} PlanThumbnails;
+
 typedef struct {
     TimeInputData *max_duration;
     TimeInputData *min_duration;
     char* filename;
+    gchar **queue;  // inputs split together on one scheduler, NULL for a single file
+
+    // Parts of a single file, once previewed
+    GtkWidget *preview_button;
+    GtkWidget *plan_list;
+    GtkWidget *plan_summary;
+    PlanView *plan_view;   // NULL until previewed or after the durations changed
+    PlanView *split_view;  // the plan the split thread executes, referenced for it
+
+    // widgets updated while the split runs in the background
+    GtkWidget *split_button;
+    GtkWidget *cancel_button;
+    GtkWidget *progress_bar;
+    GtkWidget *status_label;
+
+    SplitCancelToken *cancel;  // set while a split is running
+    double max_seconds;
+    double min_seconds;
+    int result;
+    gboolean window_closed;
 } SplitVideoInput; 
 
+typedef struct {
+    SplitVideoInput *input;
+    SplitProgress progress;
+    char *input_name;  // progress.input may be gone by the time the update runs
+} SplitProgressUpdate;
+
 TimeInputData* create_time_input(GtkWidget *parent_box, const char* default_hours, const char* default_minutes, const char* default_seconds) {
     GtkWidget *time_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
 
@@ -119,62 +198,302 @@ void size_into_readable(const VideoInfo *info, char *buf, size_t buf_size) {
 }
 
 VideoInfo *get_video_info(const char* video_path) {
-    AVFormatContext *input_ctx = NULL;
-    int ret = avformat_open_input(&input_ctx, video_path, NULL, NULL);
-    if (ret != 0) {
+    // Probed once here; the split reuses the same probe from the cache
+    MediaProbe *probe = NULL;
+    if (media_probe_get(video_path, 1, &probe) < 0) {
         fprintf(stderr, "Error opening input file %s\n", video_path);
         return NULL;
     }
 
-    ret = avformat_find_stream_info(input_ctx, NULL);
-    if (ret != 0) {
-        fprintf(stderr, "Error obtaining stream info %s\n", video_path);
-        return NULL;
-    }
-    av_dump_format(input_ctx,0 , video_path, 0);
-    
     VideoInfo *video_info = malloc(sizeof(VideoInfo));
+    if (video_info) {
+        video_info->filename = g_strdup(video_path);
+        video_info->duration = probe->duration;
+        video_info->filesize = (long)probe->file_size;
+    }
+    media_probe_unref(&probe);
+    return video_info;
+}
 
-    video_info->filename = g_strdup(video_path);
-    if (input_ctx->duration != AV_NOPTS_VALUE) {
-        video_info->duration = (double)input_ctx->duration / AV_TIME_BASE;
-    } else {
-        video_info->duration = -1.0;
+static void free_video_info(VideoInfo *video_info) {
+    if (video_info) {
+        g_free(video_info->filename);
+        free(video_info);
+    }
+}
+
+static void format_duration(double seconds, char *buf, size_t buf_size) {
+    int secs = (int)seconds;
+    snprintf(buf, buf_size, "%02d:%02d:%02d", secs / 3600, (secs / 60) % 60, secs % 60);
+}
+
+// One part of a plan, exported: its file, start, duration and, until it is
+// estimated, no size. The thumbnail comes once the row is in sight.
+static void append_split_row(GtkListStore *store, const char *video_name, double start, double duration) {
+    char start_buf[32], duration_buf[32];
+    format_duration(start, start_buf, sizeof(start_buf));
+    format_duration(duration, duration_buf, sizeof(duration_buf));
+
+    GtkTreeIter iter;
+    gtk_list_store_insert_with_values(store, &iter, -1,
+                                      PLAN_COLUMN_SELECTED, TRUE,
+                                      PLAN_COLUMN_NAME, video_name,
+                                      PLAN_COLUMN_START, start_buf,
+                                      PLAN_COLUMN_DURATION, duration_buf,
+                                      PLAN_COLUMN_SIZE, "...",
+                                      -1);
+}
+
+static PlanView *plan_view_ref(PlanView *view) {
+    g_atomic_int_inc(&view->refs);
+    return view;
+}
+
+// May run on any thread, the widgets are never touched here
+static void plan_view_unref(PlanView **view) {
+    if (*view && g_atomic_int_dec_and_test(&(*view)->refs)) {
+        split_plan_free(&(*view)->plan);
+        g_free((*view)->selected);
+        g_free((*view)->estimates);
+        g_free((*view)->thumbnails);
+        g_free(*view);
+    }
+    *view = NULL;
+}
+
+static void update_plan_summary(PlanView *view) {
+    int selected = 0;
+    int64_t bytes = 0;
+    for (int i = 0; i < view->plan->total_parts; i++) {
+        if (view->selected[i]) {
+            selected++;
+            bytes += view->estimates ? view->estimates[i] : 0;
+        }
     }
 
-    FILE *fp = fopen(video_path, "rb");
-    if (fp == NULL) {
-        fprintf(stderr, "Error obtaining file size");
-        video_info->filesize = -1;
+    char buf[128];
+    if (view->estimates) {
+        char size[32];
+        size_into_readable(&(VideoInfo){ .filesize = (long)bytes }, size, sizeof(size));
+        snprintf(buf, sizeof(buf), "%d of %d parts selected, about %s", selected, view->plan->total_parts,
+                 size);
     } else {
-        fseek(fp, 0, SEEK_END);
-        long file_size = ftell(fp);
-        fclose(fp);
-        video_info->filesize = file_size;
+        snprintf(buf, sizeof(buf), "%d of %d parts selected, estimating sizes...", selected,
+                 view->plan->total_parts);
     }
-    return video_info;
-    
+    gtk_label_set_text(GTK_LABEL(view->summary_label), buf);
+}
+
+static void get_row(PlanView *view, int part, GtkTreeIter *iter) {
+    gtk_tree_model_iter_nth_child(GTK_TREE_MODEL(view->store), iter, NULL, part);
 }
 
-GtkWidget *make_split_row(const char *video_name, const char *part, double val) {
-    GtkWidget *row = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 10);  
+static void set_row_size(PlanView *view, int part) {
+    char size[32];
+    size_into_readable(&(VideoInfo){ .filesize = (long)view->estimates[part] }, size, sizeof(size));
+    GtkTreeIter iter;
+    get_row(view, part, &iter);
+    gtk_list_store_set(view->store, &iter, PLAN_COLUMN_SIZE, size, -1);
+}
 
-    GtkWidget *video_name_label = gtk_label_new(video_name);
-    gtk_box_pack_start(GTK_BOX(row), video_name_label, FALSE, FALSE, 0);
+static void on_part_toggled(GtkCellRendererToggle *renderer, gchar *path, gpointer user_data) {
+    SplitVideoInput *split_video_input = user_data;
+    PlanView *view = split_video_input->plan_view;
+    if (!view) {
+        return;
+    }
+    GtkTreePath *tree_path = gtk_tree_path_new_from_string(path);
+    int part = gtk_tree_path_get_indices(tree_path)[0];
+    gtk_tree_path_free(tree_path);
 
-    GtkWidget *part_label = gtk_label_new(part);
-    gtk_box_pack_start(GTK_BOX(row), part_label, FALSE, FALSE, 0);
+    view->selected[part] = !view->selected[part];
+    GtkTreeIter iter;
+    get_row(view, part, &iter);
+    gtk_list_store_set(view->store, &iter, PLAN_COLUMN_SELECTED, view->selected[part], -1);
+    update_plan_summary(view);
+}
 
-    char buf[32];
-    snprintf(buf, sizeof(buf), "%.2f", val);
-    GtkWidget *label_val = gtk_label_new(buf);
-    gtk_box_pack_start(GTK_BOX(row), label_val, FALSE, FALSE, 0);
+// Runs on the main loop, queued by estimate_plan_thread()
+static gboolean on_plan_estimated(gpointer user_data) {
+    PlanEstimate *estimate = user_data;
+    PlanView *view = estimate->view;
 
-    GtkWidget *check = gtk_check_button_new();
-    gtk_box_pack_start(GTK_BOX(row), check, FALSE, FALSE, 0);
+    if (!view->closed && estimate->estimates) {
+        view->estimates = estimate->estimates;
+        estimate->estimates = NULL;
+        for (int i = 0; i < view->plan->total_parts; i++) {
+            set_row_size(view, i);
+        }
+        update_plan_summary(view);
+    } else if (!view->closed) {
+        gtk_label_set_text(GTK_LABEL(view->summary_label), "Could not index the video to estimate sizes");
+    }
 
-    return row;
+    plan_view_unref(&estimate->view);
+    g_free(estimate->estimates);
+    g_free(estimate->filename);
+    g_free(estimate);
+    return G_SOURCE_REMOVE;
 }
+
+// Sizes come from the packet bytes of each part's GOPs in the keyframe
+// index, which is built on the first preview of a file and loaded after that
+static gpointer estimate_plan_thread(gpointer user_data) {
+    PlanEstimate *estimate = user_data;
+    const SplitPlan *plan = estimate->view->plan;
+    KeyframeIndex *index = NULL;
+
+    if (keyframe_index_get(estimate->filename, &index) >= 0 && index->count > 0) {
+        double overhead = index->packet_bytes > 0 ? (double)index->file_size / index->packet_bytes : 1.0;
+        estimate->estimates = g_new0(int64_t, plan->total_parts);
+        for (int i = 0; i < plan->total_parts; i++) {
+            const SplitPart *part = &plan->parts[i];
+            int first = i == 0 ? 0 : keyframe_index_at_or_before(index, part->start_time);
+            int end = i + 1 < plan->total_parts
+                      ? keyframe_index_at_or_before(index, part->start_time + part->duration)
+                      : index->count;
+            estimate->estimates[i] = (int64_t)(keyframe_index_bytes(index, first, end) * overhead);
+        }
+    }
+    keyframe_index_free(&index);
+    g_idle_add(on_plan_estimated, estimate);
+    return NULL;
+}
+
+static void render_plan_thumbnails(PlanView *view);
+
+// Runs on the main loop, queued by plan_thumbnails_thread()
+static gboolean on_plan_thumbnails(gpointer user_data) {
+    PlanThumbnails *thumbnails = user_data;
+    PlanView *view = thumbnails->view;
+
+    for (int i = 0; i < thumbnails->count; i++) {
+        GdkPixbuf *sheet = thumbnails->sheets ? thumbnails->sheets[i] : NULL;
+        if (!view->closed) {
+            int part = thumbnails->first + i;
+            GtkTreeIter iter;
+            get_row(view, part, &iter);
+            gtk_list_store_set(view->store, &iter, PLAN_COLUMN_THUMBNAIL, sheet, -1);
+            view->thumbnails[part] = THUMBNAIL_DONE;
+        }
+        if (sheet) {
+            g_object_unref(sheet);
+        }
+    }
+    view->rendering = FALSE;
+    render_plan_thumbnails(view);  // rows scrolled to while these were rendering
+
+    plan_view_unref(&thumbnails->view);
+    g_free(thumbnails->sheets);
+    g_free(thumbnails);
+    return G_SOURCE_REMOVE;
+}
+
+static void free_sheet_pixels(guchar *pixels, gpointer user_data) {
+    AVFrame *sheet = user_data;
+    av_frame_free(&sheet);
+}
+
+// Only the keyframes at the start, middle and end of the parts of the rows
+// in sight are decoded, see preview_parts()
+static gpointer plan_thumbnails_thread(gpointer user_data) {
+    PlanThumbnails *thumbnails = user_data;
+    AVFrame **sheets = NULL;
+
+    if (preview_parts(thumbnails->view->plan, thumbnails->first, thumbnails->count, PLAN_THUMB_WIDTH,
+                      &sheets) >= 0) {
+        thumbnails->sheets = g_new0(GdkPixbuf *, thumbnails->count);
+        for (int i = 0; i < thumbnails->count; i++) {
+            AVFrame *sheet = sheets[i];
+            if (sheet) {
+                // The pixbuf keeps the frame's pixels and frees them with it
+                thumbnails->sheets[i] =
+                    gdk_pixbuf_new_from_data(sheet->data[0], GDK_COLORSPACE_RGB, FALSE, 8, sheet->width,
+                                             sheet->height, sheet->linesize[0], free_sheet_pixels, sheet);
+                sheets[i] = NULL;
+            }
+        }
+        preview_sheets_free(&sheets, thumbnails->count);
+    }
+    g_idle_add(on_plan_thumbnails, thumbnails);
+    return NULL;
+}
+
+// Rows of the list in sight, FALSE before it is laid out
+static gboolean get_visible_parts(PlanView *view, int *first, int *last) {
+    GtkTreePath *start, *end;
+    if (!gtk_tree_view_get_visible_range(GTK_TREE_VIEW(view->list), &start, &end)) {
+        return FALSE;
+    }
+    *first = gtk_tree_path_get_indices(start)[0];
+    *last = gtk_tree_path_get_indices(end)[0];
+    gtk_tree_path_free(start);
+    gtk_tree_path_free(end);
+    return TRUE;
+}
+
+// One thread at a time renders the visible rows that have no thumbnail yet,
+// so a quick scroll only pays for where the list stops. Thumbnails of rows
+// far out of sight are dropped again, scrolling through a long plan doesn't
+// keep one per part.
+static void render_plan_thumbnails(PlanView *view) {
+    int first, last;
+    if (view->closed || view->rendering || !get_visible_parts(view, &first, &last)) {
+        return;
+    }
+    for (int i = 0; i < view->plan->total_parts; i++) {
+        gboolean far = i < first - PLAN_THUMBS_MARGIN || i > last + PLAN_THUMBS_MARGIN;
+        if (view->thumbnails[i] == THUMBNAIL_DONE && far) {
+            GtkTreeIter iter;
+            get_row(view, i, &iter);
+            gtk_list_store_set(view->store, &iter, PLAN_COLUMN_THUMBNAIL, NULL, -1);
+            view->thumbnails[i] = THUMBNAIL_NONE;
+        }
+    }
+    while (first <= last && view->thumbnails[first] != THUMBNAIL_NONE) {
+        first++;
+    }
+    while (last >= first && view->thumbnails[last] != THUMBNAIL_NONE) {
+        last--;
+    }
+    if (first > last) {
+        return;
+    }
+
+    PlanThumbnails *thumbnails = g_new0(PlanThumbnails, 1);
+    thumbnails->view = plan_view_ref(view);
+    thumbnails->first = first;
+    thumbnails->count = last - first + 1;
+    for (int i = first; i <= last; i++) {
+        view->thumbnails[i] = THUMBNAIL_RENDERING;
+    }
+    view->rendering = TRUE;
+    g_thread_unref(g_thread_new("plan-thumbnails", plan_thumbnails_thread, thumbnails));
+}
+
+// The list scrolled, or was laid out for the first time
+static void on_plan_scrolled(GtkAdjustment *adjustment, gpointer user_data) {
+    SplitVideoInput *split_video_input = user_data;
+    if (split_video_input->plan_view) {
+        render_plan_thumbnails(split_video_input->plan_view);
+    }
+}
+
+// Drops the previewed plan and its rows, a split running on it keeps its own reference
+static void close_plan_view(SplitVideoInput *split_video_input) {
+    PlanView *view = split_video_input->plan_view;
+    if (!view) {
+        return;
+    }
+    view->closed = TRUE;
+    if (!split_video_input->window_closed) {
+        gtk_tree_view_set_model(GTK_TREE_VIEW(split_video_input->plan_list), NULL);
+    }
+    g_object_unref(view->store);
+    view->store = NULL;
+    plan_view_unref(&split_video_input->plan_view);
+}
+
 int get_total_seconds_from_time_input(TimeInputData *time_data) {
     const char *hours_text = gtk_entry_get_text(GTK_ENTRY(time_data->hours));
     const char *minutes_text = gtk_entry_get_text(GTK_ENTRY(time_data->minutes));
@@ -187,14 +506,377 @@ int get_total_seconds_from_time_input(TimeInputData *time_data) {
     return hours * 3600 + minutes * 60 + seconds;
 }
 
+static void free_split_video_input(SplitVideoInput *split_video_input) {
+    close_plan_view(split_video_input);
+    plan_view_unref(&split_video_input->split_view);
+    g_free(split_video_input->max_duration);
+    g_free(split_video_input->min_duration);
+    g_free(split_video_input->filename);
+    g_strfreev(split_video_input->queue);
+    g_free(split_video_input);
+}
+
+// Runs on the main loop, queued by on_split_progress()
+static gboolean update_split_progress(gpointer user_data) {
+    SplitProgressUpdate *update = user_data;
+    SplitVideoInput *split_video_input = update->input;
+    const SplitProgress *progress = &update->progress;
+
+    if (!split_video_input->window_closed) {
+        char buf[256];
+        gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(split_video_input->progress_bar), progress->fraction);
+        if (split_video_input->queue) {
+            snprintf(buf, sizeof(buf), "%s: part %d of %d", update->input_name, progress->part,
+                     progress->total_parts);
+        } else {
+            snprintf(buf, sizeof(buf), "Part %d of %d", progress->part, progress->total_parts);
+        }
+        gtk_progress_bar_set_text(GTK_PROGRESS_BAR(split_video_input->progress_bar), buf);
+
+        if (progress->eta >= 0) {
+            int eta = (int)progress->eta;
+            snprintf(buf, sizeof(buf), "%.1f MB written, %.0f packets/s, ETA %02d:%02d:%02d",
+                     progress->bytes_written / (1024.0 * 1024.0), progress->packets_per_second,
+                     eta / 3600, (eta / 60) % 60, eta % 60);
+        } else {
+            snprintf(buf, sizeof(buf), "%.1f MB written", progress->bytes_written / (1024.0 * 1024.0));
+        }
+        gtk_label_set_text(GTK_LABEL(split_video_input->status_label), buf);
+    }
+
+    g_free(update->input_name);
+    g_free(update);
+    return G_SOURCE_REMOVE;
+}
+
+// Called on the split thread, GTK may only be touched from the main loop
+static void on_split_progress(const SplitProgress *progress, void *opaque) {
+    SplitProgressUpdate *update = g_malloc(sizeof(SplitProgressUpdate));
+    update->input = opaque;
+    update->progress = *progress;
+    update->input_name = g_path_get_basename(progress->input);
+    update->progress.input = NULL;
+    g_idle_add(update_split_progress, update);
+}
+
+// Runs on the main loop once the split thread is done. Queued after every
+// progress update, so it is the last one to touch split_video_input.
+static gboolean on_split_finished(gpointer user_data) {
+    SplitVideoInput *split_video_input = user_data;
+
+    split_cancel_token_free(&split_video_input->cancel);
+    plan_view_unref(&split_video_input->split_view);
+    if (split_video_input->window_closed) {
+        free_split_video_input(split_video_input);
+        return G_SOURCE_REMOVE;
+    }
+
+    const char *status;
+    if (split_video_input->result == AVERROR_EXIT) {
+        status = "Split cancelled";
+    } else if (split_video_input->result < 0) {
+        status = "Split failed, see the console for details";
+    } else {
+        status = "Split finished";
+        gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(split_video_input->progress_bar), 1.0);
+    }
+    gtk_label_set_text(GTK_LABEL(split_video_input->status_label), status);
+    gtk_widget_set_sensitive(split_video_input->split_button, TRUE);
+    gtk_widget_set_sensitive(split_video_input->cancel_button, FALSE);
+    if (split_video_input->preview_button) {
+        gtk_widget_set_sensitive(split_video_input->preview_button, TRUE);
+        gtk_widget_set_sensitive(split_video_input->plan_list, TRUE);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+// Plans every queued file and cuts them all on one scheduler, so files on
+// different disks are split at the same time and files sharing a spinning
+// disk one after the other
+static int split_video_queue(gchar **queue, double max_seconds, double min_seconds,
+                             const SplitOptions *options) {
+    SplitScheduler *scheduler = NULL;
+    int ret = split_scheduler_new(options, &scheduler);
+    if (ret < 0) {
+        return ret;
+    }
+
+    guint count = g_strv_length(queue);
+    SplitPlan **plans = g_new0(SplitPlan *, count);
+    for (guint i = 0; i < count; i++) {
+        int plan_ret = split_plan_create(queue[i], max_seconds, min_seconds, options, &plans[i]);
+        if (plan_ret >= 0) {
+            plan_ret = split_scheduler_add(scheduler, plans[i]);
+        }
+        if (plan_ret < 0) {
+            fprintf(stderr, "Skipping '%s'\n", queue[i]);
+            split_plan_free(&plans[i]);
+            if (ret == 0) {
+                ret = plan_ret;
+            }
+        }
+    }
+
+    int run_ret = split_scheduler_run(scheduler);
+    if (run_ret < 0) {
+        ret = run_ret;
+    }
+    split_scheduler_free(&scheduler);
+    for (guint i = 0; i < count; i++) {
+        split_plan_free(&plans[i]);
+    }
+    g_free(plans);
+    return ret;
+}
+
+static gpointer split_video_thread(gpointer user_data) {
+    SplitVideoInput *split_video_input = user_data;
+
+    SplitOptions options;
+    split_options_init(&options);
+    options.progress = on_split_progress;
+    options.progress_opaque = split_video_input;
+    options.cancel = split_video_input->cancel;
+    options.probe_cache = 1;
+    options.journal = 1;
+
+    if (split_video_input->split_view) {
+        // Only the checked parts of the preview, skipped ones aren't even read
+        const SplitPlan *plan = split_video_input->split_view->plan;
+        for (int i = 0; i < plan->total_parts; i++) {
+            if (plan->parts[i].skip) {
+                options.mode = SPLIT_MODE_PER_PART;
+            }
+        }
+        split_video_input->result = split_plan_execute(split_video_input->split_view->plan, &options);
+    } else if (split_video_input->queue) {
+        split_video_input->result = split_video_queue(split_video_input->queue,
+                                                      split_video_input->max_seconds,
+                                                      split_video_input->min_seconds,
+                                                      &options);
+    } else {
+        split_video_input->result = split_video_with_options(split_video_input->filename,
+                                                             split_video_input->max_seconds,
+                                                             split_video_input->min_seconds,
+                                                             &options);
+    }
+    g_idle_add(on_split_finished, split_video_input);
+    return NULL;
+}
+
 static void on_split_video_selected(GtkButton *button, gpointer user_data) {
-    const SplitVideoInput *split_video_input= (const SplitVideoInput *)user_data; 
-    printf("Splitting video: %s\n", split_video_input->filename);
+    SplitVideoInput *split_video_input= (SplitVideoInput *)user_data; 
+    if (split_video_input->cancel) {
+        return;  // already running
+    }
+    if (split_video_input->queue) {
+        printf("Splitting %u videos\n", g_strv_length(split_video_input->queue));
+    } else {
+        printf("Splitting video: %s\n", split_video_input->filename);
+    }
 
-    double max_duration = get_total_seconds_from_time_input(split_video_input->max_duration);
-    double min_duration = get_total_seconds_from_time_input(split_video_input->min_duration);
-    
-    split_video(split_video_input->filename, max_duration, min_duration);    
+    split_video_input->max_seconds = get_total_seconds_from_time_input(split_video_input->max_duration);
+    split_video_input->min_seconds = get_total_seconds_from_time_input(split_video_input->min_duration);
+
+    PlanView *view = split_video_input->plan_view;
+    if (view) {
+        int selected = 0;
+        for (int i = 0; i < view->plan->total_parts; i++) {
+            view->plan->parts[i].skip = !view->selected[i];
+            selected += view->selected[i];
+        }
+        if (selected == 0) {
+            gtk_label_set_text(GTK_LABEL(split_video_input->status_label), "No parts selected");
+            return;
+        }
+        split_video_input->split_view = plan_view_ref(view);
+        gtk_widget_set_sensitive(split_video_input->preview_button, FALSE);
+        gtk_widget_set_sensitive(split_video_input->plan_list, FALSE);
+    }
+    split_video_input->cancel = split_cancel_token_new();
+
+    gtk_widget_set_sensitive(split_video_input->split_button, FALSE);
+    gtk_widget_set_sensitive(split_video_input->cancel_button, TRUE);
+    gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(split_video_input->progress_bar), 0.0);
+    gtk_label_set_text(GTK_LABEL(split_video_input->status_label), "Starting...");
+
+    // The remux takes hours, keep it off the main loop
+    g_thread_unref(g_thread_new("split-video", split_video_thread, split_video_input));
+}
+
+static void on_cancel_split_clicked(GtkButton *button, gpointer user_data) {
+    SplitVideoInput *split_video_input = user_data;
+    if (split_video_input->cancel) {
+        split_cancel_token_cancel(split_video_input->cancel);
+        gtk_label_set_text(GTK_LABEL(split_video_input->status_label), "Cancelling...");
+    }
+}
+
+static void on_video_window_destroyed(GtkWidget *widget, gpointer user_data) {
+    SplitVideoInput *split_video_input = user_data;
+    split_video_input->window_closed = TRUE;
+    if (split_video_input->cancel) {
+        // on_split_finished() frees it once the thread stops
+        split_cancel_token_cancel(split_video_input->cancel);
+    } else {
+        free_split_video_input(split_video_input);
+    }
+}
+
+// Plans the split with the current durations and lists its parts, all of
+// them checked, the sizes following once they are estimated
+static void on_preview_parts_clicked(GtkButton *button, gpointer user_data) {
+    SplitVideoInput *split_video_input = user_data;
+    if (split_video_input->cancel) {
+        return;  // the running split may be using the current plan
+    }
+    close_plan_view(split_video_input);
+
+    SplitOptions options;
+    split_options_init(&options);
+    options.probe_cache = 1;
+    SplitPlan *plan = NULL;
+    if (split_plan_create(split_video_input->filename,
+                          get_total_seconds_from_time_input(split_video_input->max_duration),
+                          get_total_seconds_from_time_input(split_video_input->min_duration),
+                          &options, &plan) < 0) {
+        gtk_label_set_text(GTK_LABEL(split_video_input->plan_summary), "Could not plan the split");
+        return;
+    }
+
+    PlanView *view = g_new0(PlanView, 1);
+    view->refs = 1;
+    view->plan = plan;
+    view->selected = g_new(gboolean, plan->total_parts);
+    for (int i = 0; i < plan->total_parts; i++) {
+        view->selected[i] = TRUE;
+    }
+    view->thumbnails = g_new0(guint8, plan->total_parts);
+    view->list = split_video_input->plan_list;
+    view->summary_label = split_video_input->plan_summary;
+
+    // Filled before the list shows it, which then only lays out what is in sight
+    view->store = gtk_list_store_new(PLAN_COLUMNS, G_TYPE_BOOLEAN, GDK_TYPE_PIXBUF, G_TYPE_STRING,
+                                     G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING);
+    for (int i = 0; i < plan->total_parts; i++) {
+        const SplitPart *part = &plan->parts[i];
+        gchar *name = g_path_get_basename(part->output_filename);
+        append_split_row(view->store, name, part->start_time, part->duration);
+        g_free(name);
+    }
+    gtk_tree_view_set_model(GTK_TREE_VIEW(view->list), GTK_TREE_MODEL(view->store));
+    split_video_input->plan_view = view;
+    update_plan_summary(view);
+    render_plan_thumbnails(view);
+
+    PlanEstimate *estimate = g_new0(PlanEstimate, 1);
+    estimate->view = plan_view_ref(view);
+    estimate->filename = g_strdup(split_video_input->filename);
+    g_thread_unref(g_thread_new("estimate-plan", estimate_plan_thread, estimate));
+}
+
+// A preview made with other durations would split differently than shown
+static void on_durations_changed(GtkWidget *entry, gpointer user_data) {
+    SplitVideoInput *split_video_input = user_data;
+    if (split_video_input->plan_view) {
+        close_plan_view(split_video_input);
+        gtk_label_set_text(GTK_LABEL(split_video_input->plan_summary),
+                           "Durations changed, preview the parts again");
+    }
+}
+
+static void connect_time_input_changed(TimeInputData *time_data, SplitVideoInput *split_video_input) {
+    g_signal_connect(time_data->hours, "changed", G_CALLBACK(on_durations_changed), split_video_input);
+    g_signal_connect(time_data->minutes, "changed", G_CALLBACK(on_durations_changed), split_video_input);
+    g_signal_connect(time_data->seconds, "changed", G_CALLBACK(on_durations_changed), split_video_input);
+}
+
+// Preview button and the list of parts of a single file. Only the checked
+// parts are split.
+static void add_plan_preview(GtkWidget *box, SplitVideoInput *split_video_input) {
+    GtkWidget *preview_btn = gtk_button_new_with_label("Ver partes");
+    gtk_box_pack_start(GTK_BOX(box), preview_btn, FALSE, FALSE, 0);
+
+    GtkWidget *summary_label = gtk_label_new("");
+    gtk_box_pack_start(GTK_BOX(box), summary_label, FALSE, FALSE, 0);
+
+    GtkWidget *scrolled = gtk_scrolled_window_new(NULL, NULL);
+    gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrolled), GTK_POLICY_NEVER, GTK_POLICY_AUTOMATIC);
+    gtk_scrolled_window_set_min_content_height(GTK_SCROLLED_WINDOW(scrolled), 200);
+    GtkWidget *list = gtk_tree_view_new();
+    gtk_tree_view_set_headers_visible(GTK_TREE_VIEW(list), FALSE);
+    gtk_tree_selection_set_mode(gtk_tree_view_get_selection(GTK_TREE_VIEW(list)), GTK_SELECTION_NONE);
+
+    GtkCellRenderer *toggle = gtk_cell_renderer_toggle_new();
+    g_signal_connect(toggle, "toggled", G_CALLBACK(on_part_toggled), split_video_input);
+    gtk_tree_view_insert_column_with_attributes(GTK_TREE_VIEW(list), -1, "", toggle,
+                                                "active", PLAN_COLUMN_SELECTED, NULL);
+    gtk_tree_view_insert_column_with_attributes(GTK_TREE_VIEW(list), -1, "", gtk_cell_renderer_pixbuf_new(),
+                                                "pixbuf", PLAN_COLUMN_THUMBNAIL, NULL);
+    int name_column = gtk_tree_view_insert_column_with_attributes(GTK_TREE_VIEW(list), -1, "",
+                                                                  gtk_cell_renderer_text_new(),
+                                                                  "text", PLAN_COLUMN_NAME, NULL) - 1;
+    gtk_tree_view_column_set_expand(gtk_tree_view_get_column(GTK_TREE_VIEW(list), name_column), TRUE);
+    gtk_tree_view_insert_column_with_attributes(GTK_TREE_VIEW(list), -1, "", gtk_cell_renderer_text_new(),
+                                                "text", PLAN_COLUMN_START, NULL);
+    gtk_tree_view_insert_column_with_attributes(GTK_TREE_VIEW(list), -1, "", gtk_cell_renderer_text_new(),
+                                                "text", PLAN_COLUMN_DURATION, NULL);
+    gtk_tree_view_insert_column_with_attributes(GTK_TREE_VIEW(list), -1, "", gtk_cell_renderer_text_new(),
+                                                "text", PLAN_COLUMN_SIZE, NULL);
+    gtk_container_add(GTK_CONTAINER(scrolled), list);
+    gtk_box_pack_start(GTK_BOX(box), scrolled, TRUE, TRUE, 0);
+
+    split_video_input->preview_button = preview_btn;
+    split_video_input->plan_list = list;
+    split_video_input->plan_summary = summary_label;
+    g_signal_connect(preview_btn, "clicked", G_CALLBACK(on_preview_parts_clicked), split_video_input);
+    GtkAdjustment *vadjustment = gtk_scrolled_window_get_vadjustment(GTK_SCROLLED_WINDOW(scrolled));
+    g_signal_connect(vadjustment, "value-changed", G_CALLBACK(on_plan_scrolled), split_video_input);
+    g_signal_connect(vadjustment, "changed", G_CALLBACK(on_plan_scrolled), split_video_input);
+    connect_time_input_changed(split_video_input->max_duration, split_video_input);
+    connect_time_input_changed(split_video_input->min_duration, split_video_input);
+}
+
+// Duration inputs, Split!/Cancel buttons and progress widgets, shared by the
+// single file and the queue windows
+static SplitVideoInput *add_split_controls(GtkWidget *win, GtkWidget *box) {
+    // Max time
+    GtkWidget *max_size_video_label = gtk_label_new("Max tiempo por video");
+    gtk_box_pack_start(GTK_BOX(box), max_size_video_label, FALSE, FALSE, 0);
+    TimeInputData *max_time_data =
+        create_time_input(box, MAX_HOURS_VIDEO, MAX_MINUTES_VIDEO, DEFAULT_SECONDS);
+
+    // Min time
+    GtkWidget *min_size_video_label = gtk_label_new("Min tiempo por video");
+    gtk_box_pack_start(GTK_BOX(box), min_size_video_label, FALSE, FALSE, 0);
+    TimeInputData *min_time_data =
+        create_time_input(box, MIN_HOURS_VIDEO, MIN_MINUTES_VIDEO, DEFAULT_SECONDS);
+
+    GtkWidget *btn = gtk_button_new_with_label("Split!");
+    gtk_box_pack_start(GTK_BOX(box), btn, FALSE, FALSE, 0);
+
+    GtkWidget *progress_bar = gtk_progress_bar_new();
+    gtk_progress_bar_set_show_text(GTK_PROGRESS_BAR(progress_bar), TRUE);
+    gtk_box_pack_start(GTK_BOX(box), progress_bar, FALSE, FALSE, 0);
+
+    GtkWidget *status_label = gtk_label_new("");
+    gtk_box_pack_start(GTK_BOX(box), status_label, FALSE, FALSE, 0);
+
+    GtkWidget *cancel_btn = gtk_button_new_with_label("Cancel");
+    gtk_widget_set_sensitive(cancel_btn, FALSE);
+    gtk_box_pack_start(GTK_BOX(box), cancel_btn, FALSE, FALSE, 0);
+
+    SplitVideoInput *split_video_input = g_new0(SplitVideoInput, 1);
+    split_video_input->max_duration = max_time_data;
+    split_video_input->min_duration = min_time_data;
+    split_video_input->split_button = btn;
+    split_video_input->cancel_button = cancel_btn;
+    split_video_input->progress_bar = progress_bar;
+    split_video_input->status_label = status_label;
+    g_signal_connect(btn, "clicked", G_CALLBACK(on_split_video_selected), (gpointer)split_video_input);
+    g_signal_connect(cancel_btn, "clicked", G_CALLBACK(on_cancel_split_clicked), split_video_input);
+    g_signal_connect(win, "destroy", G_CALLBACK(on_video_window_destroyed), split_video_input);
+    return split_video_input;
 }
 
 static void
@@ -206,18 +888,19 @@ on_video_selected(const char *filename)
 
     // get video information
     VideoInfo *video_info = get_video_info(filename);
-    printf("video_info->filename: %s\n", video_info->filename);
-    printf("video_info->duration: %.2f\n", video_info->duration);
-    printf("video_info->file_size: %ld\n", video_info->filesize);
-
-    char size_str[32];
-    size_into_readable(video_info, size_str, sizeof(size_str));
-    printf("File size: %s\n", size_str);
 
     if (video_info) {
+        printf("video_info->filename: %s\n", video_info->filename);
+        printf("video_info->duration: %.2f\n", video_info->duration);
+        printf("video_info->file_size: %ld\n", video_info->filesize);
+
+        char size_str[32];
+        size_into_readable(video_info, size_str, sizeof(size_str));
+        printf("File size: %s\n", size_str);
+
         GtkWidget *win = gtk_window_new(GTK_WINDOW_TOPLEVEL);
         gtk_window_set_title(GTK_WINDOW(win), "Video Info");
-        gtk_window_set_default_size(GTK_WINDOW(win), 400, 200);
+        gtk_window_set_default_size(GTK_WINDOW(win), 500, 500);
 
         GtkWidget *box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 10);
         gtk_container_add(GTK_CONTAINER(win), box);
@@ -246,28 +929,43 @@ on_video_selected(const char *filename)
         GtkWidget *label_size = gtk_label_new(buf);
         gtk_box_pack_start(GTK_BOX(box), label_size, FALSE, FALSE, 0);
 
-        // Max time
-        GtkWidget *max_size_video_label = gtk_label_new("Max tiempo por video");
-        gtk_box_pack_start(GTK_BOX(box), max_size_video_label, FALSE, FALSE, 0);
-        TimeInputData *max_time_data =
-            create_time_input(box, MAX_HOURS_VIDEO, MAX_MINUTES_VIDEO, DEFAULT_SECONDS);
+        SplitVideoInput *split_video_input = add_split_controls(win, box);
+        split_video_input->filename = g_strdup(video_info->filename);
+        add_plan_preview(box, split_video_input);
+        gtk_widget_show_all(win);
+    }
+    free_video_info(video_info);
+}
 
-        // Min time
-        GtkWidget *min_size_video_label = gtk_label_new("Min tiempo por video");
-        gtk_box_pack_start(GTK_BOX(box), min_size_video_label, FALSE, FALSE, 0);
-        TimeInputData *min_time_data =
-            create_time_input(box, MIN_HOURS_VIDEO, MIN_MINUTES_VIDEO, DEFAULT_SECONDS);
+// Several files picked at once are split as one queue
+static void on_videos_selected(GSList *filenames) {
+    guint count = g_slist_length(filenames);
+    gchar **queue = g_new0(gchar *, count + 1);
 
-        GtkWidget *btn = gtk_button_new_with_label("Split!");
-        gtk_box_pack_start(GTK_BOX(box), btn, FALSE, FALSE, 0);
+    GtkWidget *win = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+    gtk_window_set_title(GTK_WINDOW(win), "Video Queue");
+    gtk_window_set_default_size(GTK_WINDOW(win), 400, 300);
 
-        SplitVideoInput *split_video_input = g_malloc(sizeof(SplitVideoInput));
-        split_video_input->filename = g_strdup(video_info->filename);
-        split_video_input->max_duration = max_time_data;
-        split_video_input->min_duration = min_time_data;
-        g_signal_connect(btn, "clicked", G_CALLBACK(on_split_video_selected), (gpointer)split_video_input);
-        gtk_widget_show_all(win);
+    GtkWidget *box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 10);
+    gtk_container_add(GTK_CONTAINER(win), box);
+
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%u videos", count);
+    gtk_box_pack_start(GTK_BOX(box), gtk_label_new(buf), FALSE, FALSE, 0);
+
+    guint i = 0;
+    for (GSList *item = filenames; item; item = item->next) {
+        queue[i++] = g_strdup(item->data);
+        gchar *name = g_path_get_basename(item->data);
+        GtkWidget *label = gtk_label_new(name);
+        gtk_label_set_xalign(GTK_LABEL(label), 0.0);
+        gtk_box_pack_start(GTK_BOX(box), label, FALSE, FALSE, 0);
+        g_free(name);
     }
+
+    SplitVideoInput *split_video_input = add_split_controls(win, box);
+    split_video_input->queue = queue;
+    gtk_widget_show_all(win);
 }
 
 static void on_pick_video_clicked(GtkButton *button, gpointer user_data) {
@@ -298,11 +996,16 @@ static void on_pick_video_clicked(GtkButton *button, gpointer user_data) {
     gtk_file_filter_set_name(all_filter, "All Files");
     gtk_file_filter_add_pattern(all_filter, "*");
     gtk_file_chooser_add_filter(GTK_FILE_CHOOSER(dialog), all_filter);
+    gtk_file_chooser_set_select_multiple(GTK_FILE_CHOOSER(dialog), TRUE);
 
     if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
-        char *filename = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog));
-        on_video_selected(filename);
-        g_free(filename);
+        GSList *filenames = gtk_file_chooser_get_filenames(GTK_FILE_CHOOSER(dialog));
+        if (filenames && filenames->next) {
+            on_videos_selected(filenames);
+        } else if (filenames) {
+            on_video_selected(filenames->data);
+        }
+        g_slist_free_full(filenames, g_free);
     }
 
     gtk_widget_destroy(dialog);
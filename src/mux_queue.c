@@ -0,0 +1,265 @@
+#define _GNU_SOURCE
+#include "mux_queue.h"
+#include <libavformat/avformat.h>
+#include <libavutil/avutil.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INITIAL_CAPACITY 64
+
+typedef struct {
+    AVPacket *packet;
+    int64_t key;  // dts (pts when unset) in AV_TIME_BASE units
+    uint64_t seq; // arrival order, keeps each stream's packets in order on equal keys
+} QueuedPacket;
+
+typedef struct {
+    int queued;
+    int64_t last_seen;  // key of the stream's newest packet, AV_NOPTS_VALUE before the first
+    int given_up;       // packets were written past it while it was silent
+} StreamState;
+
+struct MuxQueue {
+    AVFormatContext *output_ctx;
+    MuxQueueOptions options;
+    QueuedPacket *heap;  // min-heap on (key, seq)
+    int capacity;
+    StreamState *streams;
+    uint64_t seq;
+    int64_t first;    // key of the first packet, AV_NOPTS_VALUE before it
+    int64_t newest;   // highest key seen
+    int64_t written;  // key of the last packet written in order
+    MuxQueueStats stats;
+};
+
+static int queued_before(const QueuedPacket *a, const QueuedPacket *b) {
+    return a->key < b->key || (a->key == b->key && a->seq < b->seq);
+}
+
+static void sift_up(MuxQueue *queue, int i) {
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!queued_before(&queue->heap[i], &queue->heap[parent])) {
+            break;
+        }
+        QueuedPacket tmp = queue->heap[i];
+        queue->heap[i] = queue->heap[parent];
+        queue->heap[parent] = tmp;
+        i = parent;
+    }
+}
+
+static void sift_down(MuxQueue *queue, int i) {
+    int count = queue->stats.packets;
+    for (;;) {
+        int smallest = i;
+        int left = 2 * i + 1, right = left + 1;
+        if (left < count && queued_before(&queue->heap[left], &queue->heap[smallest])) {
+            smallest = left;
+        }
+        if (right < count && queued_before(&queue->heap[right], &queue->heap[smallest])) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            break;
+        }
+        QueuedPacket tmp = queue->heap[i];
+        queue->heap[i] = queue->heap[smallest];
+        queue->heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+int mux_queue_new(AVFormatContext *output_ctx, const MuxQueueOptions *options, MuxQueue **queue_out) {
+    MuxQueue *queue = calloc(1, sizeof(MuxQueue));
+    if (!queue) {
+        return AVERROR(ENOMEM);
+    }
+    queue->output_ctx = output_ctx;
+    queue->options = *options;
+    queue->first = AV_NOPTS_VALUE;
+    queue->newest = AV_NOPTS_VALUE;
+    queue->written = AV_NOPTS_VALUE;
+    queue->streams = calloc(output_ctx->nb_streams ? output_ctx->nb_streams : 1, sizeof(StreamState));
+    queue->capacity = INITIAL_CAPACITY;
+    queue->heap = malloc(queue->capacity * sizeof(QueuedPacket));
+    if (!queue->streams || !queue->heap) {
+        mux_queue_free(&queue);
+        return AVERROR(ENOMEM);
+    }
+    for (unsigned i = 0; i < output_ctx->nb_streams; i++) {
+        queue->streams[i].last_seen = AV_NOPTS_VALUE;
+    }
+    *queue_out = queue;
+    return 0;
+}
+
+// Hands a packet to the muxer and frees it
+static int write_packet(MuxQueue *queue, AVPacket *packet) {
+    int ret = av_write_frame(queue->output_ctx, packet);
+    av_packet_free(&packet);
+    if (ret < 0) {
+        fprintf(stderr, "Error writing packet\n");
+    }
+    return ret;
+}
+
+// A stream that has been silent for longer than the delay no longer holds
+// the queue back
+static int stream_is_silent(const MuxQueue *queue, const StreamState *stream) {
+    int64_t since = stream->last_seen != AV_NOPTS_VALUE ? stream->last_seen : queue->first;
+    return queue->newest - since > queue->options.max_delay_us;
+}
+
+// The oldest packet can go once every other stream has a packet queued
+// behind it, or is silent, so nothing older can still arrive
+static int head_ready(const MuxQueue *queue) {
+    int head_stream = queue->heap[0].packet->stream_index;
+    for (unsigned i = 0; i < queue->output_ctx->nb_streams; i++) {
+        const StreamState *stream = &queue->streams[i];
+        if ((int)i != head_stream && stream->queued == 0 && !stream_is_silent(queue, stream)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Streams the head is about to be written past because they are silent;
+// only their late packets fall under the sparse stream policy
+static void give_up_silent_streams(MuxQueue *queue) {
+    int head_stream = queue->heap[0].packet->stream_index;
+    for (unsigned i = 0; i < queue->output_ctx->nb_streams; i++) {
+        StreamState *stream = &queue->streams[i];
+        if ((int)i != head_stream && stream->queued == 0 && stream_is_silent(queue, stream)) {
+            stream->given_up = 1;
+        }
+    }
+}
+
+static int write_head(MuxQueue *queue) {
+    QueuedPacket head = queue->heap[0];
+    queue->stats.packets--;
+    queue->stats.bytes -= head.packet->size;
+    queue->streams[head.packet->stream_index].queued--;
+    if (queue->stats.packets > 0) {
+        queue->heap[0] = queue->heap[queue->stats.packets];
+        sift_down(queue, 0);
+    }
+    queue->written = head.key;
+    return write_packet(queue, head.packet);
+}
+
+int mux_queue_write(MuxQueue *queue, AVPacket *packet) {
+    if (packet->stream_index < 0 || packet->stream_index >= (int)queue->output_ctx->nb_streams) {
+        av_packet_unref(packet);
+        return AVERROR(EINVAL);
+    }
+    AVStream *stream = queue->output_ctx->streams[packet->stream_index];
+    int64_t ts = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+    int64_t key = ts != AV_NOPTS_VALUE ? av_rescale_q(ts, stream->time_base, AV_TIME_BASE_Q)
+                                       : queue->newest != AV_NOPTS_VALUE ? queue->newest : 0;
+
+    StreamState *state = &queue->streams[packet->stream_index];
+    if (queue->written != AV_NOPTS_VALUE && key < queue->written) {
+        // Behind what the queue already let go of: either it stopped waiting
+        // for this silent stream, or a full queue forced packets out early.
+        // Those last ones are never dropped.
+        if (state->given_up) {
+            queue->stats.late++;
+        }
+        if (state->given_up && queue->options.sparse == MUX_SPARSE_DROP) {
+            av_packet_unref(packet);
+            return 0;
+        }
+        AVPacket *late = av_packet_alloc();
+        if (!late) {
+            av_packet_unref(packet);
+            return AVERROR(ENOMEM);
+        }
+        av_packet_move_ref(late, packet);
+        return write_packet(queue, late);
+    }
+
+    if (queue->stats.packets == queue->capacity) {
+        QueuedPacket *heap = realloc(queue->heap, 2 * queue->capacity * sizeof(QueuedPacket));
+        if (!heap) {
+            av_packet_unref(packet);
+            return AVERROR(ENOMEM);
+        }
+        queue->heap = heap;
+        queue->capacity *= 2;
+    }
+    AVPacket *queued = av_packet_alloc();
+    if (!queued) {
+        av_packet_unref(packet);
+        return AVERROR(ENOMEM);
+    }
+    av_packet_move_ref(queued, packet);
+
+    state->queued++;
+    state->last_seen = key;
+    state->given_up = 0;
+    if (queue->first == AV_NOPTS_VALUE) {
+        queue->first = key;
+    }
+    if (queue->newest == AV_NOPTS_VALUE || key > queue->newest) {
+        queue->newest = key;
+    }
+    queue->heap[queue->stats.packets] = (QueuedPacket){ .packet = queued, .key = key, .seq = queue->seq++ };
+    sift_up(queue, queue->stats.packets);
+    queue->stats.packets++;
+    queue->stats.bytes += queued->size;
+    if (queue->stats.packets > queue->stats.peak_packets) {
+        queue->stats.peak_packets = queue->stats.packets;
+    }
+    if (queue->stats.bytes > queue->stats.peak_bytes) {
+        queue->stats.peak_bytes = queue->stats.bytes;
+    }
+
+    while (queue->stats.packets > 0) {
+        int full = queue->stats.bytes > queue->options.max_bytes;
+        if (!full && !head_ready(queue)) {
+            break;
+        }
+        if (!head_ready(queue)) {
+            queue->stats.forced++;
+        } else {
+            give_up_silent_streams(queue);
+        }
+        int ret = write_head(queue);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+int mux_queue_flush(MuxQueue *queue) {
+    while (queue->stats.packets > 0) {
+        int ret = write_head(queue);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+void mux_queue_stats(const MuxQueue *queue, MuxQueueStats *stats) {
+    *stats = queue->stats;
+}
+
+void mux_queue_free(MuxQueue **queue) {
+    if (!*queue) {
+        return;
+    }
+    if ((*queue)->heap) {
+        for (int i = 0; i < (*queue)->stats.packets; i++) {
+            av_packet_free(&(*queue)->heap[i].packet);
+        }
+    }
+    free((*queue)->heap);
+    free((*queue)->streams);
+    free(*queue);
+    *queue = NULL;
+}
@@ -0,0 +1,53 @@
+#ifndef MUX_QUEUE_H
+#define MUX_QUEUE_H
+
+#include <stdint.h>
+
+struct AVFormatContext;
+struct AVPacket;
+
+// What the queue does about a stream that stays silent (subtitles, data
+// streams, a stalled track) for longer than the allowed delay. Either way it
+// stops waiting for the stream, flushing everything older than that delay
+// as a heartbeat would; the policy decides what happens to the stream's
+// packets that then arrive behind what was already written. Packets that
+// are only late because a full queue was written out early are always kept.
+typedef enum {
+    MUX_SPARSE_HEARTBEAT,  // write them as they come, slightly out of interleave order
+    MUX_SPARSE_DROP,       // drop them, the file stays strictly interleaved
+} MuxSparsePolicy;
+
+typedef struct {
+    int64_t max_bytes;     // packets are written oldest first once the queue holds more
+    int64_t max_delay_us;  // silence after which a stream is no longer waited for
+    MuxSparsePolicy sparse;
+} MuxQueueOptions;
+
+typedef struct {
+    int packets;        // queued now
+    int64_t bytes;
+    int peak_packets;   // most ever queued at once
+    int64_t peak_bytes;
+    int64_t forced;     // packets written early because the queue was full
+    int64_t late;       // packets of silent streams written or dropped out of order
+} MuxQueueStats;
+
+// Interleaves packets by dts in front of av_write_frame() with a bounded
+// amount of memory, in place of av_interleaved_write_frame(), whose queue
+// grows for as long as any stream lags behind the others
+typedef struct MuxQueue MuxQueue;
+
+int mux_queue_new(struct AVFormatContext*, const MuxQueueOptions*, MuxQueue**);
+
+// Takes the packet's reference. Timestamps are in the output stream's time base.
+int mux_queue_write(MuxQueue*, struct AVPacket*);
+
+// Writes every queued packet, before the trailer
+int mux_queue_flush(MuxQueue*);
+
+void mux_queue_stats(const MuxQueue*, MuxQueueStats*);
+
+// Drops whatever is still queued
+void mux_queue_free(MuxQueue**);
+
+#endif
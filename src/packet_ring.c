@@ -0,0 +1,201 @@
+#include "packet_ring.h"
+#include "trace.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define CACHE_LINE 64
+
+typedef struct {
+    AVPacket *packet;
+    int ret;  // result of av_read_frame() for this slot
+} PacketSlot;
+
+struct PacketReader {
+    AVFormatContext *input_ctx;
+    PacketSlot *slots;
+    size_t mask;  // ring size - 1, 0 when reading on the caller's thread
+    int threaded;
+    pthread_t thread;
+
+    // Single producer / single consumer indices, padded apart so the two
+    // threads don't share a cache line. head is only written by the demux
+    // thread, tail only by the caller.
+    char pad0[CACHE_LINE];
+    atomic_size_t head;
+    char pad1[CACHE_LINE - sizeof(atomic_size_t)];
+    atomic_size_t tail;
+    char pad2[CACHE_LINE - sizeof(atomic_size_t)];
+    atomic_int stop;
+
+    // Only used to sleep when the ring is full or empty; the fast path is
+    // lock-free. A side sets its waiting flag before re-checking the
+    // indices, the other side signals after publishing when it sees the
+    // flag set.
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    atomic_int producer_waiting;
+    atomic_int consumer_waiting;
+
+    int holding;  // the caller still holds the slot at tail
+};
+
+static void wake(PacketReader *reader, atomic_int *waiting) {
+    if (atomic_load(waiting)) {
+        pthread_mutex_lock(&reader->lock);
+        pthread_cond_broadcast(&reader->cond);
+        pthread_mutex_unlock(&reader->lock);
+    }
+}
+
+static void *demux_thread(void *arg) {
+    PacketReader *reader = arg;
+    size_t size = reader->mask + 1;
+
+    for (;;) {
+        size_t head = atomic_load_explicit(&reader->head, memory_order_relaxed);
+
+        if (head - atomic_load(&reader->tail) == size) {
+            pthread_mutex_lock(&reader->lock);
+            atomic_store(&reader->producer_waiting, 1);
+            while (head - atomic_load(&reader->tail) == size && !atomic_load(&reader->stop)) {
+                pthread_cond_wait(&reader->cond, &reader->lock);
+            }
+            atomic_store(&reader->producer_waiting, 0);
+            pthread_mutex_unlock(&reader->lock);
+        }
+        if (atomic_load(&reader->stop)) {
+            break;
+        }
+
+        PacketSlot *slot = &reader->slots[head & reader->mask];
+        TRACE_BEGIN(read_start);
+        slot->ret = av_read_frame(reader->input_ctx, slot->packet);
+        if (slot->ret >= 0) {
+            TRACE_STAT(TRACE_STAT_READ, slot->packet->stream_index, slot->packet->size, read_start);
+        }
+
+        atomic_store(&reader->head, head + 1);
+        wake(reader, &reader->consumer_waiting);
+        if (slot->ret < 0) {
+            break;  // the consumer gets the error or EOF from this slot
+        }
+    }
+
+    return NULL;
+}
+
+int packet_reader_start(AVFormatContext *input_ctx, int depth, PacketReader **reader_out) {
+    PacketReader *reader = calloc(1, sizeof(PacketReader));
+    if (!reader) {
+        return AVERROR(ENOMEM);
+    }
+    reader->input_ctx = input_ctx;
+    atomic_init(&reader->head, 0);
+    atomic_init(&reader->tail, 0);
+    atomic_init(&reader->stop, 0);
+    atomic_init(&reader->producer_waiting, 0);
+    atomic_init(&reader->consumer_waiting, 0);
+    pthread_mutex_init(&reader->lock, NULL);
+    pthread_cond_init(&reader->cond, NULL);
+
+    size_t size = 1;
+    while (size < (size_t)depth) {
+        size <<= 1;
+    }
+    reader->mask = depth > 0 ? size - 1 : 0;
+
+    // Every packet the reader will ever use is allocated here
+    reader->slots = calloc(reader->mask + 1, sizeof(PacketSlot));
+    if (!reader->slots) {
+        packet_reader_stop(&reader);
+        return AVERROR(ENOMEM);
+    }
+    for (size_t i = 0; i <= reader->mask; i++) {
+        reader->slots[i].packet = av_packet_alloc();
+        if (!reader->slots[i].packet) {
+            packet_reader_stop(&reader);
+            return AVERROR(ENOMEM);
+        }
+    }
+
+    reader->threaded = depth > 0;
+    if (reader->threaded && pthread_create(&reader->thread, NULL, demux_thread, reader) != 0) {
+        // Still works, just without the overlap
+        fprintf(stderr, "Could not start demux thread, reading inline\n");
+        reader->threaded = 0;
+    }
+
+    *reader_out = reader;
+    return 0;
+}
+
+int packet_reader_next(PacketReader *reader, AVPacket **packet) {
+    if (!reader->threaded) {
+        AVPacket *inline_packet = reader->slots[0].packet;
+        av_packet_unref(inline_packet);
+        TRACE_BEGIN(read_start);
+        int ret = av_read_frame(reader->input_ctx, inline_packet);
+        if (ret >= 0) {
+            TRACE_STAT(TRACE_STAT_READ, inline_packet->stream_index, inline_packet->size, read_start);
+        }
+        *packet = inline_packet;
+        return ret;
+    }
+
+    size_t tail = atomic_load_explicit(&reader->tail, memory_order_relaxed);
+    if (reader->holding) {
+        // Hand the previous slot back to the demux thread
+        av_packet_unref(reader->slots[tail & reader->mask].packet);
+        tail++;
+        atomic_store(&reader->tail, tail);
+        reader->holding = 0;
+        wake(reader, &reader->producer_waiting);
+    }
+
+    if (atomic_load(&reader->head) == tail) {
+        TRACE_BEGIN(wait_start);
+        pthread_mutex_lock(&reader->lock);
+        atomic_store(&reader->consumer_waiting, 1);
+        while (atomic_load(&reader->head) == tail) {
+            pthread_cond_wait(&reader->cond, &reader->lock);
+        }
+        atomic_store(&reader->consumer_waiting, 0);
+        pthread_mutex_unlock(&reader->lock);
+        TRACE_STAT(TRACE_STAT_WAIT, 0, 0, wait_start);
+    }
+
+    PacketSlot *slot = &reader->slots[tail & reader->mask];
+    if (slot->ret < 0) {
+        // Leave the slot in place so later calls keep returning the error
+        return slot->ret;
+    }
+    reader->holding = 1;
+    *packet = slot->packet;
+    return 0;
+}
+
+void packet_reader_stop(PacketReader **reader_ptr) {
+    PacketReader *reader = *reader_ptr;
+    if (!reader) {
+        return;
+    }
+
+    if (reader->threaded) {
+        atomic_store(&reader->stop, 1);
+        pthread_mutex_lock(&reader->lock);
+        pthread_cond_broadcast(&reader->cond);
+        pthread_mutex_unlock(&reader->lock);
+        pthread_join(reader->thread, NULL);
+    }
+    pthread_mutex_destroy(&reader->lock);
+    pthread_cond_destroy(&reader->cond);
+
+    for (size_t i = 0; reader->slots && i <= reader->mask; i++) {
+        av_packet_free(&reader->slots[i].packet);
+    }
+    free(reader->slots);
+    free(reader);
+    *reader_ptr = NULL;
+}
@@ -0,0 +1,23 @@
+#ifndef PACKET_RING_H
+#define PACKET_RING_H
+
+#include <libavformat/avformat.h>
+
+// Reads packets from an input context. With a depth above 0 a demux thread
+// fills a ring of that many preallocated packets (rounded up to a power of
+// two) while the caller drains it, so reading and writing overlap. With a
+// depth of 0 packets are read on the calling thread.
+typedef struct PacketReader PacketReader;
+
+// The input must not be seeked or read by anyone else until the reader is stopped
+int packet_reader_start(AVFormatContext*, int, PacketReader**);
+
+// Gives the next packet, or a negative AVERROR (AVERROR_EOF at the end). The
+// packet belongs to the reader and stays valid until the next call; the
+// caller may unref it or move its reference out.
+int packet_reader_next(PacketReader*, AVPacket**);
+
+// Stops the demux thread and frees the ring, safe to call before the end
+void packet_reader_stop(PacketReader**);
+
+#endif
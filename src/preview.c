@@ -0,0 +1,364 @@
+#define _GNU_SOURCE
+#include "preview.h"
+#include "probe.h"
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/avutil.h>
+#include <libswscale/swscale.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PREVIEW_GAP 4                // pixels between two thumbnails
+#define PREVIEW_BACKGROUND 0x20      // grey left where a keyframe couldn't be decoded
+#define PREVIEW_MAX_PACKETS 4096     // packets read after a seek looking for a keyframe
+#define PREVIEW_END_MARGIN 0.001     // seconds before a part's end the last keyframe is looked for
+
+typedef struct {
+    int sheet;     // index of the part's sheet
+    int slot;      // 0 start, 1 middle, 2 end
+    double time;   // seconds from the start of the input
+    int64_t pts;   // of the keyframe found for it, AV_NOPTS_VALUE until then
+} PreviewTarget;
+
+typedef struct {
+    AVFormatContext *input_ctx;
+    AVCodecContext *decoder;
+    int stream_index;
+    AVPacket *packet;
+    AVFrame *frame;
+    struct SwsContext *sws;
+
+    int thumb_width;
+    int thumb_height;
+    PreviewTarget *targets;
+    int nb_targets;
+    AVFrame **sheets;
+    int nb_sheets;
+} Previewer;
+
+static void previewer_close(Previewer *previewer) {
+    sws_freeContext(previewer->sws);
+    av_frame_free(&previewer->frame);
+    av_packet_free(&previewer->packet);
+    avcodec_free_context(&previewer->decoder);
+    avformat_close_input(&previewer->input_ctx);
+    free(previewer->targets);
+}
+
+static int previewer_open(Previewer *previewer, const SplitPlan *plan) {
+    const AVCodec *codec = NULL;
+
+    int ret = avformat_open_input(&previewer->input_ctx, plan->input_filename, NULL, NULL);
+    if (ret < 0) {
+        fprintf(stderr, "Could not open input file '%s'\n", plan->input_filename);
+        return ret;
+    }
+    ret = media_probe_find_stream_info(previewer->input_ctx, plan->probe);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to retrieve input stream information\n");
+        return ret;
+    }
+
+    ret = av_find_best_stream(previewer->input_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0);
+    if (ret < 0) {
+        fprintf(stderr, "No video stream to preview in '%s'\n", plan->input_filename);
+        return ret;
+    }
+    previewer->stream_index = ret;
+
+    // Only keyframes of the video stream are wanted, demuxers that know which
+    // packets are keyframes skip the rest unread
+    for (unsigned i = 0; i < previewer->input_ctx->nb_streams; i++) {
+        previewer->input_ctx->streams[i]->discard =
+            (int)i == previewer->stream_index ? AVDISCARD_NONKEY : AVDISCARD_ALL;
+    }
+
+    AVStream *stream = previewer->input_ctx->streams[previewer->stream_index];
+    previewer->decoder = avcodec_alloc_context3(codec);
+    previewer->packet = av_packet_alloc();
+    previewer->frame = av_frame_alloc();
+    if (!previewer->decoder || !previewer->packet || !previewer->frame) {
+        return AVERROR(ENOMEM);
+    }
+    ret = avcodec_parameters_to_context(previewer->decoder, stream->codecpar);
+    if (ret < 0) {
+        return ret;
+    }
+    previewer->decoder->pkt_timebase = stream->time_base;
+    // Keyframes don't depend on each other, so frame threads decode several
+    // of them at once
+    previewer->decoder->skip_frame = AVDISCARD_NONKEY;
+    previewer->decoder->thread_count = 0;
+    previewer->decoder->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    ret = avcodec_open2(previewer->decoder, codec, NULL);
+    if (ret < 0) {
+        fprintf(stderr, "Could not open the video decoder\n");
+        return ret;
+    }
+
+    // Thumbnails keep the display aspect ratio
+    AVCodecParameters *par = stream->codecpar;
+    if (par->width <= 0 || par->height <= 0) {
+        return AVERROR_INVALIDDATA;
+    }
+    double display_width = par->width;
+    if (par->sample_aspect_ratio.num > 0 && par->sample_aspect_ratio.den > 0) {
+        display_width *= av_q2d(par->sample_aspect_ratio);
+    }
+    previewer->thumb_height = (int)(previewer->thumb_width * par->height / display_width) & ~1;
+    if (previewer->thumb_height < 2) {
+        previewer->thumb_height = 2;
+    }
+    return 0;
+}
+
+static AVFrame *new_sheet(const Previewer *previewer) {
+    AVFrame *sheet = av_frame_alloc();
+    if (!sheet) {
+        return NULL;
+    }
+    sheet->format = AV_PIX_FMT_RGB24;
+    sheet->width = PREVIEW_FRAMES * previewer->thumb_width + (PREVIEW_FRAMES - 1) * PREVIEW_GAP;
+    sheet->height = previewer->thumb_height;
+    if (av_frame_get_buffer(sheet, 0) < 0) {
+        av_frame_free(&sheet);
+        return NULL;
+    }
+    for (int y = 0; y < sheet->height; y++) {
+        memset(sheet->data[0] + y * sheet->linesize[0], PREVIEW_BACKGROUND, sheet->width * 3);
+    }
+    return sheet;
+}
+
+// Scales a decoded keyframe into the slot of every target it was read for
+static int place_frame(Previewer *previewer, const AVFrame *frame) {
+    int64_t pts = frame->best_effort_timestamp != AV_NOPTS_VALUE ? frame->best_effort_timestamp : frame->pts;
+
+    for (int i = 0; i < previewer->nb_targets; i++) {
+        const PreviewTarget *target = &previewer->targets[i];
+        if (target->pts != pts) {
+            continue;
+        }
+
+        AVFrame **sheet = &previewer->sheets[target->sheet];
+        if (!*sheet && !(*sheet = new_sheet(previewer))) {
+            return AVERROR(ENOMEM);
+        }
+        previewer->sws = sws_getCachedContext(previewer->sws, frame->width, frame->height, frame->format,
+                                              previewer->thumb_width, previewer->thumb_height,
+                                              AV_PIX_FMT_RGB24, SWS_AREA, NULL, NULL, NULL);
+        if (!previewer->sws) {
+            return AVERROR(EINVAL);
+        }
+        uint8_t *dst[4] = {
+            (*sheet)->data[0] + target->slot * (previewer->thumb_width + PREVIEW_GAP) * 3,
+        };
+        int dst_stride[4] = { (*sheet)->linesize[0] };
+        sws_scale(previewer->sws, (const uint8_t *const *)frame->data, frame->linesize, 0, frame->height,
+                  dst, dst_stride);
+    }
+    return 0;
+}
+
+static int receive_frames(Previewer *previewer) {
+    int ret;
+    while ((ret = avcodec_receive_frame(previewer->decoder, previewer->frame)) >= 0) {
+        ret = place_frame(previewer, previewer->frame);
+        av_frame_unref(previewer->frame);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+}
+
+// Sends a packet, or NULL to drain, taking whatever frames the decoder has
+// ready. Broken keyframes are skipped, their slot stays blank.
+static int decode(Previewer *previewer, const AVPacket *packet) {
+    int ret;
+    while ((ret = avcodec_send_packet(previewer->decoder, packet)) == AVERROR(EAGAIN)) {
+        ret = receive_frames(previewer);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    if (ret == AVERROR(ENOMEM)) {
+        return ret;
+    }
+    return receive_frames(previewer);
+}
+
+// Reads the keyframe at or before a time into packet, returns its pts
+static int seek_keyframe(Previewer *previewer, double time, int64_t *pts) {
+    AVFormatContext *input_ctx = previewer->input_ctx;
+    AVStream *stream = input_ctx->streams[previewer->stream_index];
+    int64_t start = input_ctx->start_time != AV_NOPTS_VALUE ? input_ctx->start_time : 0;
+    int64_t ts = av_rescale_q((int64_t)(time * AV_TIME_BASE) + start, AV_TIME_BASE_Q, stream->time_base);
+
+    int ret = av_seek_frame(input_ctx, previewer->stream_index, ts, AVSEEK_FLAG_BACKWARD);
+    if (ret < 0) {
+        return ret;
+    }
+    for (int n = 0; n < PREVIEW_MAX_PACKETS; n++) {
+        ret = av_read_frame(input_ctx, previewer->packet);
+        if (ret < 0) {
+            return ret;
+        }
+        AVPacket *packet = previewer->packet;
+        if (packet->stream_index == previewer->stream_index && (packet->flags & AV_PKT_FLAG_KEY)) {
+            *pts = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+            return 0;
+        }
+        av_packet_unref(packet);
+    }
+    return AVERROR(EAGAIN);
+}
+
+int preview_plan(const SplitPlan *plan, int width, AVFrame ***sheets_out) {
+    return preview_parts(plan, 0, plan->total_parts, width, sheets_out);
+}
+
+int preview_parts(const SplitPlan *plan, int first, int count, int width, AVFrame ***sheets_out) {
+    Previewer previewer = {
+        .thumb_width = width & ~1,
+        .nb_sheets = count,
+    };
+    if (previewer.thumb_width < 2 || first < 0 || count < 0 || first + count > plan->total_parts) {
+        return AVERROR(EINVAL);
+    }
+    previewer.sheets = calloc(count ? count : 1, sizeof(AVFrame *));
+    previewer.targets = calloc(count * PREVIEW_FRAMES + 1, sizeof(PreviewTarget));
+    if (!previewer.sheets || !previewer.targets) {
+        free(previewer.sheets);
+        free(previewer.targets);
+        return AVERROR(ENOMEM);
+    }
+
+    int ret = previewer_open(&previewer, plan);
+    if (ret < 0) {
+        goto end;
+    }
+
+    // Targets in file order, so the seeks only go forward
+    for (int i = 0; i < count; i++) {
+        const SplitPart *part = &plan->parts[first + i];
+        double times[PREVIEW_FRAMES] = {
+            part->start_time,
+            part->start_time + part->duration / 2,
+            part->start_time + part->duration - PREVIEW_END_MARGIN,
+        };
+        for (int slot = 0; slot < PREVIEW_FRAMES; slot++) {
+            PreviewTarget *target = &previewer.targets[previewer.nb_targets++];
+            target->sheet = i;
+            target->slot = slot;
+            target->time = times[slot];
+            target->pts = AV_NOPTS_VALUE;
+        }
+    }
+
+    // Every keyframe is sent before any is waited for: the decoder works on
+    // the next ones while a frame is scaled
+    int64_t last_sent = AV_NOPTS_VALUE;
+    for (int i = 0; i < previewer.nb_targets && ret >= 0; i++) {
+        PreviewTarget *target = &previewer.targets[i];
+        int64_t pts;
+        if (seek_keyframe(&previewer, target->time, &pts) < 0) {
+            fprintf(stderr, "No keyframe found near %.2f s, leaving that thumbnail blank\n", target->time);
+            continue;
+        }
+        target->pts = pts;
+        // Short parts can have the same keyframe for several thumbnails
+        if (pts != last_sent) {
+            ret = decode(&previewer, previewer.packet);
+            last_sent = pts;
+        }
+        av_packet_unref(previewer.packet);
+    }
+    if (ret >= 0) {
+        ret = decode(&previewer, NULL);
+    }
+
+end:
+    previewer_close(&previewer);
+    if (ret < 0) {
+        preview_sheets_free(&previewer.sheets, previewer.nb_sheets);
+        return ret;
+    }
+    *sheets_out = previewer.sheets;
+    return 0;
+}
+
+void preview_sheets_free(AVFrame ***sheets, int count) {
+    if (!*sheets) {
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        av_frame_free(&(*sheets)[i]);
+    }
+    free(*sheets);
+    *sheets = NULL;
+}
+
+void preview_sheet_path(const SplitPart *part, char *path, size_t size) {
+    const char *name = part->output_filename;
+    const char *dot = strrchr(name, '.');
+    const char *slash = strrchr(name, '/');
+    int length = dot && (!slash || dot > slash) ? (int)(dot - name) : (int)strlen(name);
+    snprintf(path, size, "%.*s.png", length, name);
+}
+
+int preview_save_png(const AVFrame *sheet, const char *path) {
+    AVCodecContext *encoder = NULL;
+    AVPacket *packet = NULL;
+    FILE *f = NULL;
+    int ret;
+
+    const AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_PNG);
+    if (!codec) {
+        fprintf(stderr, "No PNG encoder in this FFmpeg build\n");
+        return AVERROR_ENCODER_NOT_FOUND;
+    }
+    encoder = avcodec_alloc_context3(codec);
+    packet = av_packet_alloc();
+    if (!encoder || !packet) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    encoder->width = sheet->width;
+    encoder->height = sheet->height;
+    encoder->pix_fmt = AV_PIX_FMT_RGB24;
+    encoder->time_base = (AVRational){ 1, 1 };
+    ret = avcodec_open2(encoder, codec, NULL);
+    if (ret < 0) {
+        goto end;
+    }
+
+    ret = avcodec_send_frame(encoder, sheet);
+    if (ret >= 0) {
+        ret = avcodec_send_frame(encoder, NULL);
+    }
+    if (ret >= 0) {
+        ret = avcodec_receive_packet(encoder, packet);
+    }
+    if (ret < 0) {
+        goto end;
+    }
+
+    f = fopen(path, "wb");
+    if (!f || fwrite(packet->data, 1, packet->size, f) != (size_t)packet->size) {
+        ret = AVERROR(errno ? errno : EIO);
+    }
+    if (f && fclose(f) != 0 && ret >= 0) {
+        ret = AVERROR(errno);
+    }
+
+end:
+    if (ret < 0) {
+        fprintf(stderr, "Could not write preview '%s'\n", path);
+    }
+    av_packet_free(&packet);
+    avcodec_free_context(&encoder);
+    return ret;
+}
@@ -0,0 +1,26 @@
+#ifndef PREVIEW_H
+#define PREVIEW_H
+
+#include <stddef.h>
+#include "video_splitter.h"
+
+struct AVFrame;
+
+#define PREVIEW_FRAMES 3  // thumbnails per part: its start, middle and end
+
+// Contact sheets to check the cuts of a plan without writing any part. For
+// every part, the keyframes at or before its start, middle and end are the
+// only frames decoded (on every core, non-key frames skipped), scaled to
+// width pixels and laid out side by side in an RGB24 frame. sheets gets one
+// frame per part, NULL for a part none of whose keyframes could be decoded.
+int preview_plan(const SplitPlan*, int, struct AVFrame***);
+// The same for the count parts from first on, sheets gets count frames.
+// Lets a list render the sheets of the parts it shows, as it shows them.
+int preview_parts(const SplitPlan*, int, int, int, struct AVFrame***);
+void preview_sheets_free(struct AVFrame***, int);
+
+// Where the sheet of a part goes: its output name with .png for an extension
+void preview_sheet_path(const SplitPart*, char*, size_t);
+int preview_save_png(const struct AVFrame*, const char*);
+
+#endif
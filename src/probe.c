@@ -0,0 +1,519 @@
+#define _GNU_SOURCE
+#include "probe.h"
+#include "keyframe_index.h"
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#endif
+
+// Long recordings carry their stream parameters in the container header, so
+// a few MB and seconds are enough; libavformat's defaults are 5 MB and 5 s.
+#define PROBE_SIZE (2 << 20)
+#define PROBE_ANALYZE_DURATION 2000000  // microseconds
+#define PROBE_CACHE_MAGIC "VSPC 1"
+#define PROBE_CACHE_LINE 4096
+
+typedef struct {
+    MediaProbe probe;  // first, so a MediaProbe* is also a ProbeEntry*
+    atomic_int refs;
+    pthread_mutex_t index_lock;
+    KeyframeIndex *index;
+} ProbeEntry;
+
+// In-process cache, one reference held per entry
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static ProbeEntry **cache;
+static int cache_count;
+static int cache_capacity;
+static int disk_cache_loaded;
+
+static int stat_file(const char *filename, int64_t *file_size, int64_t *mtime) {
+    struct stat st;
+    if (stat(filename, &st) != 0) {
+        return AVERROR(errno);
+    }
+    *file_size = st.st_size;
+    *mtime = st.st_mtime;
+    return 0;
+}
+
+// Same file under the same name whatever the working directory was
+static char *canonical_path(const char *filename) {
+#ifdef _WIN32
+    char *path = _fullpath(NULL, filename, 0);
+#else
+    char *path = realpath(filename, NULL);
+#endif
+    return path ? path : strdup(filename);
+}
+
+static ProbeEntry *entry_new(const char *filename, int nb_streams) {
+    ProbeEntry *entry = calloc(1, sizeof(ProbeEntry));
+    if (!entry) {
+        return NULL;
+    }
+    entry->probe.filename = strdup(filename);
+    entry->probe.streams = calloc(nb_streams > 0 ? nb_streams : 1, sizeof(ProbeStream));
+    if (!entry->probe.filename || !entry->probe.streams) {
+        free(entry->probe.filename);
+        free(entry->probe.streams);
+        free(entry);
+        return NULL;
+    }
+    entry->probe.nb_streams = nb_streams;
+    atomic_init(&entry->refs, 1);
+    pthread_mutex_init(&entry->index_lock, NULL);
+    return entry;
+}
+
+MediaProbe *media_probe_ref(MediaProbe *probe) {
+    atomic_fetch_add(&((ProbeEntry *)probe)->refs, 1);
+    return probe;
+}
+
+void media_probe_unref(MediaProbe **probe) {
+    ProbeEntry *entry = (ProbeEntry *)*probe;
+    *probe = NULL;
+    if (!entry || atomic_fetch_sub(&entry->refs, 1) > 1) {
+        return;
+    }
+    keyframe_index_free(&entry->index);
+    pthread_mutex_destroy(&entry->index_lock);
+    free(entry->probe.filename);
+    free(entry->probe.streams);
+    free(entry);
+}
+
+static int stream_described(const AVStream *stream) {
+    const AVCodecParameters *par = stream->codecpar;
+    if (par->codec_id == AV_CODEC_ID_NONE) {
+        return 0;
+    }
+    switch (par->codec_type) {
+    case AVMEDIA_TYPE_VIDEO:
+        return par->width > 0 && par->height > 0;
+    case AVMEDIA_TYPE_AUDIO:
+        return par->sample_rate > 0 && par->ch_layout.nb_channels > 0;
+    default:
+        return 1;
+    }
+}
+
+// Start and duration from the streams' own fields when the demuxer didn't
+// set the container's
+static void timings_from_streams(AVFormatContext *ctx) {
+    int64_t start = INT64_MAX, end = INT64_MIN;
+
+    for (unsigned i = 0; i < ctx->nb_streams; i++) {
+        AVStream *stream = ctx->streams[i];
+        int64_t stream_start = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+        int64_t start_us = av_rescale_q(stream_start, stream->time_base, AV_TIME_BASE_Q);
+        if (stream->start_time != AV_NOPTS_VALUE && start_us < start) {
+            start = start_us;
+        }
+        if (stream->duration != AV_NOPTS_VALUE) {
+            int64_t end_us = av_rescale_q(stream_start + stream->duration, stream->time_base, AV_TIME_BASE_Q);
+            if (end_us > end) {
+                end = end_us;
+            }
+        }
+    }
+
+    if (ctx->start_time == AV_NOPTS_VALUE && start != INT64_MAX) {
+        ctx->start_time = start;
+    }
+    if (ctx->duration == AV_NOPTS_VALUE && end != INT64_MIN) {
+        ctx->duration = end - (start != INT64_MAX ? start : 0);
+    }
+}
+
+int media_probe_find_stream_info(AVFormatContext *ctx, const MediaProbe *expected) {
+    int complete = !(ctx->ctx_flags & AVFMTCTX_NOHEADER) && ctx->nb_streams > 0 &&
+                   (!expected || (unsigned)expected->nb_streams == ctx->nb_streams);
+    for (unsigned i = 0; complete && i < ctx->nb_streams; i++) {
+        complete = stream_described(ctx->streams[i]);
+    }
+
+    if (complete) {
+        timings_from_streams(ctx);
+        if (expected && ctx->start_time == AV_NOPTS_VALUE) {
+            ctx->start_time = expected->start_time;
+        }
+        if (expected && ctx->duration == AV_NOPTS_VALUE && expected->duration > 0) {
+            ctx->duration = (int64_t)(expected->duration * AV_TIME_BASE);
+        }
+        if (ctx->duration != AV_NOPTS_VALUE) {
+            return 0;
+        }
+    }
+
+    // Streams that only show up in the packets (MPEG-TS), or an unknown
+    // duration, need libavformat to read ahead
+    return avformat_find_stream_info(ctx, NULL);
+}
+
+static int probe_file(const char *filename, int64_t file_size, int64_t mtime, ProbeEntry **entry_out) {
+    AVFormatContext *ctx = NULL;
+    AVDictionary *options = NULL;
+
+    av_dict_set_int(&options, "probesize", PROBE_SIZE, 0);
+    av_dict_set_int(&options, "analyzeduration", PROBE_ANALYZE_DURATION, 0);
+    int ret = avformat_open_input(&ctx, filename, NULL, &options);
+    av_dict_free(&options);
+    if (ret < 0) {
+        fprintf(stderr, "Could not open input file '%s'\n", filename);
+        return ret;
+    }
+
+    ret = media_probe_find_stream_info(ctx, NULL);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to retrieve input stream information\n");
+        avformat_close_input(&ctx);
+        return ret;
+    }
+
+    ProbeEntry *entry = entry_new(filename, ctx->nb_streams);
+    if (!entry) {
+        avformat_close_input(&ctx);
+        return AVERROR(ENOMEM);
+    }
+    MediaProbe *probe = &entry->probe;
+    probe->file_size = file_size;
+    probe->mtime = mtime;
+    snprintf(probe->format_name, sizeof(probe->format_name), "%s", ctx->iformat->name);
+    probe->duration = ctx->duration != AV_NOPTS_VALUE ? (double)ctx->duration / AV_TIME_BASE : -1.0;
+    probe->start_time = ctx->start_time != AV_NOPTS_VALUE ? ctx->start_time : 0;
+    probe->bit_rate = ctx->bit_rate;
+    for (unsigned i = 0; i < ctx->nb_streams; i++) {
+        const AVCodecParameters *par = ctx->streams[i]->codecpar;
+        ProbeStream *stream = &probe->streams[i];
+        stream->codec_type = par->codec_type;
+        stream->codec_id = par->codec_id;
+        stream->width = par->width;
+        stream->height = par->height;
+        stream->sample_rate = par->sample_rate;
+        stream->channels = par->ch_layout.nb_channels;
+        stream->bit_rate = par->bit_rate;
+    }
+
+    avformat_close_input(&ctx);
+    *entry_out = entry;
+    return 0;
+}
+
+void media_probe_cache_path(char *path, size_t size) {
+    const char *base = getenv("XDG_CACHE_HOME");
+    const char *suffix = "";
+    if (!base || !*base) {
+#ifdef _WIN32
+        base = getenv("LOCALAPPDATA");
+#else
+        base = getenv("HOME");
+        suffix = "/.cache";
+#endif
+    }
+    if (!base || !*base) {
+        path[0] = '\0';
+        return;
+    }
+    snprintf(path, size, "%s%s/video_splitter/probe_cache", base, suffix);
+}
+
+static void make_parent_dirs(const char *path) {
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+    for (char *slash = strchr(dir + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+#ifdef _WIN32
+        mkdir(dir);
+#else
+        mkdir(dir, 0755);
+#endif
+        *slash = '/';
+    }
+}
+
+// One line per file:
+// size mtime duration start_time bit_rate format nb_streams {type codec width height rate channels bit_rate}... \t path
+static int format_cache_line(const MediaProbe *probe, char *line, size_t size) {
+    if (strpbrk(probe->filename, "\t\n")) {
+        return -1;
+    }
+    int n = snprintf(line, size, "%lld %lld %.17g %lld %lld %s %d",
+                     (long long)probe->file_size, (long long)probe->mtime, probe->duration,
+                     (long long)probe->start_time, (long long)probe->bit_rate,
+                     probe->format_name[0] ? probe->format_name : "-", probe->nb_streams);
+    for (int i = 0; i < probe->nb_streams && n > 0 && (size_t)n < size; i++) {
+        const ProbeStream *s = &probe->streams[i];
+        n += snprintf(line + n, size - n, " %d %d %d %d %d %d %lld", s->codec_type, s->codec_id,
+                      s->width, s->height, s->sample_rate, s->channels, (long long)s->bit_rate);
+    }
+    if (n > 0 && (size_t)n < size) {
+        n += snprintf(line + n, size - n, "\t%s\n", probe->filename);
+    }
+    return n > 0 && (size_t)n < size ? 0 : -1;
+}
+
+static ProbeEntry *parse_cache_line(char *line) {
+    char *path = strchr(line, '\t');
+    if (!path) {
+        return NULL;
+    }
+    *path++ = '\0';
+    path[strcspn(path, "\n")] = '\0';
+
+    long long file_size, mtime, start_time, bit_rate;
+    double duration;
+    char format_name[32];
+    int nb_streams, used;
+    if (sscanf(line, "%lld %lld %lf %lld %lld %31s %d%n", &file_size, &mtime, &duration,
+               &start_time, &bit_rate, format_name, &nb_streams, &used) != 7 ||
+        nb_streams < 0 || nb_streams > 1024) {
+        return NULL;
+    }
+
+    ProbeEntry *entry = entry_new(path, nb_streams);
+    if (!entry) {
+        return NULL;
+    }
+    MediaProbe *probe = &entry->probe;
+    probe->file_size = file_size;
+    probe->mtime = mtime;
+    probe->duration = duration;
+    probe->start_time = start_time;
+    probe->bit_rate = bit_rate;
+    snprintf(probe->format_name, sizeof(probe->format_name), "%s",
+             strcmp(format_name, "-") ? format_name : "");
+
+    char *cursor = line + used;
+    for (int i = 0; i < nb_streams; i++) {
+        ProbeStream *s = &probe->streams[i];
+        long long stream_bit_rate;
+        if (sscanf(cursor, " %d %d %d %d %d %d %lld%n", &s->codec_type, &s->codec_id, &s->width,
+                   &s->height, &s->sample_rate, &s->channels, &stream_bit_rate, &used) != 7) {
+            MediaProbe *bad = probe;
+            media_probe_unref(&bad);
+            return NULL;
+        }
+        s->bit_rate = stream_bit_rate;
+        cursor += used;
+    }
+    return entry;
+}
+
+static int find_entry(const char *filename) {
+    for (int i = 0; i < cache_count; i++) {
+        if (strcmp(cache[i]->probe.filename, filename) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Stores an entry the cache takes ownership of, replacing an older probe of
+// the same file. Called with cache_lock held.
+static int cache_put(ProbeEntry *entry) {
+    int i = find_entry(entry->probe.filename);
+    if (i >= 0) {
+        MediaProbe *old = &cache[i]->probe;
+        media_probe_unref(&old);
+        cache[i] = entry;
+        return 1;
+    }
+    if (cache_count == cache_capacity) {
+        int capacity = cache_capacity ? cache_capacity * 2 : 64;
+        ProbeEntry **entries = realloc(cache, capacity * sizeof(ProbeEntry *));
+        if (!entries) {
+            return AVERROR(ENOMEM);
+        }
+        cache = entries;
+        cache_capacity = capacity;
+    }
+    cache[cache_count++] = entry;
+    return 0;
+}
+
+// Rewrites the on-disk cache from what is in memory, dropping superseded lines
+static void rewrite_disk_cache(const char *path) {
+    char tmp_path[PATH_MAX + 8];
+    char line[PROBE_CACHE_LINE];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    FILE *f = fopen(tmp_path, "w");
+    if (!f) {
+        return;
+    }
+    fputs(PROBE_CACHE_MAGIC "\n", f);
+    for (int i = 0; i < cache_count; i++) {
+        if (format_cache_line(&cache[i]->probe, line, sizeof(line)) == 0) {
+            fputs(line, f);
+        }
+    }
+    if (fclose(f) != 0 || rename(tmp_path, path) != 0) {
+        remove(tmp_path);
+    }
+}
+
+// Called with cache_lock held
+static void load_disk_cache(void) {
+    char path[PATH_MAX];
+    char line[PROBE_CACHE_LINE];
+    int superseded = 0, ret;
+
+    disk_cache_loaded = 1;
+    media_probe_cache_path(path, sizeof(path));
+    FILE *f = path[0] ? fopen(path, "r") : NULL;
+    if (!f) {
+        return;
+    }
+    if (!fgets(line, sizeof(line), f) || strcmp(line, PROBE_CACHE_MAGIC "\n") != 0) {
+        fclose(f);
+        return;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        // Later lines are newer probes of the same file
+        ProbeEntry *entry = parse_cache_line(line);
+        if (!entry) {
+            continue;
+        }
+        ret = cache_put(entry);
+        if (ret < 0) {
+            MediaProbe *dropped = &entry->probe;
+            media_probe_unref(&dropped);
+            break;
+        }
+        superseded += ret;
+    }
+    fclose(f);
+
+    // Lines are only ever appended, so compact once they pile up
+    if (superseded > cache_count) {
+        rewrite_disk_cache(path);
+    }
+}
+
+// Called with cache_lock held
+static void append_disk_cache(const MediaProbe *probe) {
+    char path[PATH_MAX];
+    char line[PROBE_CACHE_LINE];
+
+    media_probe_cache_path(path, sizeof(path));
+    if (!path[0] || format_cache_line(probe, line, sizeof(line)) < 0) {
+        return;
+    }
+    make_parent_dirs(path);
+
+    FILE *f = fopen(path, "a+");
+    if (!f) {
+        return;
+    }
+    fseek(f, 0, SEEK_END);
+    if (ftell(f) == 0) {
+        fputs(PROBE_CACHE_MAGIC "\n", f);
+    }
+    fputs(line, f);
+    fclose(f);
+}
+
+int media_probe_get(const char *filename, int use_disk_cache, MediaProbe **probe_out) {
+    int64_t file_size, mtime;
+    char *path = canonical_path(filename);
+    if (!path) {
+        return AVERROR(ENOMEM);
+    }
+
+    int ret = stat_file(path, &file_size, &mtime);
+    if (ret < 0) {
+        fprintf(stderr, "Could not stat '%s'\n", filename);
+        free(path);
+        return ret;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    if (use_disk_cache && !disk_cache_loaded) {
+        load_disk_cache();
+    }
+    int i = find_entry(path);
+    if (i >= 0 && cache[i]->probe.file_size == file_size && cache[i]->probe.mtime == mtime) {
+        *probe_out = media_probe_ref(&cache[i]->probe);
+        pthread_mutex_unlock(&cache_lock);
+        free(path);
+        return 0;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    // Probing can take a while, so other files are served meanwhile
+    ProbeEntry *entry = NULL;
+    ret = probe_file(path, file_size, mtime, &entry);
+    free(path);
+    if (ret < 0) {
+        return ret;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    ret = cache_put(entry);
+    if (ret >= 0 && use_disk_cache) {
+        append_disk_cache(&entry->probe);
+    }
+    // The cache keeps its own reference, this one is the caller's
+    *probe_out = ret >= 0 ? media_probe_ref(&entry->probe) : &entry->probe;
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
+}
+
+int media_probe_keyframe_index(MediaProbe *probe, const KeyframeIndex **index_out) {
+    ProbeEntry *entry = (ProbeEntry *)probe;
+    int ret = 0;
+
+    pthread_mutex_lock(&entry->index_lock);
+    if (!entry->index) {
+        ret = keyframe_index_get(probe->filename, &entry->index);
+    }
+    pthread_mutex_unlock(&entry->index_lock);
+
+    if (ret < 0) {
+        return ret;
+    }
+    *index_out = entry->index;
+    return 0;
+}
+
+int media_probe_keyframe_index_loaded(MediaProbe *probe, const KeyframeIndex **index_out) {
+    ProbeEntry *entry = (ProbeEntry *)probe;
+    int ret = 0;
+
+    pthread_mutex_lock(&entry->index_lock);
+    if (!entry->index) {
+        ret = keyframe_index_load(probe->filename, &entry->index);
+    }
+    pthread_mutex_unlock(&entry->index_lock);
+
+    if (ret < 0) {
+        return ret;
+    }
+    *index_out = entry->index;
+    return 0;
+}
+
+void media_probe_cache_clear(void) {
+    pthread_mutex_lock(&cache_lock);
+    for (int i = 0; i < cache_count; i++) {
+        MediaProbe *probe = &cache[i]->probe;
+        media_probe_unref(&probe);
+    }
+    free(cache);
+    cache = NULL;
+    cache_count = 0;
+    cache_capacity = 0;
+    disk_cache_loaded = 0;
+    pthread_mutex_unlock(&cache_lock);
+}
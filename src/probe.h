@@ -0,0 +1,62 @@
+#ifndef PROBE_H
+#define PROBE_H
+
+#include <stdint.h>
+#include <libavformat/avformat.h>
+
+struct KeyframeIndex;
+
+typedef struct {
+    int codec_type;   // enum AVMediaType
+    int codec_id;     // enum AVCodecID
+    int width;
+    int height;
+    int sample_rate;
+    int channels;
+    int64_t bit_rate;
+} ProbeStream;
+
+// What the splitter needs to know about an input, probed once per file and
+// shared by everything that looks at it afterwards (the GUI info window, the
+// planner and every part of the split).
+typedef struct MediaProbe {
+    char *filename;
+    int64_t file_size;
+    int64_t mtime;
+    char format_name[32];
+    double duration;      // seconds, negative when unknown
+    int64_t start_time;   // AV_TIME_BASE units, 0 when unknown
+    int64_t bit_rate;
+    int nb_streams;
+    ProbeStream *streams;
+} MediaProbe;
+
+// Gives the probe of a file, from the in-process cache when the file's size and
+// mtime still match, then from the on-disk cache if use_disk_cache is set,
+// and only then by opening it. The reference must be released with
+// media_probe_unref(). Safe to call from several threads.
+int media_probe_get(const char*, int, MediaProbe**);
+MediaProbe *media_probe_ref(MediaProbe*);
+void media_probe_unref(MediaProbe**);
+
+// Keyframe index of the probed file, built or loaded from its sidecar on the
+// first call and kept with the probe. Owned by the probe.
+int media_probe_keyframe_index(MediaProbe*, const struct KeyframeIndex**);
+
+// The same when the index is already kept with the probe or its sidecar is
+// still valid, AVERROR_INVALIDDATA instead of scanning the file otherwise
+int media_probe_keyframe_index_loaded(MediaProbe*, const struct KeyframeIndex**);
+
+// avformat_find_stream_info() for an input that was just opened, skipped when
+// the container header already described every stream (and, with a probe,
+// the same number of them as when it was probed). Missing start times and
+// durations are then taken from the streams or the probe.
+int media_probe_find_stream_info(AVFormatContext*, const MediaProbe*);
+
+// Forgets every cached probe; references already handed out stay valid
+void media_probe_cache_clear(void);
+
+// Path of the on-disk cache, empty when there is no cache directory
+void media_probe_cache_path(char*, size_t);
+
+#endif
@@ -0,0 +1,434 @@
+#define _GNU_SOURCE
+#include "scheduler.h"
+#include "storage.h"
+#include "probe.h"
+#include "trace.h"
+#include <libavutil/avutil.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+// Rough sequential throughput used to weigh tasks against each other, bytes/s
+#define ROTATIONAL_THROUGHPUT (150.0 * 1024 * 1024)
+#define SOLID_STATE_THROUGHPUT (1000.0 * 1024 * 1024)
+#define UNKNOWN_THROUGHPUT (400.0 * 1024 * 1024)
+#define PART_OVERHEAD 0.5  // seconds to open, probe and seek the input for a part
+
+typedef struct {
+    dev_t dev;
+    int limit;        // parts reading from it (and, separately, writing to it) at once
+    int readers;
+    int writers;
+    double throughput;
+} Device;
+
+typedef struct {
+    int plan;          // index into SplitScheduler.plans
+    int part;          // 0-based part of that plan
+    int input_device;  // indices into SplitScheduler.devices
+    int output_device;
+    double cost;       // estimated seconds
+} SchedulerTask;
+
+typedef struct {
+    SplitPlan *plan;
+    SplitJob *job;
+} ScheduledPlan;
+
+// Task indices, highest priority first. The owner takes from the front,
+// thieves from the back.
+typedef struct {
+    int *tasks;
+    int count;
+} WorkerQueue;
+
+struct SplitScheduler {
+    SplitOptions options;          // the caller's, with progress routed through progress_lock
+    const SplitOptions *caller;
+
+    ScheduledPlan *plans;
+    int nb_plans;
+    SchedulerTask *tasks;
+    int nb_tasks;
+    Device *devices;
+    int nb_devices;
+
+    // Everything below is guarded by lock. Parts take minutes, one lock for
+    // the queues and device slots costs nothing next to that.
+    pthread_mutex_t lock;
+    pthread_cond_t slots_freed;
+    WorkerQueue *queues;
+    int nb_workers;
+    int pending;  // tasks not taken by a worker yet
+
+    pthread_mutex_t progress_lock;  // keeps calls to the caller's callback serialized
+};
+
+typedef struct {
+    SplitScheduler *scheduler;
+    int index;
+} SchedulerWorker;
+
+// Jobs of different plans report on their own, the caller expects one call at
+// a time
+static void scheduled_progress(const SplitProgress *progress, void *opaque) {
+    SplitScheduler *scheduler = opaque;
+    pthread_mutex_lock(&scheduler->progress_lock);
+    scheduler->caller->progress(progress, scheduler->caller->progress_opaque);
+    pthread_mutex_unlock(&scheduler->progress_lock);
+}
+
+int split_scheduler_new(const SplitOptions *options, SplitScheduler **scheduler_out) {
+    SplitScheduler *scheduler = calloc(1, sizeof(SplitScheduler));
+    if (!scheduler) {
+        return AVERROR(ENOMEM);
+    }
+    scheduler->caller = options;
+    scheduler->options = *options;
+    scheduler->options.follow = 0;
+    if (options->progress) {
+        scheduler->options.progress = scheduled_progress;
+        scheduler->options.progress_opaque = scheduler;
+    }
+    pthread_mutex_init(&scheduler->lock, NULL);
+    pthread_cond_init(&scheduler->slots_freed, NULL);
+    pthread_mutex_init(&scheduler->progress_lock, NULL);
+
+    *scheduler_out = scheduler;
+    return 0;
+}
+
+// Device of a file, or of the directory a file is about to be created in
+static int find_device(SplitScheduler *scheduler, const char *path, int parent) {
+    char probe_path[1024];
+    snprintf(probe_path, sizeof(probe_path), "%s", path);
+    if (parent) {
+        char *slash = strrchr(probe_path, '/');
+#ifdef _WIN32
+        char *backslash = strrchr(probe_path, '\\');
+        if (backslash > slash) {
+            slash = backslash;
+        }
+#endif
+        if (slash) {
+            slash[slash == probe_path ? 1 : 0] = '\0';
+        } else {
+            snprintf(probe_path, sizeof(probe_path), ".");
+        }
+    }
+
+    struct stat st;
+    if (stat(probe_path, &st) != 0) {
+        return AVERROR(errno);
+    }
+    for (int i = 0; i < scheduler->nb_devices; i++) {
+        if (scheduler->devices[i].dev == st.st_dev) {
+            return i;
+        }
+    }
+
+    Device *devices = realloc(scheduler->devices, (scheduler->nb_devices + 1) * sizeof(Device));
+    if (!devices) {
+        return AVERROR(ENOMEM);
+    }
+    scheduler->devices = devices;
+
+    Device *device = &devices[scheduler->nb_devices];
+    memset(device, 0, sizeof(*device));
+    device->dev = st.st_dev;
+    device->limit = storage_default_jobs(probe_path);
+    switch (storage_is_rotational(probe_path)) {
+    case 1:
+        device->throughput = ROTATIONAL_THROUGHPUT;
+        break;
+    case 0:
+        device->throughput = SOLID_STATE_THROUGHPUT;
+        break;
+    default:
+        device->throughput = UNKNOWN_THROUGHPUT;
+        break;
+    }
+    return scheduler->nb_devices++;
+}
+
+// Seconds a part should take: its share of the input read from one device
+// and written to another, plus a fixed cost for reopening the input
+static double task_cost(const SplitScheduler *scheduler, const SplitPlan *plan, const SchedulerTask *task) {
+    const SplitPart *part = &plan->parts[task->part];
+    double bytes = 0;
+    if (plan->probe && plan->probe->file_size > 0 && plan->total_duration > 0) {
+        bytes = plan->probe->file_size * (part->duration / plan->total_duration);
+    }
+    return bytes / scheduler->devices[task->input_device].throughput +
+           bytes / scheduler->devices[task->output_device].throughput + PART_OVERHEAD;
+}
+
+int split_scheduler_add(SplitScheduler *scheduler, SplitPlan *plan) {
+    if (plan->streaming) {
+        fprintf(stderr, "'%s' can only be read once, split it on its own\n", plan->input_filename);
+        return AVERROR(EINVAL);
+    }
+
+    ScheduledPlan *plans = realloc(scheduler->plans, (scheduler->nb_plans + 1) * sizeof(ScheduledPlan));
+    if (!plans) {
+        return AVERROR(ENOMEM);
+    }
+    scheduler->plans = plans;
+    SchedulerTask *tasks = realloc(scheduler->tasks, (scheduler->nb_tasks + plan->total_parts) * sizeof(SchedulerTask));
+    if (!tasks) {
+        return AVERROR(ENOMEM);
+    }
+    scheduler->tasks = tasks;
+
+    int input_device = find_device(scheduler, plan->input_filename, 0);
+    if (input_device < 0) {
+        fprintf(stderr, "Could not access '%s'\n", plan->input_filename);
+        return input_device;
+    }
+
+    // Opening the journal marks the parts an earlier run finished
+    SplitJob *job = NULL;
+    int ret = split_job_begin(plan, &scheduler->options, &job);
+    if (ret < 0) {
+        return ret;
+    }
+
+    int added = 0;
+    for (int i = 0; i < plan->total_parts; i++) {
+        if (plan->parts[i].skip) {
+            continue;
+        }
+        int output_device = find_device(scheduler, plan->parts[i].output_filename, 1);
+        if (output_device < 0) {
+            fprintf(stderr, "Could not access the directory of '%s'\n", plan->parts[i].output_filename);
+            return split_job_end(&job, output_device);
+        }
+
+        SchedulerTask *task = &scheduler->tasks[scheduler->nb_tasks + added];
+        task->plan = scheduler->nb_plans;
+        task->part = i;
+        task->input_device = input_device;
+        task->output_device = output_device;
+        task->cost = task_cost(scheduler, plan, task);
+        added++;
+    }
+
+    scheduler->plans[scheduler->nb_plans].plan = plan;
+    scheduler->plans[scheduler->nb_plans].job = job;
+    scheduler->nb_plans++;
+    scheduler->nb_tasks += added;
+    return 0;
+}
+
+// Costliest first, the order of the plans and their parts otherwise
+static int compare_tasks(const void *a, const void *b) {
+    const SchedulerTask *x = a;
+    const SchedulerTask *y = b;
+    if (x->cost != y->cost) {
+        return x->cost > y->cost ? -1 : 1;
+    }
+    if (x->plan != y->plan) {
+        return x->plan - y->plan;
+    }
+    return x->part - y->part;
+}
+
+// Must be called with lock held
+static int task_can_start(const SplitScheduler *scheduler, int t) {
+    const SchedulerTask *task = &scheduler->tasks[t];
+    return scheduler->devices[task->input_device].readers < scheduler->devices[task->input_device].limit &&
+           scheduler->devices[task->output_device].writers < scheduler->devices[task->output_device].limit;
+}
+
+static int take_from_queue(WorkerQueue *queue, int position) {
+    int t = queue->tasks[position];
+    memmove(&queue->tasks[position], &queue->tasks[position + 1], (queue->count - position - 1) * sizeof(int));
+    queue->count--;
+    return t;
+}
+
+// Next task a worker can start now: the first one of its own queue whose
+// devices have a slot free, else the last such one of another worker's
+// queue. -1 when every pending task waits on a busy device. Must be called
+// with lock held.
+static int next_task(SplitScheduler *scheduler, int worker) {
+    WorkerQueue *own = &scheduler->queues[worker];
+    for (int k = 0; k < own->count; k++) {
+        if (task_can_start(scheduler, own->tasks[k])) {
+            return take_from_queue(own, k);
+        }
+    }
+    for (int v = 1; v < scheduler->nb_workers; v++) {
+        WorkerQueue *victim = &scheduler->queues[(worker + v) % scheduler->nb_workers];
+        for (int k = victim->count - 1; k >= 0; k--) {
+            if (task_can_start(scheduler, victim->tasks[k])) {
+                return take_from_queue(victim, k);
+            }
+        }
+    }
+    return -1;
+}
+
+static void *scheduler_worker(void *arg) {
+    SchedulerWorker *worker = arg;
+    SplitScheduler *scheduler = worker->scheduler;
+
+    pthread_mutex_lock(&scheduler->lock);
+    while (scheduler->pending > 0) {
+        int t = next_task(scheduler, worker->index);
+        if (t < 0) {
+            pthread_cond_wait(&scheduler->slots_freed, &scheduler->lock);
+            continue;
+        }
+        SchedulerTask *task = &scheduler->tasks[t];
+        scheduler->pending--;
+        scheduler->devices[task->input_device].readers++;
+        scheduler->devices[task->output_device].writers++;
+        pthread_mutex_unlock(&scheduler->lock);
+
+        split_job_cut_part(scheduler->plans[task->plan].job, task->part);
+
+        pthread_mutex_lock(&scheduler->lock);
+        scheduler->devices[task->input_device].readers--;
+        scheduler->devices[task->output_device].writers--;
+        pthread_cond_broadcast(&scheduler->slots_freed);
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+    return NULL;
+}
+
+// Workers enough to fill every input device
+static int default_workers(const SplitScheduler *scheduler) {
+    int workers = 0;
+    for (int i = 0; i < scheduler->nb_devices; i++) {
+        int reads_from = 0;
+        for (int t = 0; t < scheduler->nb_tasks && !reads_from; t++) {
+            reads_from = scheduler->tasks[t].input_device == i;
+        }
+        if (reads_from) {
+            workers += scheduler->devices[i].limit;
+        }
+    }
+    return workers;
+}
+
+static int run_workers(SplitScheduler *scheduler) {
+    scheduler->queues = calloc(scheduler->nb_workers, sizeof(WorkerQueue));
+    pthread_t *threads = calloc(scheduler->nb_workers, sizeof(pthread_t));
+    SchedulerWorker *workers = calloc(scheduler->nb_workers, sizeof(SchedulerWorker));
+    int ret = 0;
+    if (!scheduler->queues || !threads || !workers) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    for (int w = 0; w < scheduler->nb_workers; w++) {
+        scheduler->queues[w].tasks = malloc(scheduler->nb_tasks * sizeof(int));
+        if (!scheduler->queues[w].tasks) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+        workers[w].scheduler = scheduler;
+        workers[w].index = w;
+    }
+
+    // Dealing the sorted tasks out in turn gives every worker a similar share
+    // of the cost, stealing evens out the rest
+    qsort(scheduler->tasks, scheduler->nb_tasks, sizeof(SchedulerTask), compare_tasks);
+    for (int t = 0; t < scheduler->nb_tasks; t++) {
+        WorkerQueue *queue = &scheduler->queues[t % scheduler->nb_workers];
+        queue->tasks[queue->count++] = t;
+    }
+    scheduler->pending = scheduler->nb_tasks;
+
+    int started = 0;
+    for (; started < scheduler->nb_workers; started++) {
+        if (pthread_create(&threads[started], NULL, scheduler_worker, &workers[started]) != 0) {
+            fprintf(stderr, "Could only start %d of %d workers\n", started, scheduler->nb_workers);
+            break;
+        }
+    }
+    if (started == 0) {
+        // No thread could be created, do the work here instead
+        scheduler_worker(&workers[0]);
+    }
+    for (int w = 0; w < started; w++) {
+        pthread_join(threads[w], NULL);
+    }
+
+end:
+    if (scheduler->queues) {
+        for (int w = 0; w < scheduler->nb_workers; w++) {
+            free(scheduler->queues[w].tasks);
+        }
+    }
+    free(scheduler->queues);
+    scheduler->queues = NULL;
+    free(workers);
+    free(threads);
+    return ret;
+}
+
+int split_scheduler_run(SplitScheduler *scheduler) {
+    scheduler->nb_workers = scheduler->options.jobs > 0 ? scheduler->options.jobs : default_workers(scheduler);
+    if (scheduler->nb_workers > scheduler->nb_tasks) {
+        scheduler->nb_workers = scheduler->nb_tasks;
+    }
+    if (scheduler->nb_workers < 1) {
+        scheduler->nb_workers = 1;
+    }
+    printf("\nCutting %d parts of %d inputs on %d devices with %d workers\n",
+           scheduler->nb_tasks, scheduler->nb_plans, scheduler->nb_devices, scheduler->nb_workers);
+
+    if (scheduler->options.trace_path && !TRACE_SESSION_ACTIVE()) {
+        TRACE_SESSION_BEGIN();
+    }
+    int ret = scheduler->nb_tasks > 0 ? run_workers(scheduler) : 0;
+
+    int failed = 0;
+    for (int p = 0; p < scheduler->nb_plans; p++) {
+        ScheduledPlan *scheduled = &scheduler->plans[p];
+        int plan_ret = ret;
+        for (int i = 0; i < scheduled->plan->total_parts && plan_ret >= 0; i++) {
+            const SplitPart *part = &scheduled->plan->parts[i];
+            if (!part->skip && part->result < 0) {
+                plan_ret = part->result;
+            }
+        }
+        if (plan_ret < 0) {
+            failed++;
+            if (ret == 0) {
+                ret = plan_ret;
+            }
+        }
+        split_job_end(&scheduled->job, plan_ret);
+    }
+    if (failed > 0) {
+        fprintf(stderr, "%d of %d inputs had parts fail\n", failed, scheduler->nb_plans);
+    }
+
+    if (scheduler->options.trace_path) {
+        TRACE_SESSION_END(scheduler->options.trace_path);
+    }
+    return ret;
+}
+
+void split_scheduler_free(SplitScheduler **scheduler) {
+    if (!*scheduler) {
+        return;
+    }
+    // Jobs never run keep their journals
+    for (int p = 0; p < (*scheduler)->nb_plans; p++) {
+        split_job_end(&(*scheduler)->plans[p].job, AVERROR_EXIT);
+    }
+    pthread_mutex_destroy(&(*scheduler)->lock);
+    pthread_cond_destroy(&(*scheduler)->slots_freed);
+    pthread_mutex_destroy(&(*scheduler)->progress_lock);
+    free((*scheduler)->plans);
+    free((*scheduler)->tasks);
+    free((*scheduler)->devices);
+    free(*scheduler);
+    *scheduler = NULL;
+}
@@ -0,0 +1,27 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "video_splitter.h"
+
+// Splits many inputs on one pool of workers. Every part of every plan is a
+// task; each worker has a queue of its own and steals from the others once
+// it runs dry. A task only starts while the device holding its input has a
+// reader slot free and the device it is written to a writer slot free, so a
+// spinning disk serves one part at a time while SSDs and separate disks work
+// in parallel. The costliest tasks go first, so the run doesn't end with
+// most workers idle behind one long part.
+typedef struct SplitScheduler SplitScheduler;
+
+// options->jobs is the number of workers, 0 gives every input device as many
+// as storage_default_jobs() suggests. The options must outlive the scheduler;
+// SPLIT_MODE and follow don't apply, every part is cut on its own.
+int split_scheduler_new(const SplitOptions*, SplitScheduler**);
+// Queues the parts of a plan not already done, opening its journal and
+// checksum manifest. The plan must outlive the scheduler.
+int split_scheduler_add(SplitScheduler*, SplitPlan*);
+// Cuts every queued part, filling in SplitPart.result. A failing part doesn't
+// stop the others; the first error is returned once all have been attempted.
+int split_scheduler_run(SplitScheduler*);
+void split_scheduler_free(SplitScheduler**);
+
+#endif
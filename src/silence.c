@@ -0,0 +1,440 @@
+#define _GNU_SOURCE
+#include "silence.h"
+#include "probe.h"
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define SILENCE_X86 1
+#include <immintrin.h>
+#endif
+
+#define SILENCE_BLOCK 0.02     // seconds of audio per energy value
+#define SILENCE_RUN 10         // blocks that must be quiet together (200 ms, a pause between words)
+#define SILENCE_GOP_PACKETS 4096  // packets read past a window looking for the next keyframe
+
+typedef struct {
+    AVFormatContext *input_ctx;
+    AVCodecContext *decoder;
+    int stream_index;
+    AVPacket *packet;
+    AVFrame *frame;
+    float *scratch;  // frame converted to interleaved float when it isn't float already
+    size_t scratch_samples;
+
+    int video_index;   // stream whose keyframes the cuts snap to, -1 for none
+    double *keyframes; // times of that stream's keyframes seen around the last window
+    int keyframe_count;
+    int keyframe_capacity;
+} SilenceScanner;
+
+static float sum_squares_scalar(const float *samples, size_t n) {
+    float sum = 0;
+    for (size_t i = 0; i < n; i++) {
+        sum += samples[i] * samples[i];
+    }
+    return sum;
+}
+
+#ifdef SILENCE_X86
+
+__attribute__((target("avx2")))
+static float sum_squares_avx2(const float *samples, size_t n) {
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256 a = _mm256_loadu_ps(samples + i);
+        __m256 b = _mm256_loadu_ps(samples + i + 8);
+        acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(a, a));
+        acc1 = _mm256_add_ps(acc1, _mm256_mul_ps(b, b));
+    }
+    __m256 acc = _mm256_add_ps(acc0, acc1);
+    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+    return _mm_cvtss_f32(sum) + sum_squares_scalar(samples + i, n - i);
+}
+
+__attribute__((target("sse")))
+static float sum_squares_sse(const float *samples, size_t n) {
+    __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128 a = _mm_loadu_ps(samples + i);
+        __m128 b = _mm_loadu_ps(samples + i + 4);
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(a, a));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(b, b));
+    }
+    __m128 sum = _mm_add_ps(acc0, acc1);
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+    return _mm_cvtss_f32(sum) + sum_squares_scalar(samples + i, n - i);
+}
+
+#endif
+
+float silence_sum_squares(const float *samples, size_t n) {
+#ifdef SILENCE_X86
+    static float (*kernel)(const float*, size_t);
+    if (!kernel) {
+        // Benign race: every thread picks the same function
+        __builtin_cpu_init();
+        kernel = __builtin_cpu_supports("avx2") ? sum_squares_avx2 :
+                 __builtin_cpu_supports("sse") ? sum_squares_sse : sum_squares_scalar;
+    }
+    return kernel(samples, n);
+#else
+    return sum_squares_scalar(samples, n);
+#endif
+}
+
+static void scanner_close(SilenceScanner *scanner) {
+    av_frame_free(&scanner->frame);
+    av_packet_free(&scanner->packet);
+    avcodec_free_context(&scanner->decoder);
+    avformat_close_input(&scanner->input_ctx);
+    free(scanner->scratch);
+    free(scanner->keyframes);
+    memset(scanner, 0, sizeof(*scanner));
+}
+
+static int scanner_open(SilenceScanner *scanner, const char *filename, int keyframes) {
+    const AVCodec *codec = NULL;
+
+    int ret = avformat_open_input(&scanner->input_ctx, filename, NULL, NULL);
+    if (ret < 0) {
+        fprintf(stderr, "Could not open input file '%s'\n", filename);
+        return ret;
+    }
+    ret = media_probe_find_stream_info(scanner->input_ctx, NULL);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to retrieve input stream information\n");
+        return ret;
+    }
+
+    ret = av_find_best_stream(scanner->input_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, &codec, 0);
+    if (ret < 0) {
+        return ret;
+    }
+    scanner->stream_index = ret;
+    scanner->video_index = keyframes ? av_find_best_stream(scanner->input_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0)
+                                     : -1;
+    if (scanner->video_index < 0) {
+        scanner->video_index = -1;
+    }
+
+    // Only the audio stream is demuxed, and the video keyframes when the cuts
+    // snap to them; other packets are skipped unread
+    for (unsigned i = 0; i < scanner->input_ctx->nb_streams; i++) {
+        if ((int)i == scanner->video_index) {
+            scanner->input_ctx->streams[i]->discard = AVDISCARD_NONKEY;
+        } else if ((int)i != scanner->stream_index) {
+            scanner->input_ctx->streams[i]->discard = AVDISCARD_ALL;
+        }
+    }
+
+    AVStream *stream = scanner->input_ctx->streams[scanner->stream_index];
+    scanner->decoder = avcodec_alloc_context3(codec);
+    scanner->packet = av_packet_alloc();
+    scanner->frame = av_frame_alloc();
+    if (!scanner->decoder || !scanner->packet || !scanner->frame) {
+        return AVERROR(ENOMEM);
+    }
+    ret = avcodec_parameters_to_context(scanner->decoder, stream->codecpar);
+    if (ret < 0) {
+        return ret;
+    }
+    scanner->decoder->pkt_timebase = stream->time_base;
+    ret = avcodec_open2(scanner->decoder, codec, NULL);
+    if (ret < 0) {
+        fprintf(stderr, "Could not open the audio decoder\n");
+    }
+    return ret;
+}
+
+static float sample_to_float(const uint8_t *data, enum AVSampleFormat format, size_t i) {
+    switch (format) {
+    case AV_SAMPLE_FMT_U8:
+    case AV_SAMPLE_FMT_U8P:
+        return (data[i] - 128) / 128.0f;
+    case AV_SAMPLE_FMT_S16:
+    case AV_SAMPLE_FMT_S16P:
+        return ((const int16_t *)data)[i] / 32768.0f;
+    case AV_SAMPLE_FMT_S32:
+    case AV_SAMPLE_FMT_S32P:
+        return ((const int32_t *)data)[i] / 2147483648.0f;
+    case AV_SAMPLE_FMT_DBL:
+    case AV_SAMPLE_FMT_DBLP:
+        return (float)((const double *)data)[i];
+    default:
+        return 0;
+    }
+}
+
+// Gives the frame as float samples, either in place (float formats) or
+// converted into the scratch buffer. Planar formats give one plane per
+// channel, packed formats a single interleaved plane.
+static int frame_as_float(SilenceScanner *scanner, const AVFrame *frame, const float **planes,
+                          int *plane_count, int *stride) {
+    int channels = frame->ch_layout.nb_channels;
+    enum AVSampleFormat format = frame->format;
+    int planar = av_sample_fmt_is_planar(format);
+
+    *plane_count = planar ? channels : 1;
+    *stride = planar ? 1 : channels;
+    if (*plane_count > AV_NUM_DATA_POINTERS) {
+        return AVERROR_PATCHWELCOME;
+    }
+
+    if (format == AV_SAMPLE_FMT_FLT || format == AV_SAMPLE_FMT_FLTP) {
+        for (int p = 0; p < *plane_count; p++) {
+            planes[p] = (const float *)frame->data[p];
+        }
+        return 0;
+    }
+
+    size_t per_plane = (size_t)frame->nb_samples * *stride;
+    size_t needed = per_plane * *plane_count;
+    if (needed > scanner->scratch_samples) {
+        float *scratch = realloc(scanner->scratch, needed * sizeof(float));
+        if (!scratch) {
+            return AVERROR(ENOMEM);
+        }
+        scanner->scratch = scratch;
+        scanner->scratch_samples = needed;
+    }
+    for (int p = 0; p < *plane_count; p++) {
+        float *out = scanner->scratch + p * per_plane;
+        for (size_t i = 0; i < per_plane; i++) {
+            out[i] = sample_to_float(frame->data[p], format, i);
+        }
+        planes[p] = out;
+    }
+    return 0;
+}
+
+// Adds a decoded frame's energy into the blocks it overlaps
+static int accumulate_frame(SilenceScanner *scanner, const AVFrame *frame, double frame_time,
+                            double window_start, float *energy, int block_count) {
+    const float *planes[AV_NUM_DATA_POINTERS];
+    int plane_count, stride;
+    int ret = frame_as_float(scanner, frame, planes, &plane_count, &stride);
+    if (ret < 0) {
+        return ret;
+    }
+
+    double sample_period = 1.0 / frame->sample_rate;
+    int i = 0;
+    while (i < frame->nb_samples) {
+        double t = frame_time + i * sample_period - window_start;
+        int block = (int)floor(t / SILENCE_BLOCK);
+        if (block >= block_count) {
+            break;
+        }
+        // Samples up to the end of this block
+        int block_end = (int)ceil(((block + 1) * SILENCE_BLOCK + window_start - frame_time) / sample_period);
+        if (block_end <= i) {
+            block_end = i + 1;
+        }
+        if (block_end > frame->nb_samples) {
+            block_end = frame->nb_samples;
+        }
+        if (block >= 0) {
+            for (int p = 0; p < plane_count; p++) {
+                energy[block] += silence_sum_squares(planes[p] + (size_t)i * stride,
+                                                     (size_t)(block_end - i) * stride);
+            }
+        }
+        i = block_end;
+    }
+    return 0;
+}
+
+// Records the time of a video keyframe read while scanning a window
+static int add_keyframe(SilenceScanner *scanner, const AVPacket *packet, double start_offset, double *time) {
+    int64_t ts = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+    if (ts == AV_NOPTS_VALUE) {
+        return 0;
+    }
+    if (scanner->keyframe_count == scanner->keyframe_capacity) {
+        int capacity = scanner->keyframe_capacity ? 2 * scanner->keyframe_capacity : 16;
+        double *keyframes = realloc(scanner->keyframes, capacity * sizeof(double));
+        if (!keyframes) {
+            return AVERROR(ENOMEM);
+        }
+        scanner->keyframes = keyframes;
+        scanner->keyframe_capacity = capacity;
+    }
+    *time = ts * av_q2d(scanner->input_ctx->streams[scanner->video_index]->time_base) - start_offset;
+    scanner->keyframes[scanner->keyframe_count++] = *time;
+    return 0;
+}
+
+// Decodes the audio from window_start for block_count blocks into energy[].
+// With a video stream to snap to, also records its keyframes from the one
+// the seek lands on up to the first at or after the window's end, so the
+// nearest keyframe is found without indexing the whole file.
+static int scan_window(SilenceScanner *scanner, double window_start, float *energy, int block_count) {
+    AVFormatContext *input_ctx = scanner->input_ctx;
+    AVStream *stream = input_ctx->streams[scanner->stream_index];
+    double start_offset = input_ctx->start_time != AV_NOPTS_VALUE ? (double)input_ctx->start_time / AV_TIME_BASE : 0;
+    double window_end = window_start + block_count * SILENCE_BLOCK;
+    double next_time = window_start;
+    scanner->keyframe_count = 0;
+
+    int64_t target = (int64_t)((window_start + start_offset) * AV_TIME_BASE);
+    int ret = avformat_seek_file(input_ctx, -1, INT64_MIN, target, target, 0);
+    if (ret < 0) {
+        return ret;
+    }
+    avcodec_flush_buffers(scanner->decoder);
+
+    int done = 0;
+    int keyframes_done = scanner->video_index < 0;
+    int packets_after = 0;  // read since the audio of the window was done
+    while (!(done && keyframes_done) && (ret = av_read_frame(input_ctx, scanner->packet)) >= 0) {
+        AVPacket *packet = scanner->packet;
+        if (done && ++packets_after > SILENCE_GOP_PACKETS) {
+            av_packet_unref(packet);
+            break;
+        }
+        if (packet->stream_index == scanner->video_index && (packet->flags & AV_PKT_FLAG_KEY)) {
+            double time = -DBL_MAX;  // stays so for a keyframe without timestamps
+            ret = add_keyframe(scanner, packet, start_offset, &time);
+            av_packet_unref(packet);
+            if (ret < 0) {
+                return ret;
+            }
+            keyframes_done = keyframes_done || time >= window_end;
+            continue;
+        }
+        if (packet->stream_index != scanner->stream_index || done) {
+            av_packet_unref(packet);
+            continue;
+        }
+        ret = avcodec_send_packet(scanner->decoder, scanner->packet);
+        av_packet_unref(scanner->packet);
+        if (ret < 0 && ret != AVERROR_INVALIDDATA) {
+            return ret;
+        }
+
+        while (!done && avcodec_receive_frame(scanner->decoder, scanner->frame) >= 0) {
+            AVFrame *frame = scanner->frame;
+            double frame_time = next_time;
+            if (frame->best_effort_timestamp != AV_NOPTS_VALUE) {
+                frame_time = frame->best_effort_timestamp * av_q2d(stream->time_base) - start_offset;
+            }
+            next_time = frame_time + (double)frame->nb_samples / frame->sample_rate;
+
+            if (next_time > window_start) {
+                ret = accumulate_frame(scanner, frame, frame_time, window_start, energy, block_count);
+                if (ret < 0) {
+                    av_frame_unref(frame);
+                    return ret;
+                }
+            }
+            done = next_time >= window_end;
+            av_frame_unref(frame);
+        }
+    }
+    return ret == AVERROR_EOF ? 0 : (ret < 0 ? ret : 0);
+}
+
+// Start of the SILENCE_RUN blocks with the least energy, -1 if the window is too short
+static int quietest_run(const float *energy, int block_count) {
+    int run = block_count < SILENCE_RUN ? block_count : SILENCE_RUN;
+    if (run <= 0) {
+        return -1;
+    }
+    double sum = 0;
+    for (int i = 0; i < run; i++) {
+        sum += energy[i];
+    }
+    double best = sum;
+    int best_start = 0;
+    for (int i = run; i < block_count; i++) {
+        sum += energy[i] - energy[i - run];
+        if (sum < best) {
+            best = sum;
+            best_start = i - run + 1;
+        }
+    }
+    return best_start;
+}
+
+// Keyframe recorded by the last scan_window() nearest to time and between
+// the two bounds, time itself when there is none
+static double nearest_keyframe(const SilenceScanner *scanner, double time, double after, double before) {
+    double best = time;
+    for (int i = 0; i < scanner->keyframe_count; i++) {
+        double keyframe = scanner->keyframes[i];
+        if (keyframe > after && keyframe < before && (best == time || fabs(keyframe - time) < fabs(best - time))) {
+            best = keyframe;
+        }
+    }
+    return best;
+}
+
+int silence_find_cuts(const char *filename, double *times, int count, double window, int keyframes) {
+    SilenceScanner scanner = {0};
+    int block_count = (int)(window / SILENCE_BLOCK);
+    if (count <= 0 || block_count <= 0) {
+        return 0;
+    }
+
+    int ret = scanner_open(&scanner, filename, keyframes);
+    if (ret == AVERROR_STREAM_NOT_FOUND) {
+        fprintf(stderr, "No audio stream, keeping the planned cuts\n");
+        scanner_close(&scanner);
+        return 0;
+    }
+    if (ret < 0) {
+        scanner_close(&scanner);
+        return ret;
+    }
+
+    float *energy = malloc(block_count * sizeof(float));
+    if (!energy) {
+        scanner_close(&scanner);
+        return AVERROR(ENOMEM);
+    }
+
+    for (int c = 0; c < count; c++) {
+        double window_start = times[c] - window / 2;
+        if (window_start < 0) {
+            window_start = 0;
+        }
+        memset(energy, 0, block_count * sizeof(float));
+        ret = scan_window(&scanner, window_start, energy, block_count);
+        int start = ret < 0 ? -1 : quietest_run(energy, block_count);
+        if (start < 0) {
+            fprintf(stderr, "Could not scan the audio around %.2f s, keeping that cut\n", times[c]);
+            continue;
+        }
+        int run = block_count < SILENCE_RUN ? block_count : SILENCE_RUN;
+        double quietest = window_start + (start + run / 2.0) * SILENCE_BLOCK;
+        if (scanner.video_index >= 0) {
+            // Kept after the previous cut and before the next window, so cuts can't cross
+            double after = c > 0 ? times[c - 1] : 0;
+            double before = c + 1 < count ? times[c + 1] - window / 2 : DBL_MAX;
+            double keyframe = nearest_keyframe(&scanner, quietest, after, before);
+            if (keyframe != quietest) {
+                printf("Cut at %.2f s moved to the keyframe at %.2f s, nearest the pause at %.2f s\n",
+                       times[c], keyframe, quietest);
+                times[c] = keyframe;
+                continue;
+            }
+        }
+        printf("Cut at %.2f s moved to %.2f s\n", times[c], quietest);
+        times[c] = quietest;
+    }
+
+    free(energy);
+    scanner_close(&scanner);
+    return 0;
+}
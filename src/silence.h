@@ -0,0 +1,17 @@
+#ifndef SILENCE_H
+#define SILENCE_H
+
+#include <stddef.h>
+
+// Sum of the squares of n samples, with AVX2 or SSE when the CPU has them
+float silence_sum_squares(const float*, size_t);
+
+// Moves every cut in times (seconds from the start of the input) to the
+// quietest moment of the best audio stream within window seconds centred on
+// it. Only the audio inside each window is decoded. Cuts stay where they are
+// when the input has no audio or a window can't be decoded. With keyframes
+// set, a moved cut then goes to the video keyframe nearest the pause, found
+// by reading on from the window to the next keyframe, not a full-file scan.
+int silence_find_cuts(const char*, double*, int, double, int);
+
+#endif
@@ -0,0 +1,539 @@
+#include "smart_render.h"
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/avutil.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct SmartRender {
+    AVFormatContext *output_ctx;
+    int stream_index;
+    AVRational time_base;      // of the input stream
+    AVRational frame_rate;
+    int64_t bit_rate;
+    int profile;
+    int64_t cut_pts;           // in time_base, also the offset of the output timeline
+
+    AVCodecContext *decoder;
+    AVCodecContext *encoder;   // opened on the first frame to re-encode
+    AVFrame *frame;
+
+    AVPacket *keyframe;        // first keyframe at or after the cut, written after the re-encoded frames
+    int64_t keyframe_pts;
+
+    // Re-encoded packets are held until the keyframe's decode delay is known
+    AVPacket **encoded;
+    int encoded_count;
+    int encoded_capacity;
+    int64_t *source_pts;       // pts of every frame sent to the encoder, in time_base
+    int source_count;
+    int source_capacity;
+
+    int length_size;           // NAL length field of the output's avcC/hvcC, 0 keeps Annex B
+    // The source's own SPS/PPS (and VPS), in the same framing as the packets,
+    // written in front of the copied keyframe to replace the encoder's
+    uint8_t *parameter_sets;
+    int parameter_sets_size;
+    int finished;
+};
+
+// Size of the NAL length prefix when the output stream's extradata is in
+// avcC/hvcC form rather than Annex B, 0 when packets are written as encoded
+static int nal_length_size(const AVCodecParameters *par) {
+    if (!par->extradata || par->extradata[0] != 1) {
+        return 0;
+    }
+    if (par->codec_id == AV_CODEC_ID_H264 && par->extradata_size > 4) {
+        return (par->extradata[4] & 3) + 1;
+    }
+    if (par->codec_id == AV_CODEC_ID_HEVC && par->extradata_size > 21) {
+        return (par->extradata[21] & 3) + 1;
+    }
+    return 0;
+}
+
+// Appends the NAL units of avcC/hvcC extradata with length_size prefixes.
+// Returns the bytes written, or AVERROR_INVALIDDATA for truncated extradata.
+static int copy_nal_units(const uint8_t **data, const uint8_t *end, int count, int length_size, uint8_t *out) {
+    int written = 0;
+    for (int i = 0; i < count; i++) {
+        if (end - *data < 2) {
+            return AVERROR_INVALIDDATA;
+        }
+        int nal_size = ((*data)[0] << 8) | (*data)[1];
+        *data += 2;
+        if (end - *data < nal_size) {
+            return AVERROR_INVALIDDATA;
+        }
+        if (out) {
+            for (int b = length_size - 1; b >= 0; b--) {
+                out[written++] = (uint8_t)(nal_size >> (8 * b));
+            }
+            memcpy(out + written, *data, nal_size);
+        } else {
+            written += length_size;
+        }
+        written += nal_size;
+        *data += nal_size;
+    }
+    return written;
+}
+
+// Walks the parameter set arrays of avcC or hvcC extradata, sizing the
+// output when out is NULL
+static int extradata_nal_units(const AVCodecParameters *par, int length_size, uint8_t *out) {
+    const uint8_t *data = par->extradata;
+    const uint8_t *end = par->extradata + par->extradata_size;
+    int written = 0;
+
+    if (par->codec_id == AV_CODEC_ID_H264) {
+        data += 5;
+        for (int array = 0; array < 2; array++) {
+            if (data >= end) {
+                return AVERROR_INVALIDDATA;
+            }
+            int count = array == 0 ? *data & 0x1f : *data;  // SPS, then PPS
+            data++;
+            int ret = copy_nal_units(&data, end, count, length_size, out ? out + written : NULL);
+            if (ret < 0) {
+                return ret;
+            }
+            written += ret;
+        }
+        return written;
+    }
+
+    data += 22;
+    if (data >= end) {
+        return AVERROR_INVALIDDATA;
+    }
+    int arrays = *data++;
+    for (int array = 0; array < arrays; array++) {
+        if (end - data < 3) {
+            return AVERROR_INVALIDDATA;
+        }
+        int count = (data[1] << 8) | data[2];
+        data += 3;
+        int ret = copy_nal_units(&data, end, count, length_size, out ? out + written : NULL);
+        if (ret < 0) {
+            return ret;
+        }
+        written += ret;
+    }
+    return written;
+}
+
+// The re-encoded frames carry the encoder's SPS/PPS in-band, which would stay
+// in effect for the copied GOPs. The source's are taken from the stream
+// extradata to be written again before the copied keyframe: as they are when
+// the extradata is Annex B, converted to length prefixes from avcC/hvcC.
+static int source_parameter_sets(SmartRender *render, const AVCodecParameters *par) {
+    if (!par->extradata || par->extradata_size < 4 ||
+        (par->codec_id != AV_CODEC_ID_H264 && par->codec_id != AV_CODEC_ID_HEVC)) {
+        return 0;
+    }
+
+    int size = render->length_size ? extradata_nal_units(par, render->length_size, NULL) : par->extradata_size;
+    if (size <= 0 || (!render->length_size && par->extradata[0] != 0)) {
+        return 0;  // nothing usable, the keyframe has to bring its own
+    }
+    render->parameter_sets = av_malloc(size);
+    if (!render->parameter_sets) {
+        return AVERROR(ENOMEM);
+    }
+    if (render->length_size) {
+        extradata_nal_units(par, render->length_size, render->parameter_sets);
+    } else {
+        memcpy(render->parameter_sets, par->extradata, size);
+    }
+    render->parameter_sets_size = size;
+    return 0;
+}
+
+// Puts the source's parameter sets in front of the copied keyframe
+static int prepend_parameter_sets(SmartRender *render, AVPacket *packet) {
+    AVPacket *out = av_packet_alloc();
+    if (!out) {
+        return AVERROR(ENOMEM);
+    }
+    int ret = av_new_packet(out, render->parameter_sets_size + packet->size);
+    if (ret < 0 || (ret = av_packet_copy_props(out, packet)) < 0) {
+        av_packet_free(&out);
+        return ret;
+    }
+    memcpy(out->data, render->parameter_sets, render->parameter_sets_size);
+    memcpy(out->data + render->parameter_sets_size, packet->data, packet->size);
+
+    av_packet_unref(packet);
+    av_packet_move_ref(packet, out);
+    av_packet_free(&out);
+    return 0;
+}
+
+// Finds the next Annex B start code at or after pos, returns the buffer size
+// when there is none
+static int next_start_code(const uint8_t *data, int size, int pos, int *code_size) {
+    for (int i = pos; i + 2 < size; i++) {
+        if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1) {
+            int begin = (i > pos && data[i - 1] == 0) ? i - 1 : i;
+            *code_size = i + 3 - begin;
+            return begin;
+        }
+    }
+    *code_size = 0;
+    return size;
+}
+
+// Rewrites an Annex B packet with length-prefixed NAL units
+static int annexb_to_length_prefixed(AVPacket *packet, int length_size) {
+    const uint8_t *data = packet->data;
+    int size = packet->size;
+    int code_size;
+    int out_size = 0;
+
+    int pos = next_start_code(data, size, 0, &code_size);
+    while (pos < size) {
+        int nal_start = pos + code_size;
+        pos = next_start_code(data, size, nal_start, &code_size);
+        out_size += length_size + (pos - nal_start);
+    }
+
+    AVPacket *out = av_packet_alloc();
+    if (!out) {
+        return AVERROR(ENOMEM);
+    }
+    int ret = av_new_packet(out, out_size);
+    if (ret < 0 || (ret = av_packet_copy_props(out, packet)) < 0) {
+        av_packet_free(&out);
+        return ret;
+    }
+
+    uint8_t *write = out->data;
+    pos = next_start_code(data, size, 0, &code_size);
+    while (pos < size) {
+        int nal_start = pos + code_size;
+        pos = next_start_code(data, size, nal_start, &code_size);
+        int nal_size = pos - nal_start;
+        for (int b = length_size - 1; b >= 0; b--) {
+            *write++ = (uint8_t)(nal_size >> (8 * b));
+        }
+        memcpy(write, data + nal_start, nal_size);
+        write += nal_size;
+    }
+
+    av_packet_unref(packet);
+    av_packet_move_ref(packet, out);
+    av_packet_free(&out);
+    return 0;
+}
+
+int smart_render_new(AVFormatContext *input_ctx, int stream_index, AVFormatContext *output_ctx,
+                     int64_t start_us, SmartRender **out) {
+    AVStream *stream = input_ctx->streams[stream_index];
+    AVCodecParameters *par = stream->codecpar;
+
+    if (!avcodec_find_encoder(par->codec_id)) {
+        fprintf(stderr, "No %s encoder, the part will start on a keyframe\n", avcodec_get_name(par->codec_id));
+        return AVERROR_ENCODER_NOT_FOUND;
+    }
+    const AVCodec *codec = avcodec_find_decoder(par->codec_id);
+    if (!codec) {
+        fprintf(stderr, "No %s decoder, the part will start on a keyframe\n", avcodec_get_name(par->codec_id));
+        return AVERROR_DECODER_NOT_FOUND;
+    }
+
+    SmartRender *render = calloc(1, sizeof(SmartRender));
+    if (!render) {
+        return AVERROR(ENOMEM);
+    }
+    render->output_ctx = output_ctx;
+    render->stream_index = stream_index;
+    render->time_base = stream->time_base;
+    render->frame_rate = av_guess_frame_rate(input_ctx, stream, NULL);
+    render->bit_rate = par->bit_rate > 0 ? par->bit_rate : input_ctx->bit_rate;
+    render->profile = par->profile;
+    render->cut_pts = av_rescale_q(start_us, AV_TIME_BASE_Q, stream->time_base);
+    render->keyframe_pts = AV_NOPTS_VALUE;
+    render->length_size = nal_length_size(output_ctx->streams[stream_index]->codecpar);
+
+    int ret = source_parameter_sets(render, output_ctx->streams[stream_index]->codecpar);
+    if (ret < 0) {
+        goto fail;
+    }
+    ret = AVERROR(ENOMEM);
+    render->decoder = avcodec_alloc_context3(codec);
+    render->frame = av_frame_alloc();
+    if (!render->decoder || !render->frame) {
+        goto fail;
+    }
+    ret = avcodec_parameters_to_context(render->decoder, par);
+    if (ret < 0) {
+        goto fail;
+    }
+    render->decoder->pkt_timebase = stream->time_base;
+    ret = avcodec_open2(render->decoder, codec, NULL);
+    if (ret < 0) {
+        fprintf(stderr, "Could not open the %s decoder\n", codec->name);
+        goto fail;
+    }
+
+    *out = render;
+    return 0;
+
+fail:
+    smart_render_free(&render);
+    return ret;
+}
+
+static int open_encoder(SmartRender *render, const AVFrame *frame) {
+    const AVCodec *codec = avcodec_find_encoder(render->decoder->codec_id);
+    AVCodecContext *encoder = avcodec_alloc_context3(codec);
+    if (!encoder) {
+        return AVERROR(ENOMEM);
+    }
+
+    encoder->width = frame->width;
+    encoder->height = frame->height;
+    encoder->pix_fmt = frame->format;
+    encoder->sample_aspect_ratio = frame->sample_aspect_ratio;
+    encoder->color_range = frame->color_range;
+    encoder->color_primaries = frame->color_primaries;
+    encoder->color_trc = frame->color_trc;
+    encoder->colorspace = frame->colorspace;
+    encoder->chroma_sample_location = frame->chroma_location;
+    encoder->field_order = render->decoder->field_order;
+    encoder->profile = render->profile;
+    encoder->bit_rate = render->bit_rate;
+    encoder->framerate = render->frame_rate;
+    // Encoders such as MPEG-2 only accept their standard frame rates as time base
+    encoder->time_base = render->frame_rate.num > 0 ? av_inv_q(render->frame_rate) : render->time_base;
+    // Without B-frames packets come out in the order frames went in, so
+    // each one gets back the exact source pts of its frame
+    encoder->max_b_frames = 0;
+    encoder->thread_count = 0;
+
+    int ret = avcodec_open2(encoder, codec, NULL);
+    if (ret < 0) {
+        fprintf(stderr, "Could not open the %s encoder\n", codec->name);
+        avcodec_free_context(&encoder);
+        return ret;
+    }
+    render->encoder = encoder;
+    return 0;
+}
+
+static int append_encoded(SmartRender *render, AVPacket *packet) {
+    if (render->encoded_count == render->encoded_capacity) {
+        int capacity = render->encoded_capacity ? render->encoded_capacity * 2 : 64;
+        AVPacket **grown = realloc(render->encoded, capacity * sizeof(AVPacket*));
+        if (!grown) {
+            return AVERROR(ENOMEM);
+        }
+        render->encoded = grown;
+        render->encoded_capacity = capacity;
+    }
+    render->encoded[render->encoded_count++] = packet;
+    return 0;
+}
+
+// Sends a frame (NULL to drain) to the encoder and keeps what comes out
+static int encode(SmartRender *render, AVFrame *frame) {
+    if (frame) {
+        if (render->source_count == render->source_capacity) {
+            int capacity = render->source_capacity ? render->source_capacity * 2 : 64;
+            int64_t *grown = realloc(render->source_pts, capacity * sizeof(int64_t));
+            if (!grown) {
+                return AVERROR(ENOMEM);
+            }
+            render->source_pts = grown;
+            render->source_capacity = capacity;
+        }
+        render->source_pts[render->source_count++] = frame->pts;
+        frame->pts = av_rescale_q(frame->pts, render->time_base, render->encoder->time_base);
+        frame->pict_type = AV_PICTURE_TYPE_NONE;
+    }
+
+    int ret = avcodec_send_frame(render->encoder, frame);
+    if (ret < 0) {
+        return ret;
+    }
+    for (;;) {
+        AVPacket *packet = av_packet_alloc();
+        if (!packet) {
+            return AVERROR(ENOMEM);
+        }
+        ret = avcodec_receive_packet(render->encoder, packet);
+        if (ret < 0) {
+            av_packet_free(&packet);
+            return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+        }
+        packet->duration = av_rescale_q(packet->duration, render->encoder->time_base, render->time_base);
+        if (render->encoded_count < render->source_count) {
+            packet->pts = render->source_pts[render->encoded_count];
+        } else {
+            packet->pts = av_rescale_q(packet->pts, render->encoder->time_base, render->time_base);
+        }
+        ret = append_encoded(render, packet);
+        if (ret < 0) {
+            av_packet_free(&packet);
+            return ret;
+        }
+    }
+}
+
+// Sends a packet (NULL to drain) to the decoder and re-encodes the frames
+// that are displayed from the cut up to the keyframe
+static int decode(SmartRender *render, const AVPacket *packet) {
+    int ret = avcodec_send_packet(render->decoder, packet);
+    if (ret < 0 && ret != AVERROR_INVALIDDATA) {
+        return ret;
+    }
+
+    while ((ret = avcodec_receive_frame(render->decoder, render->frame)) >= 0) {
+        AVFrame *frame = render->frame;
+        int64_t pts = frame->best_effort_timestamp;
+        if (pts == AV_NOPTS_VALUE || pts < render->cut_pts ||
+            (render->keyframe_pts != AV_NOPTS_VALUE && pts >= render->keyframe_pts)) {
+            av_frame_unref(frame);
+            continue;
+        }
+
+        if (!render->encoder) {
+            ret = open_encoder(render, frame);
+            if (ret < 0) {
+                av_frame_unref(frame);
+                return ret;
+            }
+        }
+        frame->pts = pts;
+        ret = encode(render, frame);
+        av_frame_unref(frame);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+}
+
+// Copied packets get the same offset and rescaling as the caller applies
+static int write_packet(SmartRender *render, AVPacket *packet) {
+    AVStream *output_stream = render->output_ctx->streams[render->stream_index];
+    if (packet->pts != AV_NOPTS_VALUE) {
+        packet->pts -= render->cut_pts;
+    }
+    if (packet->dts != AV_NOPTS_VALUE) {
+        packet->dts -= render->cut_pts;
+    }
+    av_packet_rescale_ts(packet, render->time_base, output_stream->time_base);
+    packet->stream_index = render->stream_index;
+    packet->pos = -1;
+    return av_interleaved_write_frame(render->output_ctx, packet);
+}
+
+int smart_render_finish(SmartRender *render) {
+    if (render->finished) {
+        return 0;
+    }
+    render->finished = 1;
+
+    int ret = decode(render, NULL);
+    if (ret >= 0 && render->encoder) {
+        ret = encode(render, NULL);
+    }
+    if (ret < 0) {
+        fprintf(stderr, "Error re-encoding the start of the part\n");
+        return ret;
+    }
+
+    // The copied keyframe may be decoded ahead of its display time (B-frames).
+    // Re-encoded frames are shifted back by the same delay so dts keeps rising
+    // into the copied packets.
+    int64_t delay = 0;
+    if (render->keyframe && render->keyframe->pts != AV_NOPTS_VALUE && render->keyframe->dts != AV_NOPTS_VALUE) {
+        delay = render->keyframe->pts - render->keyframe->dts;
+    }
+
+    for (int i = 0; i < render->encoded_count; i++) {
+        AVPacket *packet = render->encoded[i];
+        packet->dts = packet->pts != AV_NOPTS_VALUE ? packet->pts - delay : AV_NOPTS_VALUE;
+        if (render->length_size) {
+            ret = annexb_to_length_prefixed(packet, render->length_size);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        ret = write_packet(render, packet);
+        if (ret < 0) {
+            fprintf(stderr, "Error writing a re-encoded packet\n");
+            return ret;
+        }
+    }
+    if (render->encoded_count > 0) {
+        printf("Re-encoded %d frames up to the first keyframe\n", render->encoded_count);
+    }
+
+    if (render->keyframe && render->encoded_count > 0 && render->parameter_sets) {
+        ret = prepend_parameter_sets(render, render->keyframe);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    if (render->keyframe) {
+        ret = write_packet(render, render->keyframe);
+        av_packet_free(&render->keyframe);
+    }
+    return ret;
+}
+
+int smart_render_packet(SmartRender *render, AVPacket *packet) {
+    int64_t ts = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+    int ret;
+
+    if (!render->keyframe) {
+        if ((packet->flags & AV_PKT_FLAG_KEY) && ts != AV_NOPTS_VALUE && ts >= render->cut_pts) {
+            // Decoded too, the leading pictures that may follow it refer to it
+            render->keyframe_pts = ts;
+            ret = decode(render, packet);
+            if (ret >= 0) {
+                render->keyframe = av_packet_alloc();
+                ret = render->keyframe ? 0 : AVERROR(ENOMEM);
+            }
+            if (ret >= 0) {
+                av_packet_move_ref(render->keyframe, packet);
+            }
+        } else {
+            ret = decode(render, packet);
+        }
+        av_packet_unref(packet);
+        return ret;
+    }
+
+    // Pictures displayed before the keyframe but decoded after it
+    if (ts != AV_NOPTS_VALUE && ts < render->keyframe_pts) {
+        ret = decode(render, packet);
+        av_packet_unref(packet);
+        return ret;
+    }
+
+    ret = smart_render_finish(render);
+    return ret < 0 ? ret : 1;
+}
+
+void smart_render_free(SmartRender **render) {
+    if (!*render) {
+        return;
+    }
+    for (int i = 0; i < (*render)->encoded_count; i++) {
+        av_packet_free(&(*render)->encoded[i]);
+    }
+    free((*render)->encoded);
+    free((*render)->source_pts);
+    av_freep(&(*render)->parameter_sets);
+    av_packet_free(&(*render)->keyframe);
+    av_frame_free(&(*render)->frame);
+    avcodec_free_context(&(*render)->encoder);
+    avcodec_free_context(&(*render)->decoder);
+    free(*render);
+    *render = NULL;
+}
@@ -0,0 +1,33 @@
+#ifndef SMART_RENDER_H
+#define SMART_RENDER_H
+
+#include <stdint.h>
+
+struct AVFormatContext;
+struct AVPacket;
+
+// Frame-exact part starts without transcoding the whole part. Frames from the
+// cut up to the first keyframe after it are decoded and re-encoded with the
+// source codec, the rest of the stream is copied. Re-encoded frames carry
+// the encoder's parameter sets in-band; for H.264/HEVC the source's, taken
+// from the stream extradata, are written again in front of the copied
+// keyframe so the copied GOPs decode with their own.
+typedef struct SmartRender SmartRender;
+
+// Re-encodes stream stream_index of input_ctx into output_ctx, whose header
+// must already be written, from start_us (absolute, AV_TIME_BASE units). The
+// output timeline starts at start_us.
+int smart_render_new(struct AVFormatContext*, int, struct AVFormatContext*, int64_t, SmartRender**);
+
+// Takes the next packet of the re-encoded stream, from the seek point on.
+// Returns 0 when the packet was used (its reference is taken), or 1 once the
+// re-encoded frames and the keyframe have been written: that packet and every
+// later one are to be copied by the caller.
+int smart_render_packet(SmartRender*, struct AVPacket*);
+
+// Writes whatever is still pending, for parts that end before the keyframe
+int smart_render_finish(SmartRender*);
+
+void smart_render_free(SmartRender**);
+
+#endif
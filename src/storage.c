@@ -0,0 +1,71 @@
+#define _GNU_SOURCE
+#include "storage.h"
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/sysmacros.h>
+#endif
+
+#define MAX_DEFAULT_JOBS 8
+
+static int read_rotational_flag(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return -1;
+    }
+    int value = -1;
+    if (fscanf(fp, "%d", &value) != 1) {
+        value = -1;
+    }
+    fclose(fp);
+    return value;
+}
+
+int storage_is_rotational(const char *filename) {
+#ifdef __linux__
+    struct stat st;
+    if (stat(filename, &st) != 0) {
+        return -1;
+    }
+
+    // Whole disks expose queue/ directly, partitions through their parent
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/rotational",
+             major(st.st_dev), minor(st.st_dev));
+    int rotational = read_rotational_flag(path);
+    if (rotational < 0) {
+        snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../queue/rotational",
+                 major(st.st_dev), minor(st.st_dev));
+        rotational = read_rotational_flag(path);
+    }
+    return rotational;
+#else
+    (void)filename;
+    return -1;
+#endif
+}
+
+static int online_cpus(void) {
+#ifdef _SC_NPROCESSORS_ONLN
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus > 0) {
+        return (int)cpus;
+    }
+#endif
+    return 1;
+}
+
+int storage_default_jobs(const char *filename) {
+    switch (storage_is_rotational(filename)) {
+    case 1:
+        // A second reader on a spinning disk only adds seeks
+        return 1;
+    case 0: {
+        int cpus = online_cpus();
+        return cpus < MAX_DEFAULT_JOBS ? cpus : MAX_DEFAULT_JOBS;
+    }
+    default:
+        return 2;
+    }
+}
@@ -0,0 +1,10 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+// 1 for spinning disks, 0 for solid state, -1 when it can't be told
+int storage_is_rotational(const char*);
+
+// Number of concurrent part workers that suits the device holding the file
+int storage_default_jobs(const char*);
+
+#endif
@@ -0,0 +1,248 @@
+#include "trace.h"
+
+#ifdef VS_ENABLE_TRACE
+
+#include <libavutil/avutil.h>
+#include <libavutil/time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TRACE_MAX_STREAMS 32  // higher stream indexes are counted with the last one
+#define TRACE_MAX_SPAN_NAMES 32
+
+typedef struct {
+    const char *name;
+    int part;
+    int tid;
+    int64_t start;
+    int64_t duration;
+} TraceEvent;
+
+typedef struct {
+    atomic_llong count;
+    atomic_llong bytes;
+    atomic_llong total_us;
+    atomic_llong max_us;
+} TraceCounter;
+
+static const char *const stat_names[TRACE_STAT_COUNT] = { "read", "write", "seek", "wait" };
+
+static atomic_int active;
+static int64_t session_start;
+static pthread_mutex_t events_lock = PTHREAD_MUTEX_INITIALIZER;
+static TraceEvent *events;
+static int event_count;
+static int event_capacity;
+static TraceCounter counters[TRACE_MAX_STREAMS][TRACE_STAT_COUNT];
+
+static atomic_int next_tid = 1;
+static _Thread_local int thread_tid;
+
+int64_t trace_clock(void) {
+    return av_gettime_relative();
+}
+
+static int current_tid(void) {
+    if (!thread_tid) {
+        thread_tid = atomic_fetch_add(&next_tid, 1);
+    }
+    return thread_tid;
+}
+
+void trace_session_begin(void) {
+    pthread_mutex_lock(&events_lock);
+    event_count = 0;
+    for (int s = 0; s < TRACE_MAX_STREAMS; s++) {
+        for (int k = 0; k < TRACE_STAT_COUNT; k++) {
+            atomic_store(&counters[s][k].count, 0);
+            atomic_store(&counters[s][k].bytes, 0);
+            atomic_store(&counters[s][k].total_us, 0);
+            atomic_store(&counters[s][k].max_us, 0);
+        }
+    }
+    session_start = trace_clock();
+    pthread_mutex_unlock(&events_lock);
+    atomic_store(&active, 1);
+}
+
+int trace_session_active(void) {
+    return atomic_load(&active);
+}
+
+void trace_span(const char *name, int part, int64_t start_us) {
+    int64_t now = trace_clock();
+    if (!atomic_load_explicit(&active, memory_order_relaxed)) {
+        return;
+    }
+
+    pthread_mutex_lock(&events_lock);
+    if (event_count == event_capacity) {
+        int capacity = event_capacity ? event_capacity * 2 : 1024;
+        TraceEvent *grown = realloc(events, capacity * sizeof(TraceEvent));
+        if (!grown) {
+            pthread_mutex_unlock(&events_lock);
+            return;
+        }
+        events = grown;
+        event_capacity = capacity;
+    }
+    events[event_count++] = (TraceEvent){
+        .name = name, .part = part, .tid = current_tid(), .start = start_us, .duration = now - start_us,
+    };
+    pthread_mutex_unlock(&events_lock);
+}
+
+void trace_stat(TraceStat stat, int stream, int64_t bytes, int64_t start_us) {
+    int64_t elapsed = trace_clock() - start_us;
+    if (!atomic_load_explicit(&active, memory_order_relaxed)) {
+        return;
+    }
+    if (stream < 0) {
+        stream = 0;
+    } else if (stream >= TRACE_MAX_STREAMS) {
+        stream = TRACE_MAX_STREAMS - 1;
+    }
+
+    TraceCounter *counter = &counters[stream][stat];
+    atomic_fetch_add_explicit(&counter->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&counter->bytes, bytes, memory_order_relaxed);
+    atomic_fetch_add_explicit(&counter->total_us, elapsed, memory_order_relaxed);
+    long long max = atomic_load_explicit(&counter->max_us, memory_order_relaxed);
+    while (elapsed > max &&
+           !atomic_compare_exchange_weak_explicit(&counter->max_us, &max, elapsed,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+typedef struct {
+    const char *name;
+    int64_t count;
+    int64_t total_us;
+    int64_t max_us;
+} SpanTotal;
+
+static int sum_spans(SpanTotal *totals) {
+    int count = 0;
+    for (int i = 0; i < event_count; i++) {
+        int t = 0;
+        while (t < count && strcmp(totals[t].name, events[i].name) != 0) {
+            t++;
+        }
+        if (t == count) {
+            if (count == TRACE_MAX_SPAN_NAMES) {
+                continue;
+            }
+            totals[count++] = (SpanTotal){ .name = events[i].name };
+        }
+        totals[t].count++;
+        totals[t].total_us += events[i].duration;
+        if (events[i].duration > totals[t].max_us) {
+            totals[t].max_us = events[i].duration;
+        }
+    }
+    return count;
+}
+
+static int highest_stream(void) {
+    int highest = -1;
+    for (int s = 0; s < TRACE_MAX_STREAMS; s++) {
+        for (int k = 0; k < TRACE_STAT_COUNT; k++) {
+            if (atomic_load(&counters[s][k].count) > 0) {
+                highest = s;
+            }
+        }
+    }
+    return highest;
+}
+
+static void write_summary_json(FILE *f, const SpanTotal *spans, int span_count, int streams) {
+    fprintf(f, "\"otherData\": {\"spans\": {");
+    for (int t = 0; t < span_count; t++) {
+        fprintf(f, "%s\"%s\": {\"count\": %lld, \"total_ms\": %.3f, \"max_ms\": %.3f}",
+                t ? ", " : "", spans[t].name, (long long)spans[t].count,
+                spans[t].total_us / 1000.0, spans[t].max_us / 1000.0);
+    }
+    fprintf(f, "}, \"streams\": [");
+    for (int s = 0; s < streams; s++) {
+        fprintf(f, "%s{\"stream\": %d", s ? ", " : "", s);
+        for (int k = 0; k < TRACE_STAT_COUNT; k++) {
+            TraceCounter *counter = &counters[s][k];
+            fprintf(f, ", \"%s\": {\"count\": %lld, \"bytes\": %lld, \"total_ms\": %.3f, \"max_ms\": %.3f}",
+                    stat_names[k], (long long)atomic_load(&counter->count),
+                    (long long)atomic_load(&counter->bytes),
+                    atomic_load(&counter->total_us) / 1000.0, atomic_load(&counter->max_us) / 1000.0);
+        }
+        fprintf(f, "}");
+    }
+    fprintf(f, "]}");
+}
+
+static void print_summary(const SpanTotal *spans, int span_count, int streams) {
+    fprintf(stderr, "\nTrace summary (%.3f s)\n", (trace_clock() - session_start) / 1e6);
+    for (int t = 0; t < span_count; t++) {
+        fprintf(stderr, "  %-14s %6lld x  total %10.3f ms  max %9.3f ms\n", spans[t].name,
+                (long long)spans[t].count, spans[t].total_us / 1000.0, spans[t].max_us / 1000.0);
+    }
+    for (int s = 0; s < streams; s++) {
+        for (int k = 0; k < TRACE_STAT_COUNT; k++) {
+            TraceCounter *counter = &counters[s][k];
+            long long count = atomic_load(&counter->count);
+            if (count == 0) {
+                continue;
+            }
+            fprintf(stderr, "  stream %-2d %-5s %9lld x  %12lld bytes  total %10.3f ms  max %9.3f ms\n",
+                    s, stat_names[k], count, (long long)atomic_load(&counter->bytes),
+                    atomic_load(&counter->total_us) / 1000.0, atomic_load(&counter->max_us) / 1000.0);
+        }
+    }
+}
+
+int trace_session_end(const char *path) {
+    atomic_store(&active, 0);
+
+    pthread_mutex_lock(&events_lock);
+    SpanTotal spans[TRACE_MAX_SPAN_NAMES];
+    int span_count = sum_spans(spans);
+    int streams = highest_stream() + 1;
+    print_summary(spans, span_count, streams);
+
+    int ret = 0;
+    FILE *f = path ? fopen(path, "w") : NULL;
+    if (path && !f) {
+        ret = AVERROR(errno);
+        fprintf(stderr, "Could not write trace '%s'\n", path);
+    }
+    if (f) {
+        fprintf(f, "{\"traceEvents\": [\n");
+        for (int i = 0; i < event_count; i++) {
+            const TraceEvent *e = &events[i];
+            fprintf(f, "%s{\"name\": \"%s\", \"cat\": \"split\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+                    "\"ts\": %lld, \"dur\": %lld, \"args\": {\"part\": %d}}",
+                    i ? ",\n" : "", e->name, e->tid, (long long)(e->start - session_start),
+                    (long long)e->duration, e->part);
+        }
+        fprintf(f, "\n], \"displayTimeUnit\": \"ms\", ");
+        write_summary_json(f, spans, span_count, streams);
+        fprintf(f, "}\n");
+        if (fclose(f) != 0) {
+            ret = AVERROR(EIO);
+        }
+    }
+
+    free(events);
+    events = NULL;
+    event_count = 0;
+    event_capacity = 0;
+    pthread_mutex_unlock(&events_lock);
+    return ret;
+}
+
+#else
+
+typedef int trace_disabled;  // keeps the translation unit non-empty
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+// Instrumentation of the splitting hot path. Built only with -Dtracing=true
+// (VS_ENABLE_TRACE); otherwise every TRACE_* macro expands to nothing, so the
+// calls cost nothing at all in normal builds.
+//
+// Spans (open, probe, seek, write_header, trailer, whole parts) are kept as
+// Chrome trace_event "complete" events. Per-packet reads and writes are too
+// many for that and are only summed up per stream.
+
+typedef enum {
+    TRACE_STAT_READ,   // av_read_frame()
+    TRACE_STAT_WRITE,  // av_interleaved_write_frame(), includes the muxer's interleaving
+    TRACE_STAT_SEEK,   // seeks to a part start
+    TRACE_STAT_WAIT,   // the muxing thread waiting on the demux thread
+    TRACE_STAT_COUNT,
+} TraceStat;
+
+#ifdef VS_ENABLE_TRACE
+
+typedef struct {
+    int64_t start;
+    int stream;
+    int64_t bytes;
+} TracePacketStart;
+
+int64_t trace_clock(void);
+
+// Starts recording, dropping whatever a previous session left
+void trace_session_begin(void);
+int trace_session_active(void);
+// Writes the Chrome trace (load it in chrome://tracing or Perfetto) with the
+// summary under "otherData", prints the summary to stderr and stops recording
+int trace_session_end(const char*);
+
+// A span that started at start_us and ends now; part is 1-based, 0 for none
+void trace_span(const char*, int, int64_t);
+// One packet (or seek) on a stream, taking start_us to now
+void trace_stat(TraceStat, int, int64_t, int64_t);
+
+#define TRACE_BEGIN(var) int64_t var = trace_clock()
+#define TRACE_RESTART(var) (var = trace_clock())
+#define TRACE_SPAN(name, part, var) trace_span(name, part, var)
+#define TRACE_STAT(stat, stream, bytes, var) trace_stat(stat, stream, bytes, var)
+// For calls that take the packet's reference, such as av_interleaved_write_frame()
+#define TRACE_PACKET_BEGIN(var, packet) \
+    TracePacketStart var = { trace_clock(), (packet)->stream_index, (packet)->size }
+#define TRACE_PACKET_END(stat, var) trace_stat(stat, var.stream, var.bytes, var.start)
+#define TRACE_SESSION_BEGIN() trace_session_begin()
+#define TRACE_SESSION_ACTIVE() trace_session_active()
+#define TRACE_SESSION_END(path) trace_session_end(path)
+
+#else
+
+#define TRACE_BEGIN(var)
+#define TRACE_RESTART(var) ((void)0)
+#define TRACE_SPAN(name, part, var) ((void)(part))  // keeps a parameter only spans use from warning
+#define TRACE_STAT(stat, stream, bytes, var) ((void)0)
+#define TRACE_PACKET_BEGIN(var, packet)
+#define TRACE_PACKET_END(stat, var) ((void)0)
+#define TRACE_SESSION_BEGIN() ((void)0)
+#define TRACE_SESSION_ACTIVE() 0
+#define TRACE_SESSION_END(path) ((void)0)
+
+#endif
+
+#endif
@@ -0,0 +1,440 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include "ts_copy.h"
+#include <libavutil/avutil.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#define TS_PACKET_SIZE 188
+#define TS_SYNC_BYTE 0x47
+#define TS_SYNC_CHECKS 5           // packets in a row that must start with the sync byte
+#define TS_NULL_PID 0x1fff
+#define PSI_WINDOW (4 << 20)       // bytes before a cut searched for the PAT and PMT in effect
+#define MAX_PSI_PACKETS 16         // a PMT rarely needs more than one packet
+#define COPY_CHUNK (64 << 20)      // bytes per copy_file_range() call between progress calls, a multiple of the block size
+#define FALLBACK_BUFFER (4 << 20)  // bytes per read()/write() where the kernel can't copy
+#define DEFAULT_BLOCK_SIZE 4096
+
+// Whole transport packets of a PAT and the PMT of its first program
+typedef struct {
+    uint8_t packets[MAX_PSI_PACKETS][192];
+    int count;
+} TsPsi;
+
+struct TsCopySource {
+    int fd;
+    int64_t size;
+    int packet_size;  // 188, or 192 for M2TS with a 4-byte timecode before each packet
+    int64_t origin;   // offset of the first whole packet
+    TsPsi head;       // found at the start of the file, used when none is near a cut
+};
+
+#ifndef _WIN32
+
+// Offset of the TS header within a packet, past the M2TS timecode
+static int header_offset(const TsCopySource *source) {
+    return source->packet_size - TS_PACKET_SIZE;
+}
+
+static int detect_packets(TsCopySource *source, const uint8_t *buf, int size) {
+    static const int sizes[] = { TS_PACKET_SIZE, 192 };
+    for (int s = 0; s < 2; s++) {
+        int packet_size = sizes[s];
+        int extra = packet_size - TS_PACKET_SIZE;
+        for (int sync = extra; sync < extra + packet_size; sync++) {
+            int k = 0;
+            while (k < TS_SYNC_CHECKS && sync + k * packet_size < size && buf[sync + k * packet_size] == TS_SYNC_BYTE) {
+                k++;
+            }
+            if (k == TS_SYNC_CHECKS) {
+                source->packet_size = packet_size;
+                source->origin = sync - extra;
+                return 0;
+            }
+        }
+    }
+    return AVERROR_INVALIDDATA;
+}
+
+// Payload of a TS packet, NULL when it has none
+static const uint8_t *packet_payload(const uint8_t *ts, int *size) {
+    int control = (ts[3] >> 4) & 3;
+    int offset = 4;
+    if (control & 2) {
+        offset += 1 + ts[4];
+    }
+    if (!(control & 1) || offset >= TS_PACKET_SIZE) {
+        return NULL;
+    }
+    *size = TS_PACKET_SIZE - offset;
+    return ts + offset;
+}
+
+static int packet_pid(const uint8_t *ts) {
+    return ((ts[1] & 0x1f) << 8) | ts[2];
+}
+
+// PID of the first program's PMT in a PAT packet, -1 if it has none
+static int pat_pmt_pid(const uint8_t *ts) {
+    int size;
+    const uint8_t *payload = packet_payload(ts, &size);
+    if (!payload || !(ts[1] & 0x40) || payload[0] + 1 + 8 > size) {
+        return -1;
+    }
+    const uint8_t *section = payload + 1 + payload[0];
+    int section_size = size - 1 - payload[0];
+    int length = ((section[1] & 0x0f) << 8) | section[2];
+    if (section[0] != 0 || 3 + length > section_size) {
+        return -1;
+    }
+    for (int i = 8; i + 4 <= 3 + length - 4; i += 4) {
+        int program = (section[i] << 8) | section[i + 1];
+        if (program != 0) {
+            return ((section[i + 2] & 0x1f) << 8) | section[i + 3];
+        }
+    }
+    return -1;
+}
+
+// Finds the last PAT in a run of packets and the complete PMT after it
+static int find_psi(const TsCopySource *source, const uint8_t *buf, int64_t size, TsPsi *psi) {
+    int header = header_offset(source);
+    TsPsi current = {0};
+    int pmt_pid = -1;
+    int pmt_packets = 0;
+    int pmt_needed = 0, pmt_have = 0;
+    int found = 0;
+
+    for (int64_t p = 0; p + source->packet_size <= size; p += source->packet_size) {
+        const uint8_t *ts = buf + p + header;
+        if (ts[0] != TS_SYNC_BYTE) {
+            continue;
+        }
+        int pid = packet_pid(ts);
+        int start = (ts[1] & 0x40) != 0;
+        int payload_size;
+        const uint8_t *payload = packet_payload(ts, &payload_size);
+
+        if (pid == 0 && start) {
+            int pmt = pat_pmt_pid(ts);
+            if (pmt >= 0) {
+                memcpy(current.packets[0], buf + p, source->packet_size);
+                pmt_pid = pmt;
+                pmt_packets = 0;
+            }
+        } else if (pid == pmt_pid && payload) {
+            if (start) {
+                if (payload[0] + 4 > payload_size) {
+                    continue;
+                }
+                const uint8_t *section = payload + 1 + payload[0];
+                pmt_needed = (((section[1] & 0x0f) << 8) | section[2]) + 3;
+                pmt_have = payload_size - 1 - payload[0];
+                pmt_packets = 0;
+            } else if (pmt_packets == 0) {
+                continue;  // the rest of a PMT whose start wasn't seen
+            } else {
+                pmt_have += payload_size;
+            }
+            if (pmt_packets + 1 >= MAX_PSI_PACKETS) {
+                pmt_packets = 0;
+                continue;
+            }
+            memcpy(current.packets[1 + pmt_packets++], buf + p, source->packet_size);
+            if (pmt_have >= pmt_needed) {
+                current.count = 1 + pmt_packets;
+                *psi = current;
+                found = 1;
+                pmt_packets = 0;
+            }
+        }
+    }
+    return found;
+}
+
+static int read_at(int fd, uint8_t *buf, int64_t size, int64_t offset) {
+    int64_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(fd, buf + done, size - done, offset + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return AVERROR(errno);
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    return (int)done;
+}
+
+static int write_all(int fd, const uint8_t *buf, int64_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, buf, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return AVERROR(errno);
+        }
+        buf += n;
+        size -= n;
+    }
+    return 0;
+}
+
+int ts_copy_open(const char *filename, TsCopySource **source_out) {
+    TsCopySource *source = calloc(1, sizeof(TsCopySource));
+    uint8_t *buf = malloc(PSI_WINDOW);
+    if (!source || !buf) {
+        free(source);
+        free(buf);
+        return AVERROR(ENOMEM);
+    }
+    source->fd = open(filename, O_RDONLY);
+    if (source->fd < 0) {
+        int ret = AVERROR(errno);
+        free(source);
+        free(buf);
+        return ret;
+    }
+
+    struct stat st;
+    int ret = fstat(source->fd, &st) == 0 ? 0 : AVERROR(errno);
+    source->size = ret < 0 ? 0 : st.st_size;
+    int n = ret < 0 ? ret : read_at(source->fd, buf, PSI_WINDOW, 0);
+    if (n < 0) {
+        ret = n;
+    } else if (detect_packets(source, buf, n) < 0 ||
+               !find_psi(source, buf + source->origin, n - source->origin, &source->head)) {
+        ret = AVERROR_INVALIDDATA;
+    }
+    free(buf);
+    if (ret < 0) {
+        ts_copy_close(&source);
+        return ret;
+    }
+
+    *source_out = source;
+    return 0;
+}
+
+void ts_copy_close(TsCopySource **source) {
+    if (!*source) {
+        return;
+    }
+    if ((*source)->fd >= 0) {
+        close((*source)->fd);
+    }
+    free(*source);
+    *source = NULL;
+}
+
+int64_t ts_copy_packet_start(const TsCopySource *source, int64_t pos) {
+    if (pos < source->origin) {
+        return -1;
+    }
+    // The demuxer reports either the packet or its TS header
+    for (int64_t candidate = pos; candidate >= pos - header_offset(source); candidate -= 4) {
+        if ((candidate - source->origin) % source->packet_size == 0) {
+            return candidate;
+        }
+        if (!header_offset(source)) {
+            break;
+        }
+    }
+    return -1;
+}
+
+// The PAT and PMT in effect at a cut: the last ones shortly before it, or
+// else those from the start of the file
+static void psi_before(const TsCopySource *source, int64_t cut, uint8_t *buf, TsPsi *psi) {
+    int64_t from = cut - PSI_WINDOW;
+    if (from < source->origin) {
+        from = source->origin;
+    }
+    from = source->origin + (from - source->origin) / source->packet_size * source->packet_size;
+    int n = read_at(source->fd, buf, cut - from, from);
+    if (n <= 0 || !find_psi(source, buf, n, psi)) {
+        *psi = source->head;
+    }
+}
+
+// Null packets after the PSI so the range starts at the same offset within a
+// filesystem block in the part as in the input, which reflinks require
+static int head_packets(const TsCopySource *source, int64_t start, int psi_count, int64_t block) {
+    for (int64_t k = psi_count; k < psi_count + block; k++) {
+        if ((k * source->packet_size) % block == start % block) {
+            return (int)k;
+        }
+    }
+    return psi_count;
+}
+
+// Kernel copy where the filesystems allow it, read()/write() otherwise. The
+// bytes up to the input's next block boundary go on their own, so the rest
+// is copied from block-aligned offsets on both sides, which the kernel needs
+// to share the blocks rather than copy them.
+static int copy_bytes(TsCopySource *source, int out, int64_t in_offset, int64_t out_offset, int64_t length,
+                      int64_t block, TsCopyCallback callback, void *opaque) {
+    uint8_t *buffer = NULL;
+    int64_t copied = 0;
+    int ret = 0;
+
+    while (copied < length) {
+        int64_t misaligned = (in_offset + copied) % block;
+        int64_t chunk = misaligned ? block - misaligned : COPY_CHUNK;
+        if (chunk > length - copied) {
+            chunk = length - copied;
+        }
+        ssize_t n = -1;
+#ifdef __linux__
+        if (!buffer) {
+            loff_t in_pos = in_offset + copied, out_pos = out_offset + copied;
+            n = copy_file_range(source->fd, &in_pos, out, &out_pos, (size_t)chunk, 0);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP) {
+                ret = AVERROR(errno);
+                break;
+            }
+        }
+#endif
+        if (n < 0) {
+            if (!buffer && !(buffer = malloc(FALLBACK_BUFFER))) {
+                ret = AVERROR(ENOMEM);
+                break;
+            }
+            if (chunk > FALLBACK_BUFFER) {
+                chunk = FALLBACK_BUFFER;
+            }
+            n = read_at(source->fd, buffer, chunk, in_offset + copied);
+            if (n > 0 && lseek(out, out_offset + copied, SEEK_SET) < 0) {
+                n = AVERROR(errno);
+            }
+            if (n > 0) {
+                int write_ret = write_all(out, buffer, n);
+                if (write_ret < 0) {
+                    n = write_ret;
+                }
+            }
+            if (n < 0) {
+                ret = (int)n;
+                break;
+            }
+        }
+        if (n == 0) {
+            ret = AVERROR(EIO);  // the input got shorter
+            break;
+        }
+        copied += n;
+        if (callback && callback(copied, opaque)) {
+            ret = AVERROR_EXIT;
+            break;
+        }
+    }
+    free(buffer);
+    return ret;
+}
+
+int ts_copy_range(TsCopySource *source, int64_t start, int64_t end, const char *output,
+                  TsCopyCallback callback, void *opaque) {
+    if (end < 0 || end > source->size) {
+        end = source->size;
+    }
+    if (start < 0 || start > end) {
+        return AVERROR(EINVAL);
+    }
+
+    int out = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        return AVERROR(errno);
+    }
+    struct stat st;
+    int64_t block = fstat(out, &st) == 0 && st.st_blksize > 0 && st.st_blksize <= COPY_CHUNK &&
+                    (st.st_blksize & (st.st_blksize - 1)) == 0 ? st.st_blksize : DEFAULT_BLOCK_SIZE;
+
+    // The first part keeps the file's own start, later ones get a fresh
+    // PAT and PMT
+    int64_t head_size = 0;
+    int ret = 0;
+    if (start > source->origin) {
+        uint8_t *buf = malloc(PSI_WINDOW);
+        if (!buf) {
+            close(out);
+            return AVERROR(ENOMEM);
+        }
+        TsPsi psi;
+        psi_before(source, start, buf, &psi);
+
+        // Continuity counters restart in the part, the demuxer sees no gap
+        int header = header_offset(source);
+        int counters[2] = { 0, 0 };
+        for (int i = 0; i < psi.count; i++) {
+            uint8_t *ts = psi.packets[i] + header;
+            int *counter = &counters[i > 0];
+            ts[3] = (ts[3] & 0xf0) | (*counter & 0x0f);
+            (*counter)++;
+        }
+
+        int count = head_packets(source, start, psi.count, block);
+        head_size = (int64_t)count * source->packet_size;
+        memset(buf, 0, head_size);
+        for (int i = 0; i < count; i++) {
+            uint8_t *packet = buf + (int64_t)i * source->packet_size;
+            if (i < psi.count) {
+                memcpy(packet, psi.packets[i], source->packet_size);
+                continue;
+            }
+            uint8_t *ts = packet + header;
+            ts[0] = TS_SYNC_BYTE;
+            ts[1] = TS_NULL_PID >> 8;
+            ts[2] = TS_NULL_PID & 0xff;
+            ts[3] = 0x10;
+            memset(ts + 4, 0xff, TS_PACKET_SIZE - 4);
+        }
+        ret = write_all(out, buf, head_size);
+        free(buf);
+    }
+
+    if (ret >= 0) {
+        ret = copy_bytes(source, out, start, head_size, end - start, block, callback, opaque);
+    }
+    if (close(out) != 0 && ret >= 0) {
+        ret = AVERROR(errno);
+    }
+    return ret;
+}
+
+#else
+
+int ts_copy_open(const char *filename, TsCopySource **source_out) {
+    (void)filename;
+    (void)source_out;
+    return AVERROR(ENOSYS);
+}
+
+void ts_copy_close(TsCopySource **source) {
+    *source = NULL;
+}
+
+int64_t ts_copy_packet_start(const TsCopySource *source, int64_t pos) {
+    return -1;
+}
+
+int ts_copy_range(TsCopySource *source, int64_t start, int64_t end, const char *output,
+                  TsCopyCallback callback, void *opaque) {
+    return AVERROR(ENOSYS);
+}
+
+#endif
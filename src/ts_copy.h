@@ -0,0 +1,32 @@
+#ifndef TS_COPY_H
+#define TS_COPY_H
+
+#include <stdint.h>
+
+// Parts of an MPEG-TS input copied as raw byte ranges instead of being
+// remuxed packet by packet. A part is the run of transport packets from the
+// keyframe it starts on to the one the next part starts on, moved with
+// copy_file_range() so the kernel does the copy, or shares the blocks
+// outright on filesystems with reflinks (btrfs, XFS). Only the PAT and PMT in
+// effect at the cut are written in front of it, followed by null packets that
+// put the copied range at the same offset within a filesystem block as in the
+// input, which reflinks need. Timestamps stay as they are in the input.
+typedef struct TsCopySource TsCopySource;
+
+// Called after every chunk with the bytes copied so far, a non-zero return
+// stops the copy with AVERROR_EXIT
+typedef int (*TsCopyCallback)(int64_t, void*);
+
+// Opens an input, failing with AVERROR_INVALIDDATA unless it is a transport
+// stream (188-byte packets, or 192 with a timecode each) with a PAT and PMT
+int ts_copy_open(const char*, TsCopySource**);
+void ts_copy_close(TsCopySource**);
+
+// Start of the transport packet at a byte position reported by the demuxer,
+// -1 when the position isn't on a packet
+int64_t ts_copy_packet_start(const TsCopySource*, int64_t);
+
+// Writes bytes start to end (-1 for the end of the input) into a new file
+int ts_copy_range(TsCopySource*, int64_t, int64_t, const char*, TsCopyCallback, void*);
+
+#endif
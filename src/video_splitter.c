@@ -1,114 +1,684 @@
+#define _GNU_SOURCE
 #include "video_splitter.h"
+#include "storage.h"
+#include "keyframe_index.h"
+#include "packet_ring.h"
+#include "avio_file.h"
+#include "probe.h"
+#include "silence.h"
+#include "smart_render.h"
+#include "journal.h"
+#include "checksum.h"
+#include "ts_copy.h"
+#include "mux_queue.h"
+#include "trace.h"
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
 #include <libavutil/avutil.h>
+#include <libavutil/time.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <errno.h>
 
 #define MIN_LAST_CHUNK (45.0 * 60.0)   // 45 minutes in seconds
+#define KEYFRAME_TOLERANCE 0.001       // boundaries this close to a keyframe sit on it
+#define PROGRESS_PACKET_INTERVAL 256   // packets between two updates of the shared counters
+#define PROGRESS_REPORT_INTERVAL 250000  // microseconds between two progress callbacks
+#define DEFAULT_PIPELINE_DEPTH 128     // packets buffered between the demux and mux threads
+#define DEFAULT_IO_BUFFER_SIZE (4 << 20)  // 4 MiB per read/write syscall
+#define PREALLOCATE_MARGIN 1.02        // headroom over a part's estimated size
+#define SIZE_BUDGET_MARGIN 1.01        // headroom for muxer overhead beyond the input's own
+#define DEFAULT_MUX_SPARSE_DELAY 2.0   // seconds the muxing queue waits for a silent stream
 
-int cut_video_segment(const char* input_filename, const char* output_filename, 
-                     double start_time, double duration) {
-    
-    AVFormatContext *input_ctx = NULL, *output_ctx = NULL;
-    int64_t start_pts = AV_NOPTS_VALUE;
-    
-    int ret = avformat_open_input(&input_ctx, input_filename, NULL, NULL);
+struct SplitCancelToken {
+    atomic_int cancelled;
+};
+
+struct SplitJob {
+    const char *input_filename;
+    const SplitOptions *options;
+    SplitPlan *plan;
+    const KeyframeIndex *index;  // NULL unless the plan was snapped to keyframes
+    const MediaProbe *probe;     // NULL when the input wasn't probed beforehand
+    SplitJournal *journal;       // NULL unless the job is journaled
+    ChecksumManifest *manifest;  // NULL unless copied packets are checksummed
+    TsCopySource *ts_source;     // NULL unless parts are copied as byte ranges
+    MuxSparsePolicy mux_sparse;  // the option's, unless checksums need every packet kept
+
+    // Progress shared by every worker, guarded by progress_lock
+    pthread_mutex_t progress_lock;
+    int finished_parts;
+    int64_t bytes_read;
+    int64_t bytes_written;
+    int64_t packets;
+    double *part_position;  // seconds of each part copied so far
+    double skipped_duration;  // of the parts left out, counted as done but not as work
+    int64_t started_at;
+    int64_t last_report;
+    int mux_queue_packets;  // in the queue of the part reported last
+    int64_t mux_queue_bytes;
+    int64_t mux_queue_peak_bytes;
+};
+
+// Counts a worker keeps for its part before folding them into the job
+typedef struct {
+    int64_t bytes_read;
+    int64_t bytes_written;
+    int64_t packets;
+    double position;  // seconds into the part of the last packet copied
+    MuxQueueStats mux;  // of the part's muxing queue when there is one
+} PartCounter;
+
+typedef struct {
+    SplitJob *job;
+    pthread_mutex_t lock;
+    int next_part;
+} ParallelSplit;
+
+void split_options_init(SplitOptions *options) {
+    memset(options, 0, sizeof(*options));
+    options->mode = SPLIT_MODE_SINGLE_PASS;
+    options->pipeline_depth = DEFAULT_PIPELINE_DEPTH;
+    options->io_buffer_size = DEFAULT_IO_BUFFER_SIZE;
+    options->io_preallocate = 1;
+    options->mux_sparse_delay = DEFAULT_MUX_SPARSE_DELAY;
+}
+
+static int cancel_interrupt(void *opaque) {
+    return split_cancel_token_is_cancelled(opaque);
+}
+
+static AvioFileOptions io_options(const SplitOptions *options) {
+    AvioFileOptions io = { .buffer_size = options->io_buffer_size, .use_mmap = options->io_mmap };
+    if (options->follow > 0) {
+        // Only our own I/O waits for a growing input
+        if (io.buffer_size <= 0) {
+            io.buffer_size = DEFAULT_IO_BUFFER_SIZE;
+        }
+        io.follow_idle = options->follow;
+        io.interrupt.callback = options->cancel ? cancel_interrupt : NULL;
+        io.interrupt.opaque = options->cancel;
+    }
+    return io;
+}
+
+SplitCancelToken *split_cancel_token_new(void) {
+    SplitCancelToken *token = malloc(sizeof(SplitCancelToken));
+    if (token) {
+        atomic_init(&token->cancelled, 0);
+    }
+    return token;
+}
+
+void split_cancel_token_cancel(SplitCancelToken *token) {
+    atomic_store(&token->cancelled, 1);
+}
+
+int split_cancel_token_is_cancelled(const SplitCancelToken *token) {
+    return token && atomic_load((atomic_int *)&token->cancelled);
+}
+
+void split_cancel_token_free(SplitCancelToken **token) {
+    free(*token);
+    *token = NULL;
+}
+
+static int job_cancelled(const SplitJob *job) {
+    return split_cancel_token_is_cancelled(job->options->cancel);
+}
+
+static int close_output_part(AVFormatContext **output_ctx, int write_trailer);
+
+// Must be called with progress_lock held
+static void call_progress(SplitJob *job, const SplitPart *part, SplitProgressEvent event) {
+    int64_t now = av_gettime_relative();
+    double elapsed = (now - job->started_at) / (double)AV_TIME_BASE;
+    // Skipped parts took no time, they count neither as work done nor to do
+    double done = -job->skipped_duration;
+    double work = job->plan->total_duration - job->skipped_duration;
+    for (int i = 0; i < job->plan->total_parts; i++) {
+        done += job->part_position[i];
+    }
+
+    SplitProgress progress = {
+        .event = event,
+        .input = job->input_filename,
+        .part = part->number,
+        .total_parts = job->plan->total_parts,
+        .finished_parts = job->finished_parts,
+        .result = event == SPLIT_PROGRESS_PART_FINISHED ? part->result : 0,
+        .bytes_read = job->bytes_read,
+        .bytes_written = job->bytes_written,
+        .packets_per_second = elapsed > 0 ? job->packets / elapsed : 0,
+        .current_time = part->start_time + job->part_position[part->number - 1],
+        .fraction = work > 0 ? done / work : 0,
+        .eta = -1,
+        .mux_queue_packets = job->mux_queue_packets,
+        .mux_queue_bytes = job->mux_queue_bytes,
+        .mux_queue_peak_bytes = job->mux_queue_peak_bytes,
+    };
+    if (progress.fraction > 1) {
+        progress.fraction = 1;
+    }
+    if (progress.fraction > 0) {
+        progress.eta = elapsed * (1 - progress.fraction) / progress.fraction;
+    }
+
+    job->last_report = now;
+    job->options->progress(&progress, job->options->progress_opaque);
+}
+
+// Folds a worker's counters into the job and calls the progress callback if
+// the last call is old enough. Workers only take the lock every
+// PROGRESS_PACKET_INTERVAL packets.
+static void flush_part_counter(SplitJob *job, const SplitPart *part, PartCounter *counter) {
+    if (!job->part_position) {
+        return;
+    }
+
+    pthread_mutex_lock(&job->progress_lock);
+    job->bytes_read += counter->bytes_read;
+    job->bytes_written += counter->bytes_written;
+    job->packets += counter->packets;
+    job->mux_queue_packets = counter->mux.packets;
+    job->mux_queue_bytes = counter->mux.bytes;
+    if (counter->mux.peak_bytes > job->mux_queue_peak_bytes) {
+        job->mux_queue_peak_bytes = counter->mux.peak_bytes;
+    }
+    if (counter->position > job->part_position[part->number - 1]) {
+        job->part_position[part->number - 1] = counter->position < part->duration ? counter->position : part->duration;
+    }
+    if (job->options->progress && av_gettime_relative() - job->last_report >= PROGRESS_REPORT_INTERVAL) {
+        call_progress(job, part, SPLIT_PROGRESS_PACKETS);
+    }
+    pthread_mutex_unlock(&job->progress_lock);
+
+    counter->bytes_read = counter->bytes_written = counter->packets = 0;
+}
+
+static void count_packet(SplitJob *job, const SplitPart *part, PartCounter *counter,
+                         int64_t size_read, int64_t size_written, double position) {
+    counter->bytes_read += size_read;
+    counter->bytes_written += size_written;
+    counter->packets++;
+    if (position > counter->position) {
+        counter->position = position;
+    }
+    if (counter->packets >= PROGRESS_PACKET_INTERVAL) {
+        flush_part_counter(job, part, counter);
+    }
+}
+
+// Tells the caller a part started (finished == 0) or ended with part->result
+static void report_part(SplitJob *job, const SplitPart *part, int finished) {
+    if (!job->options->progress || !job->part_position) {
+        return;
+    }
+
+    pthread_mutex_lock(&job->progress_lock);
+    if (finished) {
+        job->finished_parts++;
+        if (part->result >= 0) {
+            job->part_position[part->number - 1] = part->duration;
+        }
+    }
+    call_progress(job, part, finished ? SPLIT_PROGRESS_PART_FINISHED : SPLIT_PROGRESS_PART_STARTED);
+    pthread_mutex_unlock(&job->progress_lock);
+}
+
+// Parts are written under this name and only renamed to their own once
+// complete, so a file with the final name is never a truncated part
+static void partial_output_filename(const SplitPart *part, char *filename, size_t size) {
+    snprintf(filename, size, "%s.partial", part->output_filename);
+}
+
+// Drops a part that was interrupted so no truncated file is left behind
+static void discard_output_part(AVFormatContext **output_ctx, const SplitPart *part) {
+    char partial_filename[sizeof(part->output_filename) + 16];
+    if (!*output_ctx) {
+        return;
+    }
+    close_output_part(output_ctx, 0);
+    partial_output_filename(part, partial_filename, sizeof(partial_filename));
+    remove(partial_filename);
+}
+
+// Gives a closed part its final name and records it in the journal and the
+// checksum manifest
+static int finish_output_part(SplitJob *job, const SplitPart *part, const PartChecksum *checksum) {
+    char partial_filename[sizeof(part->output_filename) + 16];
+    partial_output_filename(part, partial_filename, sizeof(partial_filename));
+#ifdef _WIN32
+    remove(part->output_filename);  // rename() doesn't replace files there
+#endif
+    if (rename(partial_filename, part->output_filename) != 0) {
+        int ret = AVERROR(errno);
+        fprintf(stderr, "Could not rename '%s' to '%s'\n", partial_filename, part->output_filename);
+        return ret;
+    }
+    if (job->manifest && checksum_manifest_add(job->manifest, part, checksum) < 0) {
+        fprintf(stderr, "Could not add part %d to the checksum manifest\n", part->number);
+    }
+    return job->journal ? split_journal_part_done(job->journal, part) : 0;
+}
+
+// Opens the input for reading packets. When the plan already probed it, the
+// stream info pass is skipped for containers whose header describes every
+// stream.
+static int open_input(SplitJob *job, int part_number, AVFormatContext **input_ctx) {
+    AvioFileOptions io = io_options(job->options);
+
+    TRACE_BEGIN(open_start);
+    int ret = avio_file_open_input(input_ctx, job->input_filename, &io, NULL);
+    TRACE_SPAN("open", part_number, open_start);
     if (ret < 0) {
-        fprintf(stderr, "Could not open input file '%s'\n", input_filename);
+        fprintf(stderr, "Could not open input file '%s'\n", job->input_filename);
         return ret;
     }
-    
-    ret = avformat_find_stream_info(input_ctx, NULL);
+
+    TRACE_BEGIN(probe_start);
+    ret = media_probe_find_stream_info(*input_ctx, job->probe);
+    TRACE_SPAN("probe", part_number, probe_start);
     if (ret < 0) {
         fprintf(stderr, "Failed to retrieve input stream information\n");
-        goto cleanup;
+        avio_file_close_input(input_ctx);
     }
-    
-    ret = avformat_alloc_output_context2(&output_ctx, NULL, NULL, output_filename);
+    return ret;
+}
+
+// Guesses the bytes a part will take from its share of the input duration,
+// 0 when the input size or duration is unknown.
+static int64_t estimate_part_size(AVFormatContext *input_ctx, const SplitPart *part) {
+    int64_t input_size = input_ctx->pb ? avio_size(input_ctx->pb) : -1;
+    if (input_size <= 0 || input_ctx->duration <= 0) {
+        return 0;
+    }
+    double share = part->duration * AV_TIME_BASE / input_ctx->duration;
+    if (share > 1.0) {
+        share = 1.0;
+    }
+    return (int64_t)(input_size * share * PREALLOCATE_MARGIN);
+}
+
+// Creates the output context for one part, mirrors every input stream and
+// writes the container header.
+static int open_output_part(SplitJob *job, AVFormatContext *input_ctx, const SplitPart *part,
+                            AVFormatContext **output_ctx_out) {
+    char output_filename[sizeof(part->output_filename) + 16];
+    AVFormatContext *output_ctx = NULL;
+
+    // The muxer is picked from the final name, the data goes to the partial file
+    partial_output_filename(part, output_filename, sizeof(output_filename));
+    const AVOutputFormat *format = av_guess_format(NULL, part->output_filename, NULL);
+    int ret = avformat_alloc_output_context2(&output_ctx, format, NULL, output_filename);
     if (!output_ctx) {
         fprintf(stderr, "Could not create output context\n");
-        ret = AVERROR_UNKNOWN;
-        goto cleanup;
+        return AVERROR_UNKNOWN;
     }
-    
+
     for (int i = 0; i < input_ctx->nb_streams; i++) {
         AVStream *input_stream = input_ctx->streams[i];
         AVStream *output_stream = avformat_new_stream(output_ctx, NULL);
         if (!output_stream) {
             fprintf(stderr, "Failed allocating output stream\n");
             ret = AVERROR_UNKNOWN;
-            goto cleanup;
+            goto fail;
         }
-        
+
         ret = avcodec_parameters_copy(output_stream->codecpar, input_stream->codecpar);
         if (ret < 0) {
             fprintf(stderr, "Failed to copy codec parameters\n");
-            goto cleanup;
+            goto fail;
         }
         output_stream->codecpar->codec_tag = 0; //tells ffmpeg to not force a specific tag
     }
-    
+
     if (!(output_ctx->oformat->flags & AVFMT_NOFILE)) {
-        ret = avio_open(&output_ctx->pb, output_filename, AVIO_FLAG_WRITE);
+        AvioFileOptions io = io_options(job->options);
+        int64_t preallocate = job->options->io_preallocate ? estimate_part_size(input_ctx, part) : 0;
+        TRACE_BEGIN(open_start);
+        ret = avio_file_open(&output_ctx->pb, output_filename, AVIO_FLAG_WRITE, &io, preallocate);
+        TRACE_SPAN("open_output", part->number, open_start);
         if (ret < 0) {
             fprintf(stderr, "Could not open output file '%s'\n", output_filename);
-            goto cleanup;
+            goto fail;
         }
     }
-    
+
+    TRACE_BEGIN(header_start);
     ret = avformat_write_header(output_ctx, NULL);
+    TRACE_SPAN("write_header", part->number, header_start);
     if (ret < 0) {
         fprintf(stderr, "Error occurred when writing header\n");
+        goto fail;
+    }
+
+    *output_ctx_out = output_ctx;
+    return 0;
+
+fail:
+    if (!(output_ctx->oformat->flags & AVFMT_NOFILE)) {
+        avio_file_close(&output_ctx->pb);
+    }
+    avformat_free_context(output_ctx);
+    return ret;
+}
+
+// Finishes a part opened with open_output_part(). The trailer is only written
+// when the header made it to disk.
+static int close_output_part(AVFormatContext **output_ctx, int write_trailer) {
+    int ret = 0;
+
+    if (!*output_ctx) {
+        return 0;
+    }
+    if (write_trailer) {
+        ret = av_write_trailer(*output_ctx);
+    }
+    if (!((*output_ctx)->oformat->flags & AVFMT_NOFILE)) {
+        int close_ret = avio_file_close(&(*output_ctx)->pb);
+        if (ret >= 0 && close_ret < 0) {
+            ret = close_ret;
+        }
+    }
+    avformat_free_context(*output_ctx);
+    *output_ctx = NULL;
+    return ret;
+}
+
+// A queue of at most SplitOptions.mux_queue_bytes interleaving the packets of
+// a part, NULL when the muxer's own interleaving is used
+static int open_mux_queue(const SplitJob *job, AVFormatContext *output_ctx, MuxQueue **mux) {
+    if (job->options->mux_queue_bytes <= 0) {
+        return 0;
+    }
+    MuxQueueOptions options = {
+        .max_bytes = job->options->mux_queue_bytes,
+        .max_delay_us = (int64_t)(job->options->mux_sparse_delay * AV_TIME_BASE),
+        .sparse = job->mux_sparse,
+    };
+    int ret = mux_queue_new(output_ctx, &options, mux);
+    if (ret < 0) {
+        fprintf(stderr, "Could not create the muxing queue\n");
+    }
+    return ret;
+}
+
+static int write_part_packet(AVFormatContext *output_ctx, MuxQueue *mux, PartCounter *counter, AVPacket *packet) {
+    if (!mux) {
+        return av_interleaved_write_frame(output_ctx, packet);
+    }
+    int ret = mux_queue_write(mux, packet);
+    mux_queue_stats(mux, &counter->mux);
+    return ret;
+}
+
+// Writes what is left in a part's queue before its trailer and tells how
+// full the queue got. Nothing is written for a part that failed.
+static int close_mux_queue(MuxQueue **mux, const SplitPart *part, PartCounter *counter, int flush) {
+    int ret = 0;
+    if (!*mux) {
+        return 0;
+    }
+    if (flush) {
+        ret = mux_queue_flush(*mux);
+        mux_queue_stats(*mux, &counter->mux);
+        printf("Part %d muxing queue: peak of %d packets, %.1f MiB (%lld written early, %lld late)\n",
+               part->number, counter->mux.peak_packets, counter->mux.peak_bytes / (1024.0 * 1024.0),
+               (long long)counter->mux.forced, (long long)counter->mux.late);
+    }
+    mux_queue_free(mux);
+    return ret;
+}
+
+// Works out where a part starts and ends in absolute AV_TIME_BASE units. Bounds
+// that were snapped to a keyframe are taken from the index itself so the
+// keyframe is neither dropped from its part nor copied into the previous one.
+static void part_bounds_us(const KeyframeIndex *index, const AVFormatContext *input_ctx,
+                           const SplitPart *part, int64_t *start_us, int64_t *end_us) {
+    int64_t input_start_us = input_ctx->start_time != AV_NOPTS_VALUE ? input_ctx->start_time : 0;
+    double end_time = part->start_time + part->duration;
+
+    *start_us = (int64_t)(part->start_time * AV_TIME_BASE) + input_start_us;
+    *end_us = (int64_t)(end_time * AV_TIME_BASE) + input_start_us;
+    if (!index || index->count == 0) {
+        return;
+    }
+
+    int k = keyframe_index_nearest(index, part->start_time);
+    if (fabs(keyframe_index_time(index, k) - part->start_time) < KEYFRAME_TOLERANCE) {
+        *start_us = av_rescale_q(index->entries[k].pts, index->time_base, AV_TIME_BASE_Q);
+    }
+    k = keyframe_index_nearest(index, end_time);
+    if (fabs(keyframe_index_time(index, k) - end_time) < KEYFRAME_TOLERANCE) {
+        *end_us = av_rescale_q(index->entries[k].pts, index->time_base, AV_TIME_BASE_Q);
+    }
+}
+
+// With a keyframe index the part starts on a known keyframe. Demuxers that
+// resync by themselves (MPEG-TS/PS) are sent straight to its byte offset, the
+// others are asked for that exact keyframe on the indexed stream. Without an
+// index, or if both fail, fall back to a plain timestamp seek.
+static int seek_to_part_start(AVFormatContext *input_ctx, const KeyframeIndex *index,
+                              int64_t start_us) {
+    if (index && index->count > 0) {
+        int k = keyframe_index_nearest(index, (double)(start_us - index->start_time) / AV_TIME_BASE);
+        const KeyframeEntry *keyframe = &index->entries[k];
+        if (llabs(av_rescale_q(keyframe->pts, index->time_base, AV_TIME_BASE_Q) - start_us) > 1) {
+            keyframe = NULL;
+        }
+
+        if (keyframe && keyframe->pos >= 0 && (input_ctx->iformat->flags & AVFMT_TS_DISCONT) &&
+            av_seek_frame(input_ctx, -1, keyframe->pos, AVSEEK_FLAG_BYTE) >= 0) {
+            return 0;
+        }
+        if (keyframe && avformat_seek_file(input_ctx, index->stream_index, keyframe->pts,
+                                           keyframe->pts, keyframe->pts, 0) >= 0) {
+            return 0;
+        }
+    }
+
+    return avformat_seek_file(input_ctx, -1, INT64_MIN, start_us, start_us, 0);
+}
+
+typedef struct {
+    SplitJob *job;
+    const SplitPart *part;
+    PartCounter counter;
+    int64_t copied;
+    int64_t length;  // bytes in the range, to turn them into a position in the part
+} ByteRangeCopy;
+
+static int byte_range_progress(int64_t copied, void *opaque) {
+    ByteRangeCopy *copy = opaque;
+    copy->counter.bytes_read += copied - copy->copied;
+    copy->counter.bytes_written += copied - copy->copied;
+    copy->counter.position = copy->length > 0 ? copy->part->duration * copied / copy->length : 0;
+    copy->copied = copied;
+    flush_part_counter(copy->job, copy->part, &copy->counter);
+    return job_cancelled(copy->job);
+}
+
+// Byte offset in the input of the keyframe a part starts on, -1 when the part
+// doesn't start on an indexed keyframe whose packet is known
+static int64_t part_start_offset(const SplitJob *job, const SplitPart *part) {
+    if (part->number == 1) {
+        return 0;
+    }
+    int k = keyframe_index_nearest(job->index, part->start_time);
+    if (k < 0 || fabs(keyframe_index_time(job->index, k) - part->start_time) >= KEYFRAME_TOLERANCE ||
+        job->index->entries[k].pos < 0) {
+        return -1;
+    }
+    return ts_copy_packet_start(job->ts_source, job->index->entries[k].pos);
+}
+
+// Copies a part of a transport stream as the bytes between its keyframe and
+// the next part's, see ts_copy.h. AVERROR(ENOTSUP) when the part can't be cut
+// that way and has to be remuxed instead.
+static int cut_part_bytes(SplitJob *job, const SplitPart *part) {
+    char partial_filename[sizeof(part->output_filename) + 16];
+    const AVOutputFormat *format = av_guess_format(NULL, part->output_filename, NULL);
+    if (!format || strcmp(format->name, "mpegts") != 0) {
+        return AVERROR(ENOTSUP);
+    }
+
+    int64_t start = part_start_offset(job, part);
+    int64_t end = -1;
+    if (part->number < job->plan->total_parts) {
+        end = part_start_offset(job, &job->plan->parts[part->number]);
+        if (end < 0) {
+            return AVERROR(ENOTSUP);
+        }
+    }
+    if (start < 0) {
+        return AVERROR(ENOTSUP);
+    }
+
+    ByteRangeCopy copy = { .job = job, .part = part, .length = (end < 0 ? job->index->file_size : end) - start };
+    partial_output_filename(part, partial_filename, sizeof(partial_filename));
+    TRACE_BEGIN(copy_start);
+    int ret = ts_copy_range(job->ts_source, start, end, partial_filename, byte_range_progress, &copy);
+    TRACE_SPAN("byte_copy", part->number, copy_start);
+    flush_part_counter(job, part, &copy.counter);
+
+    if (ret == AVERROR_EXIT) {
+        printf("Part %d cancelled, removing '%s'\n", part->number, part->output_filename);
+    } else if (ret < 0) {
+        fprintf(stderr, "Could not copy part %d as a byte range\n", part->number);
+    }
+    if (ret < 0) {
+        remove(partial_filename);
+        return ret;
+    }
+    return finish_output_part(job, part, NULL);
+}
+
+static int cut_part(SplitJob *job, const SplitPart *part) {
+    if (job->ts_source) {
+        int ret = cut_part_bytes(job, part);
+        if (ret != AVERROR(ENOTSUP)) {
+            return ret;
+        }
+    }
+
+    const char *output_filename = part->output_filename;
+    AVFormatContext *input_ctx = NULL, *output_ctx = NULL;
+    PacketReader *reader = NULL;
+    SmartRender *smart = NULL;
+    int smart_stream = -1;
+    MuxQueue *mux = NULL;
+    PartCounter counter = {0};
+    PartChecksum checksum = {0};
+    TRACE_BEGIN(part_start);
+    
+    int ret = open_input(job, part->number, &input_ctx);
+    if (ret < 0) {
+        return ret;
+    }
+    if (job->manifest && (ret = part_checksum_init(&checksum, input_ctx->nb_streams)) < 0) {
         goto cleanup;
     }
     
-    int64_t seek_target_time = (int64_t)(start_time * AV_TIME_BASE);
-    ret = avformat_seek_file(input_ctx, -1, INT64_MIN, seek_target_time, seek_target_time, 0);
+    ret = open_output_part(job, input_ctx, part, &output_ctx);
     if (ret < 0) {
-        fprintf(stderr, "Error seeking to start time\n");
         goto cleanup;
     }
     
-    int64_t end_time_us = (int64_t)((start_time + duration) * AV_TIME_BASE);
+    int64_t seek_target_time, end_time_us;
+    part_bounds_us(job->index, input_ctx, part, &seek_target_time, &end_time_us);
+    TRACE_BEGIN(seek_start);
+    ret = seek_to_part_start(input_ctx, job->index, seek_target_time);
+    TRACE_STAT(TRACE_STAT_SEEK, job->index ? job->index->stream_index : 0, 0, seek_start);
+    TRACE_SPAN("seek", part->number, seek_start);
+    if (ret < 0) {
+        fprintf(stderr, "Error seeking to start time\n");
+        goto cleanup;
+    }
     
-    AVPacket* packet = av_packet_alloc();
-    while (av_read_frame(input_ctx, packet) >= 0) {
+    if (job->options->smart_render) {
+        smart_stream = av_find_best_stream(input_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+        if (smart_stream >= 0 &&
+            smart_render_new(input_ctx, smart_stream, output_ctx, seek_target_time, &smart) < 0) {
+            smart_stream = -1;
+        }
+    }
+    // The re-encoded start goes through the muxer's own interleaving, which
+    // can't be mixed with the queue's
+    if (smart_stream < 0 && (ret = open_mux_queue(job, output_ctx, &mux)) < 0) {
+        goto cleanup;
+    }
+
+    ret = packet_reader_start(input_ctx, job->options->pipeline_depth, &reader);
+    if (ret < 0) {
+        goto cleanup;
+    }
+
+    AVPacket* packet;
+    while ((ret = packet_reader_next(reader, &packet)) >= 0) {
         AVStream *input_stream = input_ctx->streams[packet->stream_index];
         AVStream *output_stream = output_ctx->streams[packet->stream_index];
         
         int64_t packet_time_us = av_rescale_q(packet->pts, input_stream->time_base, 
                                               (AVRational){1, AV_TIME_BASE});
         
-        if (packet_time_us > end_time_us) {
+        if (job_cancelled(job)) {
             av_packet_unref(packet);
+            ret = AVERROR_EXIT;
             break;
         }
+
+        if (packet_time_us >= end_time_us) {
+            av_packet_unref(packet);
+            break;
+        }
+
+        if (smart && packet->stream_index == smart_stream) {
+            int size = packet->size;
+            ret = smart_render_packet(smart, packet);
+            if (ret < 0) {
+                av_packet_unref(packet);
+                break;
+            }
+            if (ret == 0) {
+                count_packet(job, part, &counter, size, 0, 0);
+                continue;
+            }
+            // The re-encoded start is written, copy from here on
+            smart_render_free(&smart);
+            ret = 0;
+        }
         
         if (packet_time_us < seek_target_time) {
+            count_packet(job, part, &counter, packet->size, 0, 0);
             av_packet_unref(packet);
             continue;
         }
-        
-        if (start_pts == AV_NOPTS_VALUE && packet->stream_index == 0) {
-            start_pts = packet->pts;
+        count_packet(job, part, &counter, packet->size, packet->size,
+                     (double)(packet_time_us - seek_target_time) / AV_TIME_BASE);
+        if (checksum.streams) {
+            part_checksum_add(&checksum, packet);
         }
         
-        packet->pts = av_rescale_q_rnd(packet->pts - start_pts, 
-                                      input_stream->time_base, 
-                                      output_stream->time_base, 
-                                      AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX);
-        packet->dts = av_rescale_q_rnd(packet->dts - start_pts, 
-                                      input_stream->time_base, 
-                                      output_stream->time_base, 
-                                      AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX);
-        packet->duration = av_rescale_q(packet->duration, 
-                                       input_stream->time_base, 
-                                       output_stream->time_base);
+        // Every stream is offset by the part's start in its own time base, so
+        // streams whose first packet comes late keep their place
+        int64_t offset = av_rescale_q(seek_target_time, AV_TIME_BASE_Q, input_stream->time_base);
+        if (packet->pts != AV_NOPTS_VALUE) {
+            packet->pts -= offset;
+        }
+        if (packet->dts != AV_NOPTS_VALUE) {
+            packet->dts -= offset;
+        }
+        av_packet_rescale_ts(packet, input_stream->time_base, output_stream->time_base);
         packet->pos = -1;
         
-        ret = av_interleaved_write_frame(output_ctx, packet);
+        TRACE_PACKET_BEGIN(write_start, packet);
+        ret = write_part_packet(output_ctx, mux, &counter, packet);
+        TRACE_PACKET_END(TRACE_STAT_WRITE, write_start);
         if (ret < 0) {
             fprintf(stderr, "Error writing packet\n");
             av_packet_unref(packet);
@@ -117,41 +687,353 @@ int cut_video_segment(const char* input_filename, const char* output_filename,
         
         av_packet_unref(packet);
     }
-    
-    av_write_trailer(output_ctx);
+    if (ret == AVERROR_EOF) {
+        ret = 0;
+    } else if (ret < 0 && ret != AVERROR_EXIT) {
+        // Read errors included: a truncated part must not get its final name
+        // nor be journaled as done
+        fprintf(stderr, "Part %d is incomplete, not finishing it\n", part->number);
+    }
+    packet_reader_stop(&reader);
+    int mux_ret = close_mux_queue(&mux, part, &counter, ret >= 0);
+    if (ret >= 0) {
+        ret = mux_ret;
+    }
+    flush_part_counter(job, part, &counter);
+
+    if (smart && ret >= 0) {
+        // The part ended before the first keyframe after its start
+        ret = smart_render_finish(smart);
+    }
+
+    if (ret == AVERROR_EXIT) {
+        printf("Part %d cancelled, removing '%s'\n", part->number, output_filename);
+        discard_output_part(&output_ctx, part);
+        goto cleanup;
+    }
+
+    TRACE_BEGIN(trailer_start);
+    int close_ret = close_output_part(&output_ctx, 1);
+    TRACE_SPAN("trailer", part->number, trailer_start);
+    if (ret >= 0) {
+        ret = close_ret < 0 ? close_ret : finish_output_part(job, part, &checksum);
+    }
     
 cleanup:
-    if (input_ctx) {
-        avformat_close_input(&input_ctx);
+    packet_reader_stop(&reader);
+    mux_queue_free(&mux);
+    smart_render_free(&smart);
+    part_checksum_free(&checksum);
+    avio_file_close_input(&input_ctx);
+    close_output_part(&output_ctx, 0);
+    TRACE_SPAN("part", part->number, part_start);
+
+    return ret;
+}
+
+int cut_video_segment(const char* input_filename, const char* output_filename,
+                     double start_time, double duration) {
+    SplitOptions options;
+    split_options_init(&options);
+    SplitJob job = { .input_filename = input_filename, .options = &options };
+    SplitPart part = { .number = 1, .start_time = start_time, .duration = duration };
+    snprintf(part.output_filename, sizeof(part.output_filename), "%s", output_filename);
+    return cut_part(&job, &part);
+}
+
+// Adds a part as long as the last one after it, for inputs that are followed
+// while they grow
+static int plan_append_part(SplitJob *job) {
+    SplitPlan *plan = job->plan;
+    SplitPart *parts = realloc(plan->parts, (plan->total_parts + 1) * sizeof(SplitPart));
+    if (!parts) {
+        return AVERROR(ENOMEM);
+    }
+    plan->parts = parts;
+
+    pthread_mutex_lock(&job->progress_lock);
+    double *position = realloc(job->part_position, (plan->total_parts + 1) * sizeof(double));
+    if (!position) {
+        pthread_mutex_unlock(&job->progress_lock);
+        return AVERROR(ENOMEM);
+    }
+    job->part_position = position;
+    position[plan->total_parts] = 0;
+
+    const SplitPart *last = &parts[plan->total_parts - 1];
+    SplitPart *part = &parts[plan->total_parts];
+    memset(part, 0, sizeof(*part));
+    part->number = plan->total_parts + 1;
+    part->start_time = last->start_time + last->duration;
+    part->duration = last->duration;
+    generate_output_filename(plan->output_name, part->number, part->output_filename,
+                             sizeof(part->output_filename));
+    plan->total_parts++;
+    pthread_mutex_unlock(&job->progress_lock);
+    return 0;
+}
+
+// Index of the first part from index on that still has to be written, -1 if none
+static int next_pending_part(const SplitPlan *plan, int index) {
+    for (; index < plan->total_parts; index++) {
+        if (!plan->parts[index].skip) {
+            return index;
+        }
+    }
+    return -1;
+}
+
+// Reads the input once from start to finish. Part N is closed and part N+1
+// opened as soon as the reference stream (the best video stream, or stream 0
+// for audio-only inputs) reaches the next boundary on a keyframe, so every part
+// after the first starts on a clean GOP and the source is never seeked.
+// Streamed inputs get a new part every time the last one is full. Parts that
+// a resumed job already has are read past without being written; leading ones
+// are seeked over, and reading stops once no part is left to write.
+static int split_single_pass(SplitJob *job) {
+    SplitPlan *plan = job->plan;
+    AVFormatContext *input_ctx = NULL, *output_ctx = NULL;
+    PacketReader *reader = NULL;
+    AVPacket *packet = NULL;
+    int streaming = plan->streaming;
+    int first_part = next_pending_part(plan, 0);
+    int current_part = 0;
+    double input_time = 0;  // furthest point of the input read so far, in seconds
+    int64_t part_offset_us = 0;
+    MuxQueue *mux = NULL;
+    PartCounter counter = {0};
+    PartChecksum checksum = {0};
+    TRACE_BEGIN(part_start);
+
+    if (first_part < 0) {
+        return 0;
+    }
+
+    int ret = open_input(job, first_part + 1, &input_ctx);
+    if (ret < 0) {
+        return ret;
+    }
+    if (job->manifest && (ret = part_checksum_init(&checksum, input_ctx->nb_streams)) < 0) {
+        goto cleanup;
+    }
+
+    int reference_stream = av_find_best_stream(input_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (reference_stream < 0) {
+        reference_stream = 0;
     }
-    if (output_ctx) {
-        if (!(output_ctx->oformat->flags & AVFMT_NOFILE)) {
-            avio_closep(&output_ctx->pb);
+    if (input_ctx->start_time != AV_NOPTS_VALUE) {
+        part_offset_us = input_ctx->start_time;
+    }
+    int64_t input_start_us = input_ctx->start_time != AV_NOPTS_VALUE ? input_ctx->start_time : 0;
+
+    if (first_part > 0) {
+        // Start from the keyframe before the first missing part; the part
+        // itself is opened at the same keyframe the earlier run rotated on
+        int64_t resume_us = (int64_t)(plan->parts[first_part].start_time * AV_TIME_BASE) + input_start_us;
+        ret = seek_to_part_start(input_ctx, job->index, resume_us);
+        if (ret < 0) {
+            fprintf(stderr, "Error seeking to part %d\n", first_part + 1);
+            goto cleanup;
+        }
+        current_part = first_part - 1;
+    } else {
+        printf("\nCreating part 1: %s\n", plan->parts[0].output_filename);
+        report_part(job, &plan->parts[0], 0);
+        ret = open_output_part(job, input_ctx, &plan->parts[0], &output_ctx);
+        if (ret < 0 || (ret = open_mux_queue(job, output_ctx, &mux)) < 0) {
+            goto cleanup;
         }
-        avformat_free_context(output_ctx);
     }
-    
+
+    ret = packet_reader_start(input_ctx, job->options->pipeline_depth, &reader);
+    if (ret < 0) {
+        goto cleanup;
+    }
+
+    while ((ret = packet_reader_next(reader, &packet)) >= 0) {
+        AVStream *input_stream = input_ctx->streams[packet->stream_index];
+        int64_t packet_ts = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+
+        if (job_cancelled(job)) {
+            av_packet_unref(packet);
+            ret = AVERROR_EXIT;
+            goto cleanup;
+        }
+
+        if (packet->stream_index == reference_stream &&
+            (packet->flags & AV_PKT_FLAG_KEY) &&
+            packet_ts != AV_NOPTS_VALUE &&
+            (current_part + 1 < plan->total_parts || streaming)) {
+            const SplitPart *part = &plan->parts[current_part];
+            int64_t packet_time_us = av_rescale_q(packet_ts, input_stream->time_base, AV_TIME_BASE_Q);
+            int64_t boundary_us = (int64_t)((part->start_time + part->duration) * AV_TIME_BASE) +
+                                  input_start_us;
+
+            if (packet_time_us + (int64_t)(KEYFRAME_TOLERANCE * AV_TIME_BASE) >= boundary_us) {
+                if (current_part + 1 == plan->total_parts) {
+                    ret = plan_append_part(job);
+                    if (ret < 0) {
+                        av_packet_unref(packet);
+                        goto cleanup;
+                    }
+                }
+                if (output_ctx) {
+                    ret = close_mux_queue(&mux, &plan->parts[current_part], &counter, 1);
+                    flush_part_counter(job, &plan->parts[current_part], &counter);
+                    TRACE_BEGIN(trailer_start);
+                    int close_ret = close_output_part(&output_ctx, 1);
+                    if (ret >= 0) {
+                        ret = close_ret;
+                    }
+                    TRACE_SPAN("trailer", current_part + 1, trailer_start);
+                    TRACE_SPAN("part", current_part + 1, part_start);
+                    if (ret >= 0) {
+                        ret = finish_output_part(job, &plan->parts[current_part], &checksum);
+                    }
+                    if (checksum.streams) {
+                        part_checksum_reset(&checksum);
+                    }
+                    if (ret < 0) {
+                        fprintf(stderr, "Error finishing part %d\n", current_part + 1);
+                        plan->parts[current_part].result = ret;
+                        report_part(job, &plan->parts[current_part], 1);
+                        av_packet_unref(packet);
+                        goto cleanup;
+                    }
+                    printf("Part %d completed successfully\n", current_part + 1);
+                    report_part(job, &plan->parts[current_part], 1);
+                }
+
+                current_part++;
+                counter.position = 0;
+                TRACE_RESTART(part_start);
+                part_offset_us = packet_time_us;
+                if (next_pending_part(plan, current_part) < 0) {
+                    // Everything after this point was written by an earlier run
+                    av_packet_unref(packet);
+                    ret = AVERROR_EOF;
+                    break;
+                }
+                if (!plan->parts[current_part].skip) {
+                    printf("\nCreating part %d: %s\n", current_part + 1,
+                           plan->parts[current_part].output_filename);
+                    report_part(job, &plan->parts[current_part], 0);
+                    ret = open_output_part(job, input_ctx, &plan->parts[current_part], &output_ctx);
+                    if (ret >= 0) {
+                        ret = open_mux_queue(job, output_ctx, &mux);
+                    }
+                    if (ret < 0) {
+                        av_packet_unref(packet);
+                        goto cleanup;
+                    }
+                }
+            }
+        }
+
+        if (!output_ctx) {
+            // Still before the first part to write, or inside one already written
+            av_packet_unref(packet);
+            continue;
+        }
+
+        double position = 0;
+        if (packet_ts != AV_NOPTS_VALUE) {
+            position = (av_rescale_q(packet_ts, input_stream->time_base, AV_TIME_BASE_Q) - input_start_us) /
+                       (double)AV_TIME_BASE - plan->parts[current_part].start_time;
+            if (plan->parts[current_part].start_time + position > input_time) {
+                input_time = plan->parts[current_part].start_time + position;
+            }
+        }
+        count_packet(job, &plan->parts[current_part], &counter, packet->size, packet->size, position);
+        if (checksum.streams) {
+            part_checksum_add(&checksum, packet);
+        }
+
+        AVStream *output_stream = output_ctx->streams[packet->stream_index];
+        int64_t offset = av_rescale_q(part_offset_us, AV_TIME_BASE_Q, input_stream->time_base);
+        if (packet->pts != AV_NOPTS_VALUE) {
+            packet->pts -= offset;
+        }
+        if (packet->dts != AV_NOPTS_VALUE) {
+            packet->dts -= offset;
+        }
+        av_packet_rescale_ts(packet, input_stream->time_base, output_stream->time_base);
+        packet->pos = -1;
+
+        TRACE_PACKET_BEGIN(write_start, packet);
+        ret = write_part_packet(output_ctx, mux, &counter, packet);
+        TRACE_PACKET_END(TRACE_STAT_WRITE, write_start);
+        av_packet_unref(packet);
+        if (ret < 0) {
+            fprintf(stderr, "Error writing packet to part %d\n", current_part + 1);
+            goto cleanup;
+        }
+    }
+    if (ret == AVERROR_EOF) {
+        ret = 0;
+    } else if (ret < 0) {
+        fprintf(stderr, "Error reading input at part %d\n", current_part + 1);
+    }
+
+    if (ret == 0 && streaming) {
+        // Only now is it known where the input ends
+        plan->parts[current_part].duration = input_time - plan->parts[current_part].start_time;
+        plan->total_duration = input_time;
+    }
+    if (ret == 0 && output_ctx) {
+        ret = close_mux_queue(&mux, &plan->parts[current_part], &counter, 1);
+        flush_part_counter(job, &plan->parts[current_part], &counter);
+        TRACE_BEGIN(trailer_start);
+        int close_ret = close_output_part(&output_ctx, 1);
+        if (ret >= 0) {
+            ret = close_ret;
+        }
+        TRACE_SPAN("trailer", current_part + 1, trailer_start);
+        TRACE_SPAN("part", current_part + 1, part_start);
+        if (ret >= 0) {
+            ret = finish_output_part(job, &plan->parts[current_part], &checksum);
+        }
+        if (ret >= 0) {
+            printf("Part %d completed successfully\n", current_part + 1);
+        }
+        plan->parts[current_part].result = ret < 0 ? ret : 0;
+        report_part(job, &plan->parts[current_part], 1);
+    }
+    if (ret >= 0 && !streaming && next_pending_part(plan, current_part + 1) >= 0) {
+        // The parts never reached were not written, the split didn't succeed
+        fprintf(stderr, "Input ended after %d of %d parts\n", current_part + 1, plan->total_parts);
+        for (int i = next_pending_part(plan, current_part + 1); i >= 0; i = next_pending_part(plan, i + 1)) {
+            plan->parts[i].result = AVERROR(EIO);
+            report_part(job, &plan->parts[i], 1);
+        }
+        ret = AVERROR(EIO);
+    }
+
+cleanup:
+    if (ret < 0 && output_ctx) {
+        plan->parts[current_part].result = ret;
+        report_part(job, &plan->parts[current_part], 1);
+    }
+    if (ret == AVERROR_EXIT) {
+        printf("Part %d cancelled, removing '%s'\n", current_part + 1,
+               plan->parts[current_part].output_filename);
+        discard_output_part(&output_ctx, &plan->parts[current_part]);
+    }
+    packet_reader_stop(&reader);
+    mux_queue_free(&mux);
+    close_output_part(&output_ctx, 0);
+    part_checksum_free(&checksum);
+    avio_file_close_input(&input_ctx);
     return ret;
 }
 
 double get_video_duration(const char* filename) {
-    AVFormatContext *fmt_ctx = NULL;
-    double duration = 0.0;
-    
-    if (avformat_open_input(&fmt_ctx, filename, NULL, NULL) < 0) {
+    MediaProbe *probe = NULL;
+    if (media_probe_get(filename, 0, &probe) < 0) {
         return -1.0;
     }
-    
-    if (avformat_find_stream_info(fmt_ctx, NULL) < 0) {
-        avformat_close_input(&fmt_ctx);
-        return -1.0;
-    }
-    
-    if (fmt_ctx->duration != AV_NOPTS_VALUE) {
-        duration = (double)fmt_ctx->duration / AV_TIME_BASE;
-    }
-    
-    avformat_close_input(&fmt_ctx);
+    double duration = probe->duration > 0 ? probe->duration : 0.0;
+    media_probe_unref(&probe);
     return duration;
 }
 
@@ -167,32 +1049,24 @@ void generate_output_filename(const char* input_filename, int part_number,
     }
 }
 
-int split_video(const char* input_filename, double chunk_max_duration, double chunk_min_duration) {
-    double total_duration = get_video_duration(input_filename);
-    if (total_duration <= 0) {
-        fprintf(stderr, "Could not get video duration\n");
-        return -1;
-    }
-    
-    printf("Total video duration: %.2f seconds (%.2f hours)\n", 
-           total_duration, total_duration / 3600.0);
-    
+// Works out where every part starts and how long it lasts. A trailing
+// remainder shorter than chunk_min_duration is merged into the previous part.
+static int plan_split(const char* input_filename, double total_duration,
+                      double chunk_max_duration, double chunk_min_duration, SplitPlan *plan) {
     // Calculate number of full chunks and remaining time
     int full_chunks = (int)(total_duration / chunk_max_duration);
     double remaining_time = total_duration - (full_chunks * chunk_max_duration);
     
-    printf("Will create %d full chunks of 4 hours each\n", full_chunks);
+    printf("Will create %d full chunks of %.2f hours each\n", full_chunks, chunk_max_duration / 3600.0);
     printf("Remaining time: %.2f seconds (%.2f minutes)\n", 
            remaining_time, remaining_time / 60.0);
     
     int total_parts;
     double last_chunk_duration;
-    int merge_last_chunk = 0;  
     if (remaining_time > 0 && remaining_time < chunk_min_duration && full_chunks > 0) {
         // Merge with previous chunk
         total_parts = full_chunks;
         last_chunk_duration = chunk_max_duration + remaining_time;
-        merge_last_chunk = 1;  
         printf("Last segment is too short (%.2f min), merging with previous chunk\n", 
                remaining_time / 60.0);
         printf("Final chunk will be %.2f hours long\n", last_chunk_duration / 3600.0);
@@ -205,34 +1079,594 @@ int split_video(const char* input_filename, double chunk_max_duration, double ch
         }
     }
     
-    // Create each part
+    plan->parts = calloc(total_parts, sizeof(SplitPart));
+    if (!plan->parts) {
+        return AVERROR(ENOMEM);
+    }
+    plan->total_parts = total_parts;
+
     for (int i = 0; i < total_parts; i++) {
-        char output_filename[512];
-        generate_output_filename(input_filename, i + 1, output_filename, sizeof(output_filename));
-    
-        double start_time = i * chunk_max_duration;
-        double duration;
-    
-        if (i == total_parts - 1 && merge_last_chunk) {
-            duration = last_chunk_duration;  // chunk duration + reaming time
-        } else if (i == total_parts - 1) {
-            duration = last_chunk_duration;  // remaining_time
+        SplitPart *part = &plan->parts[i];
+        part->number = i + 1;
+        generate_output_filename(input_filename, i + 1, part->output_filename,
+                                 sizeof(part->output_filename));
+        part->start_time = i * chunk_max_duration;
+        if (i == total_parts - 1) {
+            part->duration = last_chunk_duration;  // remaining time, or chunk + remaining time when merged
         } else {
             // Regular chunk
-            duration = chunk_max_duration;
+            part->duration = chunk_max_duration;
         }        
-        printf("\nCreating part %d: %s\n", i + 1, output_filename);
-        printf("Start time: %.2f seconds (%.2f hours)\n", start_time, start_time / 3600.0);
-        printf("Duration: %.2f seconds (%.2f hours)\n", duration, duration / 3600.0);
+    }
         
-        int ret = cut_video_segment(input_filename, output_filename, start_time, duration);
-        if (ret < 0) {
+    return 0;
+}
+
+// Packs whole GOPs into parts using the keyframe index: each part ends at the
+// last keyframe that keeps it within max_bytes and max_duration, so every
+// boundary is a keyframe. Packet bytes are scaled by the input's container
+// overhead, since the parts use the same container. A last part shorter than
+// min_duration is merged, or else takes GOPs back from the one before.
+static int plan_by_size(const char *input_filename, const KeyframeIndex *index, double total_duration,
+                        int64_t max_bytes, double max_duration, double min_duration, SplitPlan *plan) {
+    if (index->count == 0) {
+        fprintf(stderr, "No keyframes indexed, can't plan parts by size\n");
+        return AVERROR(EINVAL);
+    }
+
+    double overhead = SIZE_BUDGET_MARGIN;
+    if (index->packet_bytes > 0 && index->file_size > index->packet_bytes) {
+        overhead *= (double)index->file_size / index->packet_bytes;
+    }
+    int64_t budget = (int64_t)(max_bytes / overhead);
+
+    // Keyframe each part starts at, the first part from the start of the file
+    int *starts = malloc((index->count + 1) * sizeof(int));
+    if (!starts) {
+        return AVERROR(ENOMEM);
+    }
+    int count = 0;
+    for (int first = 0; first < index->count;) {
+        double start_time = count == 0 ? 0 : keyframe_index_time(index, first);
+        int64_t bytes = index->entries[first].gop_bytes;
+        if (bytes > budget) {
+            fprintf(stderr, "GOP at %.2f s alone is over the size limit, its part will be too\n",
+                    keyframe_index_time(index, first));
+        }
+        int end = first + 1;
+        while (end < index->count) {
+            double end_time = end + 1 < index->count ? keyframe_index_time(index, end + 1) : total_duration;
+            if (bytes + index->entries[end].gop_bytes > budget || end_time - start_time > max_duration) {
+                break;
+            }
+            bytes += index->entries[end].gop_bytes;
+            end++;
+        }
+        starts[count++] = first;
+        first = end;
+    }
+
+    if (count > 1 && total_duration - keyframe_index_time(index, starts[count - 1]) < min_duration) {
+        if (keyframe_index_bytes(index, starts[count - 2], index->count) <= budget) {
+            // As in plan_split(), a short remainder joins the previous part
+            // even past max_duration, as long as the size allows
+            printf("Last part is too short, merging it with the previous one\n");
+            count--;
+        } else {
+            int last = starts[count - 1];
+            while (last - 1 > starts[count - 2] &&
+                   total_duration - keyframe_index_time(index, last) < min_duration &&
+                   keyframe_index_bytes(index, last - 1, index->count) <= budget) {
+                last--;
+            }
+            starts[count - 1] = last;
+        }
+    }
+
+    plan->parts = calloc(count, sizeof(SplitPart));
+    if (!plan->parts) {
+        free(starts);
+        return AVERROR(ENOMEM);
+    }
+    plan->total_parts = count;
+    for (int i = 0; i < count; i++) {
+        SplitPart *part = &plan->parts[i];
+        part->number = i + 1;
+        generate_output_filename(input_filename, i + 1, part->output_filename, sizeof(part->output_filename));
+        part->start_time = i == 0 ? 0 : keyframe_index_time(index, starts[i]);
+        double end = i + 1 < count ? keyframe_index_time(index, starts[i + 1]) : total_duration;
+        part->duration = end - part->start_time;
+        int64_t bytes = keyframe_index_bytes(index, starts[i], i + 1 < count ? starts[i + 1] : index->count);
+        if (part->duration < min_duration) {
+            printf("Part %d is only %.2f minutes long to stay within the size limit\n",
+                   part->number, part->duration / 60.0);
+        }
+        printf("Part %d: %.2f hours, about %.1f MB\n", part->number, part->duration / 3600.0,
+               bytes * overhead / (1024.0 * 1024.0));
+    }
+    free(starts);
+    return 0;
+}
+
+// Moves every boundary onto the nearest keyframe so stream-copied parts start
+// on a clean GOP. Boundaries without a keyframe between their neighbours are
+// left where they were.
+static void snap_plan_to_keyframes(SplitPlan *plan, const KeyframeIndex *index, double total_duration) {
+    if (index->count == 0) {
+        return;
+    }
+
+    for (int i = 1; i < plan->total_parts; i++) {
+        double start = keyframe_index_time(index, keyframe_index_nearest(index, plan->parts[i].start_time));
+        double next = i + 1 < plan->total_parts ? plan->parts[i + 1].start_time : total_duration;
+        if (start > plan->parts[i - 1].start_time && start < next) {
+            plan->parts[i].start_time = start;
+        }
+    }
+    for (int i = 0; i < plan->total_parts; i++) {
+        double end = i + 1 < plan->total_parts ? plan->parts[i + 1].start_time : total_duration;
+        plan->parts[i].duration = end - plan->parts[i].start_time;
+    }
+    printf("Boundaries snapped to keyframes\n");
+}
+
+// Moves every boundary to the quietest audio within window seconds of it, or
+// with keyframes to the video keyframe nearest that. The window is narrowed
+// to the shortest part so boundaries can't cross.
+static int move_plan_to_silence(SplitPlan *plan, double window, int keyframes) {
+    int count = plan->total_parts - 1;
+    if (count <= 0) {
+        return 0;
+    }
+
+    for (int i = 0; i < plan->total_parts; i++) {
+        if (plan->parts[i].duration < window) {
+            window = plan->parts[i].duration;
+        }
+    }
+    double *times = malloc(count * sizeof(double));
+    if (!times) {
+        return AVERROR(ENOMEM);
+    }
+    for (int i = 0; i < count; i++) {
+        times[i] = plan->parts[i + 1].start_time;
+    }
+
+    int ret = silence_find_cuts(plan->input_filename, times, count, window, keyframes);
+    if (ret >= 0) {
+        for (int i = 0; i < count; i++) {
+            plan->parts[i + 1].start_time = times[i];
+        }
+        for (int i = 0; i < plan->total_parts; i++) {
+            double end = i + 1 < plan->total_parts ? plan->parts[i + 1].start_time : plan->total_duration;
+            plan->parts[i].duration = end - plan->parts[i].start_time;
+        }
+    }
+    free(times);
+    return ret;
+}
+
+static int split_per_part(SplitJob *job) {
+    SplitPlan *plan = job->plan;
+    for (int i = 0; i < plan->total_parts; i++) {
+        SplitPart *part = &plan->parts[i];
+        if (part->skip) {
+            continue;
+        }
+        if (job_cancelled(job)) {
+            printf("Split cancelled before part %d\n", i + 1);
+            return AVERROR_EXIT;
+        }
+
+        printf("\nCreating part %d: %s\n", i + 1, part->output_filename);
+        printf("Start time: %.2f seconds (%.2f hours)\n", part->start_time, part->start_time / 3600.0);
+        printf("Duration: %.2f seconds (%.2f hours)\n", part->duration, part->duration / 3600.0);
+        report_part(job, part, 0);
+
+        part->result = cut_part(job, part);
+        report_part(job, part, 1);
+        if (part->result < 0) {
             fprintf(stderr, "Error creating part %d\n", i + 1);
-            return ret;
+            return part->result;
         }
-        
+
         printf("Part %d completed successfully\n", i + 1);
     }
-    
+
+    return 0;
+}
+
+int split_job_cut_part(SplitJob *job, int i) {
+    SplitPart *part = &job->plan->parts[i];
+    if (part->skip) {
+        return 0;
+    }
+    if (job_cancelled(job)) {
+        part->result = AVERROR_EXIT;
+        return part->result;
+    }
+
+    printf("Creating part %d of '%s': %s (start %.2f s, duration %.2f s)\n",
+           i + 1, job->input_filename, part->output_filename, part->start_time, part->duration);
+    report_part(job, part, 0);
+    part->result = cut_part(job, part);
+    report_part(job, part, 1);
+    if (part->result < 0) {
+        fprintf(stderr, "Error creating part %d: %s\n", i + 1, av_err2str(part->result));
+    } else {
+        printf("Part %d completed successfully\n", i + 1);
+    }
+    return part->result;
+}
+
+static void *parallel_split_worker(void *arg) {
+    ParallelSplit *split = arg;
+    SplitJob *job = split->job;
+
+    for (;;) {
+        pthread_mutex_lock(&split->lock);
+        int i = split->next_part++;
+        pthread_mutex_unlock(&split->lock);
+        if (i >= job->plan->total_parts) {
+            break;
+        }
+        split_job_cut_part(job, i);
+    }
+
+    return NULL;
+}
+
+// Cuts the parts concurrently, each worker with its own input and output
+// contexts. A failing part doesn't stop the others; the first error is
+// returned once every part has been attempted.
+static int split_parallel(SplitJob *job) {
+    SplitPlan *plan = job->plan;
+    int jobs = job->options->jobs;
+    if (jobs <= 0) {
+        jobs = storage_default_jobs(job->input_filename);
+    }
+    if (jobs > plan->total_parts) {
+        jobs = plan->total_parts;
+    }
+    printf("\nCutting %d parts with %d workers\n", plan->total_parts, jobs);
+
+    ParallelSplit split = {
+        .job = job,
+        .next_part = 0,
+    };
+    pthread_mutex_init(&split.lock, NULL);
+
+    pthread_t *workers = calloc(jobs, sizeof(pthread_t));
+    if (!workers) {
+        pthread_mutex_destroy(&split.lock);
+        return AVERROR(ENOMEM);
+    }
+
+    int started = 0;
+    for (; started < jobs; started++) {
+        if (pthread_create(&workers[started], NULL, parallel_split_worker, &split) != 0) {
+            fprintf(stderr, "Could only start %d of %d workers\n", started, jobs);
+            break;
+        }
+    }
+    if (started == 0) {
+        // No thread could be created, do the work here instead
+        parallel_split_worker(&split);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    pthread_mutex_destroy(&split.lock);
+
+    int ret = 0;
+    int failed = 0;
+    for (int i = 0; i < plan->total_parts; i++) {
+        if (plan->parts[i].result < 0) {
+            failed++;
+            if (ret == 0) {
+                ret = plan->parts[i].result;
+            }
+        }
+    }
+    if (failed > 0) {
+        fprintf(stderr, "%d of %d parts failed\n", failed, plan->total_parts);
+    }
+    return ret;
+}
+
+// An input that is still growing, or a pipe, has no duration yet and probing
+// it would eat its start. The plan holds the first part only, the single pass
+// adds the others as the input arrives. The last part can't be merged with the
+// previous one, since it is only known to be last once the input ends.
+static int plan_streaming(const char* input_filename, const char *output_name, double chunk_max_duration,
+                          SplitPlan **plan_out) {
+    SplitPlan *plan = calloc(1, sizeof(SplitPlan));
+    if (!plan) {
+        return AVERROR(ENOMEM);
+    }
+    plan->input_filename = strdup(input_filename);
+    plan->output_name = strdup(output_name);
+    plan->parts = calloc(1, sizeof(SplitPart));
+    if (!plan->input_filename || !plan->output_name || !plan->parts) {
+        split_plan_free(&plan);
+        return AVERROR(ENOMEM);
+    }
+
+    plan->streaming = 1;
+    plan->total_parts = 1;
+    plan->parts[0].number = 1;
+    plan->parts[0].duration = chunk_max_duration;
+    generate_output_filename(output_name, 1, plan->parts[0].output_filename,
+                             sizeof(plan->parts[0].output_filename));
+    printf("Streaming '%s', writing a part every %.2f hours of input\n",
+           strcmp(input_filename, "-") == 0 ? "stdin" : input_filename, chunk_max_duration / 3600.0);
+
+    *plan_out = plan;
     return 0;
 }
+
+int split_plan_create(const char* input_filename, double chunk_max_duration,
+                      double chunk_min_duration, const SplitOptions *options, SplitPlan **plan_out) {
+    SplitOptions defaults;
+    if (!options) {
+        split_options_init(&defaults);
+        options = &defaults;
+    }
+
+    if (chunk_max_duration <= 0) {
+        fprintf(stderr, "Maximum part duration must be positive\n");
+        return AVERROR(EINVAL);
+    }
+
+    if (options->trace_path) {
+        TRACE_SESSION_BEGIN();
+    }
+
+    const char *output_name = options->output_name ? options->output_name : input_filename;
+    if (strcmp(output_name, "-") == 0) {
+        fprintf(stderr, "Parts of stdin need a name to be derived from\n");
+        return AVERROR(EINVAL);
+    }
+    if (options->follow > 0 || avio_file_is_stream(input_filename)) {
+        return plan_streaming(input_filename, output_name, chunk_max_duration, plan_out);
+    }
+
+    MediaProbe *probe = NULL;
+    TRACE_BEGIN(probe_start);
+    int ret = media_probe_get(input_filename, options->probe_cache, &probe);
+    TRACE_SPAN("probe", 0, probe_start);
+    if (ret < 0) {
+        return ret;
+    }
+    double total_duration = probe->duration;
+    if (total_duration <= 0) {
+        fprintf(stderr, "Could not get video duration\n");
+        media_probe_unref(&probe);
+        return -1;
+    }
+
+    printf("Total video duration: %.2f seconds (%.2f hours)\n",
+           total_duration, total_duration / 3600.0);
+
+    SplitPlan *plan = calloc(1, sizeof(SplitPlan));
+    if (!plan) {
+        media_probe_unref(&probe);
+        return AVERROR(ENOMEM);
+    }
+    plan->probe = probe;
+    plan->total_duration = total_duration;
+    plan->input_filename = strdup(input_filename);
+    plan->output_name = strdup(output_name);
+    if (!plan->input_filename || !plan->output_name) {
+        split_plan_free(&plan);
+        return AVERROR(ENOMEM);
+    }
+
+    if (options->max_part_bytes > 0) {
+        // Sizes come from the index, which also puts every cut on a keyframe
+        const KeyframeIndex *index = NULL;
+        ret = media_probe_keyframe_index(probe, &index);
+        if (ret >= 0) {
+            ret = plan_by_size(output_name, index, total_duration, options->max_part_bytes,
+                               chunk_max_duration, chunk_min_duration, plan);
+        } else {
+            fprintf(stderr, "Could not index '%s' to plan parts by size\n", input_filename);
+        }
+        if (ret < 0) {
+            split_plan_free(&plan);
+            return ret;
+        }
+        plan->index = index;
+        *plan_out = plan;
+        return 0;
+    }
+
+    ret = plan_split(output_name, total_duration, chunk_max_duration, chunk_min_duration, plan);
+    if (ret < 0) {
+        split_plan_free(&plan);
+        return ret;
+    }
+
+    // Copied parts start on the keyframe at or after their cut, which on long
+    // GOPs can be seconds past the pause that was found. Boundaries moved to
+    // silence go to the keyframe closest to it instead: from the index when
+    // one was asked for or its sidecar is already there, otherwise from the
+    // keyframes read around each window, never indexing the whole file for it.
+    int snap_silence = options->silence_window > 0 && !options->smart_render;
+    const KeyframeIndex *index = NULL;
+    if (options->use_keyframe_index || options->ts_copy) {
+        if (media_probe_keyframe_index(probe, &index) < 0) {
+            fprintf(stderr, "Could not index keyframes, cutting at the planned times\n");
+            index = NULL;
+        }
+    } else if (snap_silence && media_probe_keyframe_index_loaded(probe, &index) < 0) {
+        index = NULL;
+    }
+
+    if (options->silence_window > 0) {
+        TRACE_BEGIN(silence_start);
+        if (move_plan_to_silence(plan, options->silence_window, snap_silence && !index) < 0) {
+            fprintf(stderr, "Could not scan the audio, cutting at the planned times\n");
+        }
+        TRACE_SPAN("silence", 0, silence_start);
+    }
+
+    if (index) {
+        snap_plan_to_keyframes(plan, index, total_duration);
+        plan->index = index;
+    }
+
+    *plan_out = plan;
+    return 0;
+}
+
+int split_job_begin(SplitPlan *plan, const SplitOptions *options, SplitJob **job_out) {
+    SplitJob *job = calloc(1, sizeof(SplitJob));
+    if (!job) {
+        return AVERROR(ENOMEM);
+    }
+    job->input_filename = plan->input_filename;
+    job->options = options;
+    job->plan = plan;
+    job->index = plan->index;
+    job->probe = plan->probe;
+    job->started_at = av_gettime_relative();
+    job->part_position = calloc(plan->total_parts, sizeof(double));
+    if (!job->part_position) {
+        free(job);
+        return AVERROR(ENOMEM);
+    }
+    pthread_mutex_init(&job->progress_lock, NULL);
+
+    // A streamed input's plan keeps growing, there is nothing to resume against
+    if (options->journal && !plan->streaming && split_journal_open(plan, &job->journal) < 0) {
+        fprintf(stderr, "Continuing without a journal\n");
+    }
+    int resumed = 0;
+    for (int i = 0; i < plan->total_parts; i++) {
+        if (plan->parts[i].skip) {
+            job->part_position[i] = plan->parts[i].duration;
+            job->skipped_duration += plan->parts[i].duration;
+            job->finished_parts++;
+            resumed = 1;
+        }
+    }
+    if (options->checksum && avio_file_is_stream(plan->input_filename)) {
+        printf("A pipe can't be read again to verify, not checksumming '%s'\n", plan->input_filename);
+    } else if (options->checksum) {
+        char manifest_path[1024];
+        checksum_manifest_path(plan->input_filename, manifest_path, sizeof(manifest_path));
+        // A resumed job adds the parts it writes now to the earlier run's manifest
+        if (checksum_manifest_open(manifest_path, resumed, &job->manifest) < 0) {
+            fprintf(stderr, "Continuing without checksums\n");
+        }
+    }
+    // The manifest hashes every packet read for a part, so one the queue
+    // dropped would still verify as copied
+    job->mux_sparse = options->mux_sparse;
+    if (job->manifest && options->mux_queue_bytes > 0 && options->mux_sparse == MUX_SPARSE_DROP) {
+        printf("Checksummed parts keep every packet, writing late packets of sparse streams\n");
+        job->mux_sparse = MUX_SPARSE_HEARTBEAT;
+    }
+    // Byte ranges carry neither checksums nor re-encoded starts, and need a
+    // keyframe to cut on
+    if (options->ts_copy && plan->index && !plan->streaming && !job->manifest && !options->smart_render) {
+        int ret = ts_copy_open(plan->input_filename, &job->ts_source);
+        if (ret == AVERROR_INVALIDDATA) {
+            printf("'%s' isn't a transport stream, remuxing its parts\n", plan->input_filename);
+        } else if (ret < 0) {
+            fprintf(stderr, "Could not open '%s' to copy byte ranges, remuxing its parts\n", plan->input_filename);
+        }
+    }
+
+    *job_out = job;
+    return 0;
+}
+
+int split_job_end(SplitJob **job, int result) {
+    if (!*job) {
+        return result;
+    }
+    split_journal_close(&(*job)->journal, result >= 0);
+    checksum_manifest_close(&(*job)->manifest);
+    ts_copy_close(&(*job)->ts_source);
+    pthread_mutex_destroy(&(*job)->progress_lock);
+    free((*job)->part_position);
+    free(*job);
+    *job = NULL;
+    return result;
+}
+
+int split_plan_execute(SplitPlan *plan, const SplitOptions *options) {
+    SplitOptions defaults;
+    if (!options) {
+        split_options_init(&defaults);
+        options = &defaults;
+    }
+
+    SplitJob *job = NULL;
+    int ret = split_job_begin(plan, options, &job);
+    if (ret < 0) {
+        return ret;
+    }
+    if (options->trace_path && !TRACE_SESSION_ACTIVE()) {
+        TRACE_SESSION_BEGIN();
+    }
+
+    SplitMode mode = options->mode;
+    if (plan->streaming) {
+        // A growing input or a pipe can't be seeked, nor split ahead of what arrived
+        mode = SPLIT_MODE_SINGLE_PASS;
+    } else if (options->smart_render && mode == SPLIT_MODE_SINGLE_PASS) {
+        // A single pass can only rotate on keyframes
+        printf("Smart render cuts each part separately, using the per-part mode\n");
+        mode = SPLIT_MODE_PER_PART;
+    } else if (job->ts_source && mode == SPLIT_MODE_SINGLE_PASS) {
+        // Byte ranges are copied part by part, reading nothing in between
+        mode = SPLIT_MODE_PER_PART;
+    }
+
+    if (mode == SPLIT_MODE_PER_PART) {
+        ret = split_per_part(job);
+    } else if (mode == SPLIT_MODE_PARALLEL) {
+        ret = split_parallel(job);
+    } else {
+        ret = split_single_pass(job);
+    }
+
+    ret = split_job_end(&job, ret);
+    if (options->trace_path) {
+        TRACE_SESSION_END(options->trace_path);
+    }
+    return ret;
+}
+
+void split_plan_free(SplitPlan **plan) {
+    if (!*plan) {
+        return;
+    }
+    media_probe_unref(&(*plan)->probe);
+    free((*plan)->input_filename);
+    free((*plan)->output_name);
+    free((*plan)->parts);
+    free(*plan);
+    *plan = NULL;
+}
+
+int split_video_with_options(const char* input_filename, double chunk_max_duration,
+                             double chunk_min_duration, const SplitOptions *options) {
+    SplitPlan *plan = NULL;
+    int ret = split_plan_create(input_filename, chunk_max_duration, chunk_min_duration, options, &plan);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = split_plan_execute(plan, options);
+    split_plan_free(&plan);
+    return ret;
+}
+
+int split_video(const char* input_filename, double chunk_max_duration, double chunk_min_duration) {
+    return split_video_with_options(input_filename, chunk_max_duration, chunk_min_duration, NULL);
+}
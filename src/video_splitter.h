@@ -1,6 +1,157 @@
 #ifndef VIDEO_SPLITTER_H
 #define VIDEO_SPLITTER_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include "mux_queue.h"
+
+struct KeyframeIndex;
+struct MediaProbe;
+
+typedef enum {
+    SPLIT_MODE_SINGLE_PASS,  // read the input once, rotating the output at each boundary
+    SPLIT_MODE_PER_PART,     // reopen and seek the input for every part
+    SPLIT_MODE_PARALLEL,     // like SPLIT_MODE_PER_PART, several parts at a time
+} SplitMode;
+
+typedef struct {
+    int number;              // 1-based
+    double start_time;       // seconds from the start of the input
+    double duration;         // seconds
+    char output_filename[512];
+    int result;              // 0, or the negative AVERROR the part failed with
+    int skip;                // left out by split_plan_execute(), set for parts a journal shows as done
+} SplitPart;
+
+typedef struct {
+    char *input_filename;
+    double total_duration;
+    int total_parts;
+    SplitPart *parts;
+    struct MediaProbe *probe;            // the input as probed when planning
+    const struct KeyframeIndex *index;   // set when the plan was snapped to keyframes, owned by probe
+    char *output_name;                   // what the parts are named after, see SplitOptions.output_name
+    // Set for inputs read once as they arrive (followed ones, stdin and pipes):
+    // the plan starts with one part and grows while the single pass runs
+    int streaming;
+} SplitPlan;
+
+typedef enum {
+    SPLIT_PROGRESS_PART_STARTED,
+    SPLIT_PROGRESS_PACKETS,   // periodic update while packets are copied
+    SPLIT_PROGRESS_PART_FINISHED,
+} SplitProgressEvent;
+
+typedef struct {
+    SplitProgressEvent event;
+    const char *input;        // input the part is cut from
+    int part;                 // 1-based part the event is about
+    int total_parts;
+    int finished_parts;
+    int result;               // result of the part once it is finished
+
+    // Totals for the whole split so far
+    int64_t bytes_read;       // packet payload read from the input
+    int64_t bytes_written;    // packet payload handed to the muxers
+    double packets_per_second;
+    double current_time;      // input position of the part, in seconds
+    double fraction;          // 0..1 of the duration of the parts to write already copied
+    double eta;               // seconds left, negative while unknown
+
+    // With SplitOptions.mux_queue_bytes: what the muxing queue of the part
+    // holds, and the most any part's queue held so far
+    int mux_queue_packets;
+    int64_t mux_queue_bytes;
+    int64_t mux_queue_peak_bytes;
+} SplitProgress;
+
+typedef void (*SplitProgressCallback)(const SplitProgress*, void*);
+
+// Shared between the thread running a split and whoever may want to stop it
+typedef struct SplitCancelToken SplitCancelToken;
+
+typedef struct {
+    SplitMode mode;
+    int jobs;                // workers for SPLIT_MODE_PARALLEL, 0 picks one from the storage type
+    int use_keyframe_index;  // snap boundaries to keyframes from the <input>.kfidx sidecar
+    // Positive to also keep every part within this many bytes. Parts are then
+    // planned from the packet sizes in the keyframe index, on keyframes, and
+    // silence_window is ignored.
+    int64_t max_part_bytes;
+    // Copy the parts of an MPEG-TS input as raw byte ranges between keyframes,
+    // see ts_copy.h. Implies use_keyframe_index; parts that can't be cut that
+    // way, and any input with checksum or smart_render, are remuxed as usual.
+    int ts_copy;
+    int smart_render;        // re-encode from each cut to the next keyframe for frame-exact parts
+    // Seconds around each boundary searched for the quietest audio, 0 keeps
+    // them. Unless smart_render cuts frame-exact, the moved boundaries then
+    // go to the keyframe nearest the pause: through the keyframe index with
+    // use_keyframe_index, ts_copy or a valid sidecar, otherwise found by
+    // reading on to the next keyframe after each window.
+    double silence_window;
+    int pipeline_depth;      // packets read ahead on a demux thread, 0 reads and writes on one thread
+    int io_buffer_size;      // bytes per read/write syscall, 0 uses libavformat's file protocol
+    int io_mmap;             // map the input instead of reading it
+    int io_preallocate;      // reserve each part's estimated size on disk before writing it
+    // Positive to interleave each part's packets in a queue of at most this
+    // many bytes (see mux_queue.h) instead of av_interleaved_write_frame(),
+    // which buffers without bound while a sparse or stalled stream lags
+    int64_t mux_queue_bytes;
+    double mux_sparse_delay;     // seconds the queue waits for a silent stream (default 2)
+    MuxSparsePolicy mux_sparse;  // what happens to that stream's packets once it stopped waiting,
+                                 // always MUX_SPARSE_HEARTBEAT with checksum
+    int probe_cache;         // also keep input probes in an on-disk cache across runs
+    int journal;             // keep an <input>.vsjob journal so an interrupted split resumes where it stopped
+    int checksum;            // hash every copied packet into an <input>.vssum manifest, see checksum.h
+    const char *trace_path;  // Chrome trace written by split_plan_execute(), needs -Dtracing=true
+    // Name the parts are derived from instead of the input's (<name>_partNN.<ext>),
+    // required for stdin ("-")
+    const char *output_name;
+    // Positive to split an input that is still being recorded:
+    // parts are written in a single pass as soon as their content has arrived,
+    // and the input ends once it hasn't grown for this many seconds
+    double follow;
+
+    // Called from the splitting thread(s) when a part starts, a few times per
+    // second while it is copied, and when it ends. Calls are serialized.
+    SplitProgressCallback progress;
+    void *progress_opaque;
+
+    // Checked for every packet. A cancelled split deletes the part it was
+    // writing and returns AVERROR_EXIT.
+    SplitCancelToken *cancel;
+} SplitOptions;
+
+void split_options_init(SplitOptions*);
+
+SplitCancelToken *split_cancel_token_new(void);
+void split_cancel_token_cancel(SplitCancelToken*);
+int split_cancel_token_is_cancelled(const SplitCancelToken*);
+void split_cancel_token_free(SplitCancelToken**);
+
+// Probes the input and works out the parts without writing anything
+int split_plan_create(const char*, double, double, const SplitOptions*, SplitPlan**);
+// Writes every part of a plan, filling in SplitPart.result
+int split_plan_execute(SplitPlan*, const SplitOptions*);
+void split_plan_free(SplitPlan**);
+
+// split_plan_execute() in pieces, for callers that schedule parts themselves
+// (see scheduler.h). A job holds the progress, journal and manifest of one
+// plan; its parts may then be cut in any order and from any thread.
+typedef struct SplitJob SplitJob;
+
+int split_job_begin(SplitPlan*, const SplitOptions*, SplitJob**);
+// Cuts one part (0-based) on its own input and output contexts, as
+// SPLIT_MODE_PARALLEL does. Parts with SplitPart.skip set are left alone.
+int split_job_cut_part(SplitJob*, int);
+// Closes the journal, deleting it when result isn't negative, and the
+// checksum manifest. Returns result.
+int split_job_end(SplitJob**, int);
+
 int split_video(const char*, double, double);
+int split_video_with_options(const char*, double, double, const SplitOptions*);
+
+double get_video_duration(const char*);
+void generate_output_filename(const char*, int, char*, size_t);
 
 #endif